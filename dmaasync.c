@@ -0,0 +1,577 @@
+/*******************************************************************
+ * Asynchronous completion engine on top of the streaming (ring)
+ * mode of pciedma_patterns.c: transfers are queued without locking
+ * and without waiting, then posted in batches and completed by a
+ * dedicated thread, which runs the user callbacks and signals an
+ * eventfd. Sends are split into chunks and scheduled by priority
+ * class, so a short urgent transfer overtakes a long bulk one.
+ *******************************************************************/
+
+#include "pciedma.h"
+#include "dmaasync.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+// Tokens carry the channel in the low bit, the class above it and the sequence number of the class on top
+#define TOKEN(seq,cls,istx)	(((seq) << (ASYNC_CLASS_BITS + 1)) | ((cls) << 1) | (istx))
+#define TOKEN_SEQ(token)	((token) >> (ASYNC_CLASS_BITS + 1))
+#define TOKEN_CLASS(token)	((int)(((token) >> 1) & (ASYNC_CLASSES - 1)))
+#define TOKEN_CHAN(token)	((int)((token) & 1))
+
+/* Completed transfer, handed from the reaping code to the callbacks */
+typedef struct {
+  dma_xfer xfer;
+  int status;
+} dma_done;
+
+/* Claims a position in a submission queue and publishes a request in it. Producers only compete on the compare-and-swap of
+ * the enqueue position, never on a lock
+ * Returns: position of the request, -1 if the queue is full
+ */
+long subqPush(dma_subq *q, dma_reg *reg, unsigned int offset, unsigned int len, dma_callback cb, void *arg)
+{
+  dma_req *req;
+  unsigned long pos, seq;
+
+  pos = q->enq;
+  while(1){
+    req = &q->req[pos % ASYNC_QUEUE];
+    seq = req->seq;
+    __sync_synchronize();
+
+    if(seq == pos){
+      // Entry free for this position: claim it, unless another producer did first
+      if(__sync_bool_compare_and_swap(&q->enq, pos, pos + 1))
+        break;
+    }
+    else if((long)(seq - pos) < 0)
+      return -1; // Entry still holds the request of the previous lap
+    pos = q->enq;
+  }
+
+  req->reg = reg;
+  req->offset = offset;
+  req->len = len;
+  req->cb = cb;
+  req->arg = arg;
+
+  // The request must be complete before the completion thread can see it
+  __sync_synchronize();
+  req->seq = pos + 1;
+
+  return pos;
+}
+
+/* Returns the oldest published request of a submission queue, NULL if there is none. Completion thread only */
+dma_req *subqPeek(dma_subq *q)
+{
+  dma_req *req = &q->req[q->deq % ASYNC_QUEUE];
+
+  if(req->seq != q->deq + 1)
+    return NULL;
+  __sync_synchronize();
+
+  return req;
+}
+
+/* Releases the oldest request of a submission queue, its entry becoming free for the next lap. Completion thread only */
+void subqPop(dma_subq *q)
+{
+  dma_req *req = &q->req[q->deq % ASYNC_QUEUE];
+
+  __sync_synchronize();
+  req->seq = q->deq + ASYNC_QUEUE;
+  q->deq++;
+}
+
+/* Returns 1 if a class has a transfer waiting to be posted. Completion thread only */
+int backlogged(dma_class *c)
+{
+  return c->active || subqPeek(&c->q) != NULL;
+}
+
+/* Picks the class the next chunk of a channel comes from: the highest backlogged class with credit left in the current round.
+ * Once no backlogged class has credit left, each one is granted its share for a new round (deficit round robin), so that under
+ * load classes get the link in proportion to their shares. An idle class keeps a full share, so a transfer arriving in it is
+ * posted next if its class is the highest one waiting. Completion thread only
+ * Returns: class, -1 if nothing is waiting
+ */
+int pickClass(dma_async *as, int istx)
+{
+  dma_class *c;
+  int i, round, waiting;
+
+  for(round = 0; round < 2; round++){
+    waiting = 0;
+    for(i = 0; i < ASYNC_CLASSES; i++){
+      c = &as->cls[istx][i];
+      if(!backlogged(c)){
+        c->deficit = (long)as->share[i]*as->chunk;
+        continue;
+      }
+      waiting = 1;
+      if(c->deficit > 0)
+        return i;
+    }
+    if(!waiting)
+      return -1;
+
+    for(i = 0; i < ASYNC_CLASSES; i++)
+      as->cls[istx][i].deficit += (long)as->share[i]*as->chunk;
+  }
+
+  return -1;
+}
+
+/* Posts chunks of the queued transfers of a channel into the free slots of its ring, class by class, and hands them to the
+ * engine with a single TAILDESC write. Receive buffers are posted whole and in submission order, since the device decides
+ * which frame fills them. A chunk that fails for any reason but a full ring fails its transfer. Completion thread only, called
+ * without the lock held
+ * Returns: number of chunks posted
+ */
+int drainQueue(dma_async *as, int istx)
+{
+  dma_chan *chan = istx ? &as->ctx->snd : &as->ctx->recv;
+  dma_class *c;
+  dma_xfer *xfer;
+  dma_req *req;
+  unsigned int len;
+  int i, n, k = 0;
+
+  while(as->count[istx] < RING_SLOTS && (!istx || as->inflight[istx] < as->window)){
+    i = pickClass(as, istx);
+    if(i < 0)
+      break;
+    c = &as->cls[istx][i];
+
+    if(!c->active){
+      req = subqPeek(&c->q);
+      c->cur = *req;
+      c->cur_token = TOKEN((long)c->q.deq + 1, i, istx);
+      c->cur_off = 0;
+      c->active = 1;
+      subqPop(&c->q);
+    }
+
+    len = c->cur.len - c->cur_off;
+    if(istx && len > as->chunk)
+      len = as->chunk;
+
+    n = (len == 0) ? 0 : streamPostReg(as->ctx, istx, c->cur.reg, c->cur.offset + c->cur_off, len);
+    if(n == RING_FULL && chan->ring_count > 0)
+      break; // The chunk waits for completions; any other error fails its transfer
+
+    xfer = &as->xfer[istx][as->head[istx]];
+    xfer->token = c->cur_token;
+    xfer->ndesc = (n < 0) ? 0 : n;
+    xfer->len = (n < 0) ? 0 : len;
+    xfer->bytes = c->cur.len;
+    xfer->cb = c->cur.cb;
+    xfer->arg = c->cur.arg;
+    xfer->status = (n < 0) ? -1 : 0;
+
+    // The rest of a transfer is dropped once a chunk fails
+    c->cur_off += len;
+    xfer->last = (n < 0) || (c->cur_off >= c->cur.len);
+    if(xfer->last)
+      c->active = 0;
+    c->deficit -= len;
+
+    as->head[istx] = (as->head[istx] + 1) % RING_SLOTS;
+    as->count[istx]++;
+    as->inflight[istx] += xfer->len;
+    k++;
+  }
+
+  if(k > 0)
+    streamFlush(as->ctx, istx);
+
+  return k;
+}
+
+/* Accounts n completed descriptors (or a channel failure if n < 0) to the chunks in flight on a channel, oldest first; a
+ * transfer completes with its last chunk. Called with the lock held
+ * Returns: number of transfers completed, stored in out
+ */
+int completeXfers(dma_async *as, int istx, int n, dma_done *out)
+{
+  dma_xfer *xfer;
+  dma_class *c;
+  unsigned int tail;
+  int ndone = 0;
+
+  while(as->count[istx] > 0){
+    tail = (as->head[istx] + RING_SLOTS - as->count[istx]) % RING_SLOTS;
+    xfer = &as->xfer[istx][tail];
+
+    // Chunks that never reached the ring complete in their turn, with no descriptor to wait for
+    if(n >= 0 && xfer->status == 0){
+      if((unsigned int)n < xfer->ndesc){
+        xfer->ndesc -= n; // Chunk partially done
+        break;
+      }
+      n -= xfer->ndesc;
+    }
+
+    as->count[istx]--;
+    as->inflight[istx] -= xfer->len;
+
+    // Chunks of a class complete in order, so the failure of one is carried to the last chunk of its transfer
+    c = &as->cls[istx][TOKEN_CLASS(xfer->token)];
+    if(n < 0 || xfer->status < 0)
+      c->failed = 1;
+    if(!xfer->last)
+      continue;
+
+    out[ndone].xfer = *xfer;
+    out[ndone].status = c->failed ? -1 : 0;
+    ndone++;
+
+    c->failed = 0;
+    c->done = TOKEN_SEQ(xfer->token);
+    c->status[c->done % ASYNC_HIST] = out[ndone-1].status;
+  }
+
+  return ndone;
+}
+
+/* Reaps a channel and completes the transfers it finished; on a DMA error every transfer in flight fails and the channel
+ * is reset and put back in streaming mode. Called with the lock held
+ * Returns: number of transfers completed, stored in out
+ */
+int reapChannel(dma_async *as, int istx, dma_done *out)
+{
+  int n;
+
+  if(as->count[istx] == 0)
+    return 0;
+
+  n = streamReap(as->ctx, istx, NULL);
+  if(n >= 0)
+    return completeXfers(as, istx, n, out);
+
+  PRINT("Error: %s transfers failed, restarting the channel\n", istx ? "MM2S" : "S2MM");
+  n = completeXfers(as, istx, -1, out);
+
+  stopStream(as->ctx, istx);
+  if(istx)
+    MM2Sreset(as->ctx);
+  else
+    S2MMreset(as->ctx);
+  if(startStream(as->ctx, istx) < 0){
+    PRINT("Error: Could not restart the %s channel\n", istx ? "MM2S" : "S2MM");
+    as->running = 0;
+  }
+
+  return n;
+}
+
+/* Backs off when nothing completed, following the wait policy of the channels. Called without the lock held */
+void backOff(dma_async *as, unsigned long idle_ns)
+{
+  dma_chan *chan;
+  int i;
+
+  // Block on the interrupt if a channel in interrupt mode is bound to raise one
+  for(i = 0; i < 2; i++){
+    chan = i ? &as->ctx->snd : &as->ctx->recv;
+    if(as->count[i] == 0 || chan->wait.mode != DMA_WAIT_IRQ || idle_ns < chan->wait.spin_ns)
+      continue;
+    if(chan->irq_en && (chan->irq_delay || chan->ring_count >= chan->irq_threshold)){
+      if(as->ctx->ops->wait_irq(as->ctx->dev) < 0){
+        PRINT("Error: Could not wait for interrupt, falling back to sleeping\n");
+        chan->wait.mode = DMA_WAIT_SLEEP;
+      }
+      return;
+    }
+  }
+
+  // Otherwise the channel with the tightest budget decides between spinning and sleeping
+  chan = (as->ctx->recv.wait.spin_ns >= as->ctx->snd.wait.spin_ns) ? &as->ctx->recv : &as->ctx->snd;
+  if(chan->wait.mode == DMA_WAIT_SPIN || idle_ns < chan->wait.spin_ns)
+    return;
+
+  usleep(chan->wait.sleep_us);
+}
+
+/* Returns 1 if a class of the engine has a transfer waiting to be posted. Completion thread only */
+int queued(dma_async *as)
+{
+  int i;
+
+  for(i = 0; i < ASYNC_CLASSES; i++)
+    if(backlogged(&as->cls[0][i]) || backlogged(&as->cls[1][i]))
+      return 1;
+
+  return 0;
+}
+
+void *completionThread(void *arg)
+{
+  dma_async *as = (dma_async*)arg;
+  dma_done done[2*RING_SLOTS];
+  struct timespec start, now;
+  unsigned long long one = 1;
+  int i, ndone, nposted;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&as->lock);
+  while(as->running || as->count[0] > 0 || as->count[1] > 0 || queued(as)){
+    if(as->count[0] == 0 && as->count[1] == 0 && !queued(as)){
+      // Submitters take the lock to wake the thread only once it has announced it is going idle
+      as->idle = 1;
+      __sync_synchronize();
+      if(as->running && !queued(as))
+        pthread_cond_wait(&as->cond, &as->lock);
+      as->idle = 0;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      continue;
+    }
+    pthread_mutex_unlock(&as->lock);
+
+    // Queued requests go to the engine in batches, one TAILDESC write per channel
+    nposted = drainQueue(as, 0);
+    nposted += drainQueue(as, 1);
+
+    // Interrupts are acknowledged before reaping so that no completion is left without a pending interrupt
+    ackIRQ(as->ctx, 0);
+    ackIRQ(as->ctx, 1);
+
+    pthread_mutex_lock(&as->lock);
+
+    // Every completed descriptor is reaped, however many an interrupt covered
+    ndone = reapChannel(as, 0, done);
+    ndone += reapChannel(as, 1, done + ndone);
+
+    if(ndone == 0){
+      // Submitters blocked on a full queue may go on
+      if(nposted > 0)
+        pthread_cond_broadcast(&as->cond);
+      pthread_mutex_unlock(&as->lock);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if(nposted == 0)
+        backOff(as, (now.tv_sec - start.tv_sec)*1000000000UL + now.tv_nsec - start.tv_nsec);
+      pthread_mutex_lock(&as->lock);
+      continue;
+    }
+
+    // Wake submitters waiting for queue entries and threads in asyncWait()
+    pthread_cond_broadcast(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+
+    for(i = 0; i < ndone; i++){
+      if(done[i].xfer.cb != NULL)
+        done[i].xfer.cb(done[i].xfer.token, done[i].status, done[i].xfer.bytes, done[i].xfer.arg);
+      if(as->efd >= 0 && write(as->efd, &one, sizeof(one)) != sizeof(one))
+        PRINT("Error: Could not signal eventfd\n");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&as->lock);
+  }
+  as->stopped = 1;
+  pthread_cond_broadcast(&as->cond);
+  pthread_mutex_unlock(&as->lock);
+
+  return NULL;
+}
+
+int asyncInit(dma_async *as, dma_ctx *ctx, int use_eventfd)
+{
+  int i, j, k;
+
+  memset(as, 0, sizeof(dma_async));
+  as->ctx = ctx;
+  as->efd = -1;
+
+  as->chunk = ASYNC_CHUNK_DEF;
+  as->window = ASYNC_WINDOW_DEF;
+  for(k = 0; k < ASYNC_CLASSES; k++)
+    as->share[k] = 1 << (ASYNC_CLASSES - 1 - k);
+
+  // Every queue entry starts free for the position of the first lap
+  for(i = 0; i < 2; i++)
+    for(k = 0; k < ASYNC_CLASSES; k++)
+      for(j = 0; j < ASYNC_QUEUE; j++)
+        as->cls[i][k].q.req[j].seq = j;
+
+  if(use_eventfd){
+    as->efd = eventfd(0, 0);
+    if(as->efd < 0){
+      PRINT("Error: Could not create eventfd\n");
+      return -1;
+    }
+  }
+
+  if(startStream(ctx, 1) < 0 || startStream(ctx, 0) < 0){
+    PRINT("Error: Could not put the channels in streaming mode\n");
+    goto err;
+  }
+
+  pthread_mutex_init(&as->lock, NULL);
+  pthread_cond_init(&as->cond, NULL);
+  as->running = 1;
+
+  if(pthread_create(&as->thread, NULL, completionThread, as) != 0){
+    PRINT("Error: Could not start the completion thread\n");
+    pthread_mutex_destroy(&as->lock);
+    pthread_cond_destroy(&as->cond);
+    goto err;
+  }
+
+  return 0;
+
+err:
+  stopStream(ctx, 1);
+  stopStream(ctx, 0);
+  if(as->efd >= 0)
+    close(as->efd);
+  as->efd = -1;
+  return -1;
+}
+
+long asyncSubmit(dma_async *as, int istx, dma_reg *reg, unsigned int offset, unsigned int len, dma_callback cb, void *arg)
+{
+  return asyncSubmitClass(as, istx, ASYNC_CLASS_BULK, reg, offset, len, cb, arg);
+}
+
+long asyncSubmitClass(dma_async *as, int istx, int cls, dma_reg *reg, unsigned int offset, unsigned int len, dma_callback cb,
+                      void *arg)
+{
+  dma_subq *q;
+  long pos;
+
+  istx = istx ? 1 : 0;
+
+  if(cls < 0 || cls >= ASYNC_CLASSES){
+    PRINT("Error: Priority class %d out of range\n", cls);
+    return -1;
+  }
+
+  // The device decides which frame fills a receive buffer, so receives keep a single submission order
+  if(!istx)
+    cls = ASYNC_CLASS_BULK;
+  q = &as->cls[istx][cls].q;
+
+  if(!as->running){
+    PRINT("Error: Completion engine is stopped\n");
+    return -1;
+  }
+
+  pos = subqPush(q, reg, offset, len, cb, arg);
+  if(pos < 0){
+    // Queue full: wait for the completion thread to move requests into the ring
+    pthread_mutex_lock(&as->lock);
+    while((pos = subqPush(q, reg, offset, len, cb, arg)) < 0 && !as->stopped)
+      pthread_cond_wait(&as->cond, &as->lock);
+    pthread_mutex_unlock(&as->lock);
+
+    if(pos < 0){
+      PRINT("Error: Completion engine is stopped\n");
+      return -1;
+    }
+  }
+
+  // A busy completion thread picks the request up on its own; an idle one must be woken
+  __sync_synchronize();
+  if(as->idle){
+    pthread_mutex_lock(&as->lock);
+    pthread_cond_broadcast(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+  }
+
+  return TOKEN(pos + 1, cls, istx);
+}
+
+int asyncSetQos(dma_async *as, unsigned int chunk, unsigned int window, const unsigned int *share)
+{
+  int i;
+
+  if(chunk < 4 || chunk % 4 != 0 || window < chunk){
+    PRINT("Error: Chunks must be a non-zero multiple of 4 bytes and fit the window\n");
+    return -1;
+  }
+
+  if(share != NULL){
+    for(i = 0; i < ASYNC_CLASSES; i++){
+      if(share[i] == 0){
+        PRINT("Error: Class %d would never be served\n", i);
+        return -1;
+      }
+    }
+    memcpy(as->share, share, sizeof(as->share));
+  }
+
+  as->chunk = chunk;
+  as->window = window;
+
+  return 0;
+}
+
+int asyncPoll(dma_async *as, long token)
+{
+  dma_class *c = &as->cls[TOKEN_CHAN(token)][TOKEN_CLASS(token)];
+  int ret;
+
+  pthread_mutex_lock(&as->lock);
+  if(TOKEN_SEQ(token) > c->done)
+    ret = 0;
+  else
+    ret = (c->status[TOKEN_SEQ(token) % ASYNC_HIST] < 0) ? -1 : 1;
+  pthread_mutex_unlock(&as->lock);
+
+  return ret;
+}
+
+int asyncWait(dma_async *as, long token)
+{
+  dma_class *c = &as->cls[TOKEN_CHAN(token)][TOKEN_CLASS(token)];
+  int ret;
+
+  pthread_mutex_lock(&as->lock);
+  while(TOKEN_SEQ(token) > c->done){
+    if(as->stopped){
+      pthread_mutex_unlock(&as->lock);
+      return -1; // Engine stopped, the transfer will never complete
+    }
+    pthread_cond_wait(&as->cond, &as->lock);
+  }
+  ret = c->status[TOKEN_SEQ(token) % ASYNC_HIST];
+  pthread_mutex_unlock(&as->lock);
+
+  return ret;
+}
+
+int asyncEventFd(dma_async *as)
+{
+  return as->efd;
+}
+
+int asyncStop(dma_async *as)
+{
+  pthread_mutex_lock(&as->lock);
+  as->running = 0;
+  pthread_cond_broadcast(&as->cond);
+  pthread_mutex_unlock(&as->lock);
+
+  // The completion thread drains the queued transfers and those in flight before exiting
+  pthread_join(as->thread, NULL);
+
+  pthread_cond_broadcast(&as->cond);
+  pthread_mutex_destroy(&as->lock);
+  pthread_cond_destroy(&as->cond);
+
+  stopStream(as->ctx, 1);
+  stopStream(as->ctx, 0);
+
+  if(as->efd >= 0)
+    close(as->efd);
+  as->efd = -1;
+
+  return 0;
+}
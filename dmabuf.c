@@ -0,0 +1,211 @@
+/*******************************************************************
+ * DMA buffer allocator: buffers backed by hugepages (with fallback
+ * to regular pages), pinned and registered with a DMA context, and
+ * pools of contiguous kernel buffers that need no pinning at all.
+ *******************************************************************/
+
+#define _GNU_SOURCE
+#include "pciedma.h"
+#include "dmabuf.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT		26
+#endif
+#define MAP_HUGE_2MB_FLAG	(21 << MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB_FLAG	(30 << MAP_HUGE_SHIFT)
+
+/* Maps anonymous memory with the given page size, rounding the size up to it
+ * Returns: pointer to the memory, NULL if the pages are not available
+ */
+void *mapPages(size_t size, size_t page, int huge_flags, size_t *alloc_size)
+{
+  void *p;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  *alloc_size = (size + page - 1) & ~(page - 1);
+
+#ifdef MAP_HUGETLB
+  // Hugepages are reserved up front so that a short pool fails here and not on first touch
+  if(huge_flags)
+    flags |= MAP_HUGETLB | MAP_POPULATE | huge_flags;
+#else
+  if(huge_flags)
+    return NULL;
+#endif
+
+  p = mmap(NULL, *alloc_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if(p == MAP_FAILED)
+    return NULL;
+
+  return p;
+}
+
+int dmabufAlloc(dma_ctx *ctx, size_t size, int flags, dma_buf *buf)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  memset(buf, 0, sizeof(dma_buf));
+
+  if(size == 0 || size > 0xFFFFFFFF){
+    PRINT("Error: Buffer size must be within 1 byte and 4 GB\n");
+    return -1;
+  }
+
+  // A hugepage larger than the buffer wastes the rest of it, so it is only used when no smaller backing is allowed
+  if((flags & DMABUF_HUGE_1G) && (size >= 1UL << 30 || !(flags & (DMABUF_HUGE_2M | DMABUF_PAGES))) &&
+     (buf->vaddr = mapPages(size, 1UL << 30, MAP_HUGE_1GB_FLAG, &buf->alloc_size)) != NULL)
+    buf->kind = DMABUF_HUGE_1G;
+  else if((flags & DMABUF_HUGE_2M) && (size >= 1UL << 21 || !(flags & DMABUF_PAGES)) &&
+	  (buf->vaddr = mapPages(size, 1UL << 21, MAP_HUGE_2MB_FLAG, &buf->alloc_size)) != NULL)
+    buf->kind = DMABUF_HUGE_2M;
+  else if((flags & DMABUF_PAGES) && (buf->vaddr = mapPages(size, page, 0, &buf->alloc_size)) != NULL){
+    buf->kind = DMABUF_PAGES;
+#ifdef MADV_HUGEPAGE
+    madvise(buf->vaddr, buf->alloc_size, MADV_HUGEPAGE); // Let the kernel back it with transparent hugepages if it can
+#endif
+  }
+  else{
+    PRINT("Error: Could not allocate a %lu bytes DMA buffer\n", (unsigned long)size);
+    return -1;
+  }
+
+  buf->size = size;
+
+  if(registerBuffer(ctx, buf->vaddr, size, &buf->reg) < 0){
+    munmap(buf->vaddr, buf->alloc_size);
+    buf->vaddr = NULL;
+    return -1;
+  }
+
+  buf->nsegs = buf->reg->um.nents;
+
+  PRINT("DMA buffer of %lu bytes on %s pages: %d physical segments\n", (unsigned long)size,
+	buf->kind == DMABUF_HUGE_1G ? "1 GB" : buf->kind == DMABUF_HUGE_2M ? "2 MB" : "regular", buf->nsegs);
+
+  return 0;
+}
+
+int dmabufFree(dma_ctx *ctx, dma_buf *buf)
+{
+  int ret = 0;
+
+  if(buf->vaddr == NULL)
+    return -1;
+
+  if(buf->reg != NULL && unregisterBuffer(ctx, buf->reg) < 0)
+    ret = -1;
+  buf->reg = NULL;
+
+  if(munmap(buf->vaddr, buf->alloc_size) < 0){
+    PRINT("Error: Could not release DMA buffer\n");
+    ret = -1;
+  }
+  buf->vaddr = NULL;
+
+  return ret;
+}
+
+int kpoolInit(dma_ctx *ctx, dma_kpool *pool, int nbufs, unsigned int size)
+{
+  dma_kbuf *kb;
+  int i;
+
+  memset(pool, 0, sizeof(dma_kpool));
+
+  if(nbufs <= 0 || size == 0 || size > KPOOL_SIZE_MAX){
+    PRINT("Error: Pool buffers must be within 1 byte and %d bytes\n", KPOOL_SIZE_MAX);
+    return -1;
+  }
+
+  pool->bufs = (dma_kbuf*)calloc(nbufs, sizeof(dma_kbuf));
+  if(pool->bufs == NULL){
+    PRINT("Error: Could not malloc kernel buffer pool\n");
+    return -1;
+  }
+  pool->size = size;
+  pool->ctx = ctx;
+
+  for(i = 0; i < nbufs; i++){
+    kb = &pool->bufs[i];
+
+    kb->vaddr = ctx->ops->alloc_kmem(ctx->dev, size, &kb->km);
+    if(kb->vaddr == NULL){
+      PRINT("Error: Could not allocate kernel buffer %d\n", i);
+      goto err;
+    }
+    pool->nbufs++;
+
+    // The whole buffer must be reachable through one AXI2PCIE window
+    if((kb->km.pa & AXI2PCIE_MASK) != ((kb->km.pa + size - 1) & AXI2PCIE_MASK)){
+      PRINT("Error: Kernel buffer %d at %08lx crosses an AXI2PCIE window\n", i, kb->km.pa);
+      goto err;
+    }
+
+    kb->size = size;
+    kb->base_axi2pcie = kb->km.pa & AXI2PCIE_MASK;
+    kb->axi_addr = kb->km.pa - kb->base_axi2pcie + AXI_PCIE;
+  }
+
+  PRINT("Kernel buffer pool: %d buffers of %d bytes\n", nbufs, size);
+
+  return 0;
+
+err:
+  kpoolFree(pool);
+  return -1;
+}
+
+dma_kbuf *kpoolGet(dma_kpool *pool)
+{
+  dma_kbuf *kb;
+  int i;
+
+  for(i = 0; i < pool->nbufs; i++){
+    kb = &pool->bufs[(pool->next + i) % pool->nbufs];
+    if(!kb->in_use){
+      kb->in_use = 1;
+      pool->next = (pool->next + i + 1) % pool->nbufs;
+      return kb;
+    }
+  }
+
+  return NULL;
+}
+
+int kpoolPut(dma_kpool *pool, dma_kbuf *kb)
+{
+  if(kb < pool->bufs || kb >= pool->bufs + pool->nbufs || !kb->in_use){
+    PRINT("Error: Buffer does not belong to the pool or is not in use\n");
+    return -1;
+  }
+
+  kb->in_use = 0;
+
+  return 0;
+}
+
+int kpoolFree(dma_kpool *pool)
+{
+  int i, ret = 0;
+
+  if(pool->bufs == NULL)
+    return -1;
+
+  for(i = 0; i < pool->nbufs; i++){
+    if(pool->ctx->ops->free_kmem(pool->ctx->dev, &pool->bufs[i].km) < 0){
+      PRINT("Error: Could not release kernel buffer %d\n", i);
+      ret = -1;
+    }
+  }
+
+  free(pool->bufs);
+  pool->bufs = NULL;
+  pool->nbufs = 0;
+
+  return ret;
+}
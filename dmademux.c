@@ -0,0 +1,179 @@
+/*******************************************************************
+ * Receive demultiplexer: keeps the S2MM ring supplied with kernel
+ * pool buffers and sorts the frames of many producers into one
+ * queue per stream, using the TDEST/TID written back by the engine.
+ *******************************************************************/
+
+#include "pciedma.h"
+#include "dmademux.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Posts free pool buffers to the S2MM ring until the ring or the pool runs out
+ * Returns: 0 on success, -1 on error
+ */
+int demuxPost(dma_demux *dmx)
+{
+  dma_chan *chan = &dmx->ctx->recv;
+  dma_kbuf *kb;
+  int n;
+
+  while(chan->ring_count < RING_SLOTS - 1){
+    kb = kpoolGet(dmx->pool);
+    if(kb == NULL)
+      return 0;
+
+    n = streamSubmitKbuf(dmx->ctx, 0, kb, 0, kb->size);
+    if(n != 1){
+      if(n > 1)
+        PRINT("Error: Pool buffers of %d bytes take %d descriptors, frames could share a buffer\n", kb->size, n);
+      kpoolPut(dmx->pool, kb);
+      return -1;
+    }
+
+    dmx->posted[(dmx->posted_head + dmx->posted_count) % RING_SLOTS] = kb;
+    dmx->posted_count++;
+  }
+
+  return 0;
+}
+
+int demuxInit(dma_ctx *ctx, dma_demux *dmx, dma_kpool *pool, int key)
+{
+  int i;
+
+  memset(dmx, 0, sizeof(dma_demux));
+  dmx->ctx = ctx;
+  dmx->pool = pool;
+  dmx->key = key;
+
+  if(pool->nbufs > DEMUX_DEPTH){
+    PRINT("Error: A stream queue holds at most %d buffers, the pool has %d\n", DEMUX_DEPTH, pool->nbufs);
+    return -1;
+  }
+
+  for(i = 0; i < pool->nbufs; i++){
+    if(pool->bufs[i].in_use){
+      PRINT("Error: Buffer %d of the pool is in use\n", i);
+      return -1;
+    }
+    if(pool->bufs[i].base_axi2pcie != pool->bufs[0].base_axi2pcie){
+      PRINT("Error: Buffer %d of the pool lies in another AXI2PCIE window\n", i);
+      return -1;
+    }
+  }
+
+  if(startStream(ctx, 0) < 0)
+    return -1;
+
+  if(demuxPost(dmx) < 0){
+    demuxStop(dmx);
+    return -1;
+  }
+
+  return 0;
+}
+
+int demuxPoll(dma_demux *dmx, int wait)
+{
+  dma_compl compl[RING_SLOTS];
+  dma_fragq *q;
+  dma_frag *frag;
+  int i, n, stream;
+
+  n = wait ? streamWaitCompl(dmx->ctx, 0, compl, RING_SLOTS, NULL) : streamReapCompl(dmx->ctx, 0, compl, RING_SLOTS, NULL);
+  if(n < 0)
+    return -1;
+
+  // Descriptors complete in ring order, which is the order the buffers were posted in
+  for(i = 0; i < n; i++){
+    stream = (dmx->key == DEMUX_BY_TID) ? (compl[i].mc & TID) >> TID_SHIFT : compl[i].mc & TDEST;
+    q = &dmx->q[stream];
+
+    frag = &q->frag[(q->head + q->count) % DEMUX_DEPTH];
+    frag->kb = dmx->posted[dmx->posted_head];
+    frag->len = compl[i].status & STATUS_TRANSF;
+    frag->tdest = compl[i].mc & TDEST;
+    frag->tid = (compl[i].mc & TID) >> TID_SHIFT;
+    frag->sof = (compl[i].status & STATUS_RXSOF) != 0;
+    frag->eof = (compl[i].status & STATUS_RXEOF) != 0;
+    q->count++; // The pool is never larger than a queue, see demuxInit()
+
+    dmx->posted_head = (dmx->posted_head + 1) % RING_SLOTS;
+    dmx->posted_count--;
+  }
+
+  if(demuxPost(dmx) < 0)
+    return -1;
+
+  return n;
+}
+
+int demuxRecv(dma_demux *dmx, int stream, dma_frag *frag, int wait)
+{
+  dma_fragq *q;
+
+  if(stream < 0 || stream >= DEMUX_STREAMS){
+    PRINT("Error: Stream %d out of range\n", stream);
+    return -1;
+  }
+  q = &dmx->q[stream];
+
+  // Completions of every stream are routed on the way, whichever stream the caller waits for
+  if(demuxPoll(dmx, 0) < 0)
+    return -1;
+
+  while(q->count == 0){
+    if(!wait)
+      return 0;
+
+    if(dmx->posted_count == 0){
+      PRINT("Error: No buffer left to receive stream %d, fragments of other streams must be released\n", stream);
+      return -1;
+    }
+
+    if(demuxPoll(dmx, 1) < 0)
+      return -1;
+  }
+
+  *frag = q->frag[q->head];
+  q->head = (q->head + 1) % DEMUX_DEPTH;
+  q->count--;
+
+  return 1;
+}
+
+int demuxRelease(dma_demux *dmx, dma_frag *frag)
+{
+  if(kpoolPut(dmx->pool, frag->kb) < 0)
+    return -1;
+
+  frag->kb = NULL;
+
+  // The buffer is posted right away if the ring had run dry
+  return demuxPost(dmx);
+}
+
+int demuxStop(dma_demux *dmx)
+{
+  dma_fragq *q;
+  int i, ret;
+
+  ret = stopStream(dmx->ctx, 0);
+
+  for(; dmx->posted_count > 0; dmx->posted_count--){
+    kpoolPut(dmx->pool, dmx->posted[dmx->posted_head]);
+    dmx->posted_head = (dmx->posted_head + 1) % RING_SLOTS;
+  }
+
+  for(i = 0; i < DEMUX_STREAMS; i++){
+    q = &dmx->q[i];
+    for(; q->count > 0; q->count--){
+      kpoolPut(dmx->pool, q->frag[q->head].kb);
+      q->head = (q->head + 1) % DEMUX_DEPTH;
+    }
+  }
+
+  return ret;
+}
@@ -53,6 +53,7 @@ int main()
   unsigned int *data_samples;
   int i;
   pd_device_t dev;
+  dma_ctx ctx;
   void *memr;
   
  printf("FFT computation demonstration\n");
@@ -72,50 +73,50 @@ int main()
 // for(i=0;i<64;i++)
 //   printf("%d: %08x\n",i,data_samples[i]);
  
- if(initDMA(&dev) < 0)
+ if(initDMA(&ctx, &dev) < 0)
    printf("Init DMA failed\n");
  
- FFTreset();
- //configFFT(10,0x2AA,0);
+ FFTreset(&ctx);
+ //configFFT(&ctx, 10,0x2AA,0);
  
-// if(setFFTfwdinv(1) < 0)
+// if(setFFTfwdinv(&ctx, 1) < 0)
 //   printf("Could not set FFT direction\n");
  
-// if(setFFTscaling(0x2AA) < 0)
+// if(setFFTscaling(&ctx, 0x2AA) < 0)
 //   printf("Could not set FFT scaling\n");
  
    
-// if(setFFTsize(10) < 0)
+// if(setFFTsize(&ctx, 10) < 0)
 //   printf("Could not set FFT size\n");
    
-//   printf("FFT Status: %08x\n",readFFTstatus());
+//   printf("FFT Status: %08x\n",readFFTstatus(&ctx));
 
     
  
- if(setupSend(&dev, (void*)data_samples, sizeof(unsigned int)*NSAMPLES,3) < 0)
+ if(setupSend(&ctx, (void*)data_samples, sizeof(unsigned int)*NSAMPLES,3) < 0)
    printf("Setup Send failed\n");
  
- if(startSend(&dev, 0) < 0)
+ if(startSend(&ctx, 0) < 0)
    printf("DMA Send failed\n");
 
- if(checkSend() < 0)
+ if(checkSend(&ctx) < 0)
    printf("Check DMA send failed\n");
  
 
 
- freeSend(&dev);
+ freeSend(&ctx);
 
  // Receive result
  
- setupRecv(&dev, memr, sizeof(unsigned int)*NSAMPLES);
+ setupRecv(&ctx, memr, sizeof(unsigned int)*NSAMPLES);
 
- startRecv(&dev, 1);
+ startRecv(&ctx, 1);
 
- checkRecv();
+ checkRecv(&ctx);
  
- freeRecv(&dev);
+ freeRecv(&ctx);
 
- stopDMA(&dev);
+ stopDMA(&ctx);
 
  
  for(i=0;i<64;i++)
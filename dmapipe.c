@@ -0,0 +1,130 @@
+/*******************************************************************
+ * Send/receive pipeline: streams large host buffers through the
+ * device chunk by chunk, keeping both channels busy by overlapping
+ * the setup of the next chunk with the transfer of the current one.
+ *******************************************************************/
+
+#include "pciedma.h"
+#include "dmapipe.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Posts as many chunks of a registered buffer as the ring of a channel can take
+ * Returns: 0 on success, -1 on error
+ */
+int pipePost(dma_ctx *ctx, int istx, dma_reg *reg, unsigned int *offset, unsigned int size, unsigned int chunk)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  unsigned int len;
+  int ret;
+
+  while(*offset < size){
+    len = (size - *offset < chunk) ? size - *offset : chunk;
+
+    ret = streamSubmitReg(ctx, istx, reg, *offset, len);
+    if(ret < 0){
+      if(ret == RING_FULL && chan->ring_count > 0)
+        return 0; // Nothing was posted, the chunk goes in once slots are recycled
+
+      PRINT("Error: Could not post a %d bytes chunk at offset %d\n", len, *offset);
+      return -1;
+    }
+
+    *offset += len;
+  }
+
+  return 0;
+}
+
+int pipeStreamReg(dma_ctx *ctx, dma_reg *sreg, unsigned int in_size, dma_reg *rreg, unsigned int out_size, unsigned int chunk, int str_dest)
+{
+  unsigned int tx_off = 0, rx_off = 0, tx_bytes = 0, rx_bytes = 0, bytes;
+  unsigned long long t0;
+  int istx, ret = -1;
+
+  if(chunk == 0)
+    chunk = PIPE_CHUNK_DEF;
+
+  if(sreg == NULL || rreg == NULL || in_size > sreg->size || out_size > rreg->size){
+    PRINT("Error: Pipeline sizes exceed the registered buffers\n");
+    return -1;
+  }
+
+  // A single AXI2PCIE window is shared by both channels while they run together
+  if(sreg->nwin > 1 || rreg->nwin > 1 || sreg->base_axi2pcie != rreg->base_axi2pcie){
+    PRINT("Error: Input and output buffers must fall in a single, common AXI2PCIE window\n");
+    return -1;
+  }
+
+  ctx->dest_tx = str_dest;
+
+  if(startStream(ctx, 0) < 0)
+    return -1;
+  if(startStream(ctx, 1) < 0){
+    stopStream(ctx, 0);
+    return -1;
+  }
+
+  while(tx_off < in_size || rx_off < out_size || ctx->snd.ring_count > 0 || ctx->recv.ring_count > 0){
+    // Send slots are recycled before posting: a slot freed after the last post could leave the send ring empty with data
+    // still to go while we sleep on a receive that waits for that data
+    if(streamReap(ctx, 1, &bytes) < 0)
+      goto out;
+    tx_bytes += bytes;
+
+    // Receive chunks go first so the S2MM channel is ready before the results of the matching send chunk come back
+    if(pipePost(ctx, 0, rreg, &rx_off, out_size, chunk) < 0)
+      goto out;
+    if(pipePost(ctx, 1, sreg, &tx_off, in_size, chunk) < 0)
+      goto out;
+
+    // Wait on the output side while it has work, otherwise on the input side
+    istx = (ctx->recv.ring_count > 0) ? 0 : 1;
+    if(streamWait(ctx, istx, &bytes) < 0)
+      goto out;
+    if(istx)
+      tx_bytes += bytes;
+    else
+      rx_bytes += bytes;
+  }
+
+  PRINT("Pipeline: %d bytes sent, %d bytes received\n", tx_bytes, rx_bytes);
+  ret = 0;
+
+out:
+  stopStream(ctx, 1);
+  stopStream(ctx, 0);
+
+  // Nothing to sync if the device wrote nothing
+  if(ret == 0 && rx_bytes > 0){
+    t0 = traceStart(ctx);
+    if(ctx->ops->sync_umem(ctx->dev, &rreg->um, PD_DIR_FROMDEVICE) < 0){
+      PRINT("Error: Could not sync user memory\n");
+      ret = -1;
+    }
+    traceEnd(ctx, t0, TRACE_SYNC, 0, rx_bytes);
+  }
+
+  return ret;
+}
+
+int pipeStream(dma_ctx *ctx, void *in, unsigned int in_size, void *out, unsigned int out_size, unsigned int chunk, int str_dest)
+{
+  dma_reg *sreg, *rreg;
+  int ret;
+
+  if(registerBuffer(ctx, in, in_size, &sreg) < 0)
+    return -1;
+
+  if(registerBuffer(ctx, out, out_size, &rreg) < 0){
+    unregisterBuffer(ctx, sreg);
+    return -1;
+  }
+
+  ret = pipeStreamReg(ctx, sreg, in_size, rreg, out_size, chunk, str_dest);
+
+  unregisterBuffer(ctx, rreg);
+  unregisterBuffer(ctx, sreg);
+
+  return ret;
+}
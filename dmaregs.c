@@ -0,0 +1,84 @@
+/*******************************************************************
+ * Register access layer: registers that only the host writes are
+ * shadowed in the context, so read-modify-write updates turn into
+ * posted writes; status registers always come from the device.
+ *******************************************************************/
+
+#include "pciedma.h"
+#include "fftcontrol.h"
+
+/* Write-owned registers, by byte offset in BAR0; bit i of reg_valid covers reg_shadow[i] */
+const unsigned int reg_owned[REG_OWNED] = {
+  DMA_BASE + MM2S_DMACR,	// DMACR.RESET self-clears: reset waits poll the device, then regInvalidate()
+  DMA_BASE + S2MM_DMACR,
+  AXIBAR2PCIEBAR0,
+  CMU_BASE + CMU_KCR,
+  CMU_BASE + CMU_KCML,
+  CMU_BASE + CMU_KCMH,
+  FFT_BASE			// FFT control word
+};
+
+/* Returns the shadow slot of a register, -1 if the register is not write-owned */
+int regSlot(unsigned int offset)
+{
+  int i;
+
+  for(i = 0; i < REG_OWNED; i++)
+    if(reg_owned[i] == offset)
+      return i;
+
+  return -1;
+}
+
+/* Reads a register of BAR0. Registers only the host writes (DMACR of both channels, AXIBAR2PCIEBAR0, CMU KCR/KCML/KCMH and
+ * the FFT control word) are served from a host shadow once it holds their value, so that a read-modify-write costs a
+ * single posted write instead of a non-posted read round trip; status registers are always read from the device
+ * Arguments: ctx - DMA context
+ * 	      offset - byte offset of the register in BAR0
+ * Returns: value of the register
+ */
+unsigned int regRead(dma_ctx *ctx, unsigned int offset)
+{
+  int i = regSlot(offset);
+
+  if(i < 0)
+    return ((volatile unsigned int*)ctx->bar)[offset/4];
+
+  // First access: one read from the device fills the shadow
+  if(!(ctx->reg_valid & (1U << i))){
+    ctx->reg_shadow[i] = ((volatile unsigned int*)ctx->bar)[offset/4];
+    ctx->reg_valid |= 1U << i;
+  }
+
+  return ctx->reg_shadow[i];
+}
+
+/* Writes a register of BAR0, updating its shadow if it is write-owned
+ * Arguments: ctx - DMA context
+ * 	      offset - byte offset of the register in BAR0
+ * 	      value - value to write
+ */
+void regWrite(dma_ctx *ctx, unsigned int offset, unsigned int value)
+{
+  int i = regSlot(offset);
+
+  ((volatile unsigned int*)ctx->bar)[offset/4] = value;
+
+  if(i >= 0){
+    ctx->reg_shadow[i] = value;
+    ctx->reg_valid |= 1U << i;
+  }
+}
+
+/* Drops the shadow of a write-owned register after the device changed it on its own (e.g. a soft reset); the next
+ * regRead() goes to the device
+ * Arguments: ctx - DMA context
+ * 	      offset - byte offset of the register in BAR0
+ */
+void regInvalidate(dma_ctx *ctx, unsigned int offset)
+{
+  int i = regSlot(offset);
+
+  if(i >= 0)
+    ctx->reg_valid &= ~(1U << i);
+}
@@ -0,0 +1,799 @@
+/*******************************************************************
+ * Software model of the AXI DMA, its descriptor BRAM and the AXI
+ * side of the PCIe bridge, used as a backend of pciedma_patterns.c
+ * to run the host code on machines without the board.
+ *******************************************************************/
+
+#include "pciedma.h"
+#include "dmasim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+// Register of a simulated channel, addressed with the MM2S register offsets
+#define SIM_REG(sim,istx,reg)	((volatile unsigned int*)(sim)->bar)[DMA_INDEX + (((istx) ? MM2S_DMACR : S2MM_DMACR) + (reg))/4]
+
+// Word of a descriptor, addressed by the AXI address of the descriptor
+#define SIM_DESC(sim,desc,word)	((volatile unsigned int*)(sim)->bar)[((desc) - PCIE2AXI + (word))/4]
+
+#define SIM_IRQ_BITS		(DMASR_IOC_IRQ | DMASR_DLY_IRQ | DMASR_ERR_IRQ)
+
+/* Updates the status register of a channel. The host clears interrupt bits by writing ones, which plain memory cannot
+ * do by itself: any value found that differs from the last one written by the simulator is such a write
+ */
+void simStatus(dma_sim *sim, int istx, unsigned int set, unsigned int clear)
+{
+  sim_chan *ch = &sim->chan[istx];
+  volatile unsigned int *sr = &SIM_REG(sim,istx,MM2S_DMASR);
+  unsigned int v, n;
+
+  do{
+    v = *sr;
+    if(v != ch->sr)
+      ch->sr &= ~(v & SIM_IRQ_BITS);
+    n = (ch->sr | set) & ~clear;
+    if(n == v)
+      break;
+  }while(!__sync_bool_compare_and_swap(sr, v, n));
+
+  ch->sr = n;
+}
+
+/* Clears bits of the control register of a channel without losing a concurrent write from the host */
+void simClearControl(dma_sim *sim, int istx, unsigned int clear)
+{
+  volatile unsigned int *cr = &SIM_REG(sim,istx,MM2S_DMACR);
+  unsigned int v;
+
+  do{
+    v = *cr;
+  }while(!__sync_bool_compare_and_swap(cr, v, v & ~clear));
+}
+
+void simRaiseIRQ(dma_sim *sim, int istx, unsigned int bit)
+{
+  simStatus(sim, istx, bit, 0);
+
+  pthread_mutex_lock(&sim->lock);
+  sim->irq_pending++;
+  pthread_cond_broadcast(&sim->irq);
+  pthread_mutex_unlock(&sim->lock);
+}
+
+/* Soft reset: both channels go back to their power-up state, as on the AXI DMA. The loopback stream lives outside the DMA
+ * core and keeps the data it holds
+ */
+void simReset(dma_sim *sim)
+{
+  int i;
+
+  for(i = 0; i < 2; i++){
+    memset(&sim->chan[i], 0, sizeof(sim_chan));
+    SIM_REG(sim,i,MM2S_CURDESC) = 0;
+    SIM_REG(sim,i,MM2S_TAILDESC) = 0;
+    sim->chan[i].sr = DMASR_HALTED | DMASR_SGINCLD;
+    SIM_REG(sim,i,MM2S_DMASR) = sim->chan[i].sr;
+    SIM_REG(sim,i,MM2S_DMACR) = 1 << IRQTHRESHOLD_SHIFT;
+  }
+}
+
+/* Halts a channel on an error, as the AXI DMA does
+ * sr_err - DMASR error bits
+ * desc_err - STATUS error bits of the descriptor being processed, if any
+ */
+void simError(dma_sim *sim, int istx, unsigned int sr_err, unsigned int desc_err)
+{
+  sim_chan *ch = &sim->chan[istx];
+
+  if(ch->active && desc_err)
+    SIM_DESC(sim,ch->desc,STATUS) = SIM_DESC(sim,ch->desc,STATUS) | desc_err;
+
+  ch->active = 0;
+  ch->running = 0;
+  simClearControl(sim, istx, DMACR_RS);
+  simStatus(sim, istx, sr_err | DMASR_HALTED, DMASR_IDLE);
+
+  if(SIM_REG(sim,istx,MM2S_DMACR) & DMACR_Err_IrqEn)
+    simRaiseIRQ(sim, istx, DMASR_ERR_IRQ);
+}
+
+/* Host memory behind a bus address
+ * avail - will hold the bytes accessible from the returned pointer
+ * Returns: pointer to the memory, NULL if no mapping covers the address
+ */
+char *simBusAddr(dma_sim *sim, unsigned long pa, unsigned long *avail)
+{
+  sim_map *m;
+  unsigned long off, seg;
+  char *p = NULL;
+  int i;
+
+  pthread_mutex_lock(&sim->lock);
+  for(i = 0; i < SIM_MAPS; i++){
+    m = &sim->map[i];
+    if(!m->in_use || pa < m->pa || pa >= m->pa + m->span)
+      continue;
+
+    off = pa - m->pa;
+    if(m->seg == 0){
+      p = m->vaddr + off;
+      *avail = m->span - off;
+    }
+    else if(off % (2*m->seg) < m->seg){ // Odd segments are the holes between the pages of the mapping
+      seg = off / (2*m->seg);
+      p = m->vaddr + seg*m->seg + off % (2*m->seg);
+      *avail = m->seg - off % (2*m->seg);
+    }
+    break;
+  }
+  pthread_mutex_unlock(&sim->lock);
+
+  return p;
+}
+
+/* Host memory behind an address of the AXI bus: the DDR3 at 0, or host memory through the AXI2PCIE window
+ * avail - will hold the bytes accessible from the returned pointer
+ * Returns: pointer to the memory, NULL on a decode error
+ */
+char *simAXIaddr(dma_sim *sim, unsigned int axi, unsigned long *avail)
+{
+  unsigned long win_end = (unsigned long)AXI_PCIE + (~AXI2PCIE_MASK + 1);
+  unsigned int win;
+  char *p;
+
+  if(axi < sim->cfg.ddr_size){
+    *avail = sim->cfg.ddr_size - axi;
+    return (char*)sim->ddr + axi;
+  }
+
+  if(axi < AXI_PCIE || axi >= win_end)
+    return NULL;
+
+  win = ((volatile unsigned int*)sim->bar)[AXIBAR2PCIEBAR0/4];
+  p = simBusAddr(sim, (unsigned long)win + (axi - AXI_PCIE), avail);
+
+  // Accesses do not run past the end of the window
+  if(p != NULL && *avail > win_end - axi)
+    *avail = win_end - axi;
+
+  return p;
+}
+
+/* Moves bytes of the current MM2S descriptor into the loopback stream
+ * Returns: 1 if the descriptor progressed or completed, 0 if the stream is full, -1 on a decode error
+ */
+int simMM2S(dma_sim *sim, sim_chan *ch)
+{
+  int discard = (sim->cfg.discard_mask >> (ch->mc & TDEST)) & 1;
+  unsigned long avail, len, room, moved = 0, part;
+  sim_frame *fr;
+  char *src;
+
+  // A descriptor with SOF starts a new frame, closing any frame left open; one without SOF continues the open frame
+  if(!discard && !ch->framed){
+    fr = &sim->frame[(sim->frame_in - 1) % SIM_FRAMES];
+    if(sim->frame_in == sim->frame_out || fr->closed || (ch->ctl & CONTROL_TXSOF)){
+      if(sim->frame_in - sim->frame_out >= SIM_FRAMES)
+        return 0;
+      if(sim->frame_in != sim->frame_out && !fr->closed){
+        fr->end = sim->fifo_in;
+        fr->closed = 1;
+      }
+      fr = &sim->frame[sim->frame_in % SIM_FRAMES];
+      fr->dest = ch->mc & (TDEST | TID);
+      fr->closed = 0;
+      sim->frame_in++;
+    }
+    ch->framed = 1;
+  }
+
+  while(ch->line < ch->vsize && moved < SIM_BURST){
+    room = discard ? SIM_BURST : SIM_FIFO_SIZE - (sim->fifo_in - sim->fifo_out);
+    if(room == 0)
+      break;
+
+    len = ch->hsize - ch->pos;
+    if(len > room)
+      len = room;
+
+    src = simAXIaddr(sim, ch->addr + ch->line*ch->stride + ch->pos, &avail);
+    if(src == NULL)
+      return -1;
+    if(len > avail)
+      len = avail;
+
+    if(!discard){
+      part = SIM_FIFO_SIZE - sim->fifo_in % SIM_FIFO_SIZE;
+      if(part > len)
+        part = len;
+      memcpy(sim->fifo + sim->fifo_in % SIM_FIFO_SIZE, src, part);
+      memcpy(sim->fifo, src + part, len - part);
+      __sync_synchronize();
+      sim->fifo_in += len;
+    }
+
+    ch->pos += len;
+    ch->bytes += len;
+    moved += len;
+    if(ch->pos == ch->hsize){
+      ch->pos = 0;
+      ch->line++;
+    }
+  }
+
+  if(ch->line == ch->vsize && !discard && (ch->ctl & CONTROL_TXEOF)){
+    fr = &sim->frame[(sim->frame_in - 1) % SIM_FRAMES];
+    fr->end = sim->fifo_in;
+    fr->closed = 1;
+  }
+
+  return (moved > 0 || ch->line == ch->vsize) ? 1 : 0;
+}
+
+/* Moves bytes of the loopback stream into the buffer of the current S2MM descriptor; a frame ending completes the
+ * descriptor early, as TLAST does on the AXI DMA
+ * Returns: 1 if the descriptor progressed or completed, 0 if the stream is empty, -1 on a decode error
+ */
+int simS2MM(dma_sim *sim, sim_chan *ch)
+{
+  unsigned long avail, len, lim, moved = 0, part;
+  sim_frame *fr;
+  char *dst;
+
+  while(ch->line < ch->vsize && moved < SIM_BURST){
+    if(sim->frame_in == sim->frame_out)
+      break;
+    fr = &sim->frame[sim->frame_out % SIM_FRAMES];
+
+    if(ch->bytes == 0){
+      ch->sof = (sim->frame_out == 0 || sim->fifo_out == sim->frame[(sim->frame_out - 1) % SIM_FRAMES].end);
+      ch->dest = fr->dest;
+    }
+
+    lim = sim->fifo_in - sim->fifo_out;
+    if(fr->closed && fr->end - sim->fifo_out < lim)
+      lim = fr->end - sim->fifo_out;
+
+    len = ch->hsize - ch->pos;
+    if(len > lim)
+      len = lim;
+
+    if(len > 0){
+      dst = simAXIaddr(sim, ch->addr + ch->line*ch->stride + ch->pos, &avail);
+      if(dst == NULL)
+        return -1;
+      if(len > avail)
+        len = avail;
+
+      part = SIM_FIFO_SIZE - sim->fifo_out % SIM_FIFO_SIZE;
+      if(part > len)
+        part = len;
+      memcpy(dst, sim->fifo + sim->fifo_out % SIM_FIFO_SIZE, part);
+      memcpy(dst + part, sim->fifo, len - part);
+      sim->fifo_out += len;
+
+      ch->pos += len;
+      ch->bytes += len;
+      moved += len;
+      if(ch->pos == ch->hsize){
+        ch->pos = 0;
+        ch->line++;
+      }
+    }
+
+    if(fr->closed && sim->fifo_out == fr->end){
+      sim->frame_out++;
+      ch->eof = 1;
+      break;
+    }
+
+    if(len == 0)
+      break;
+  }
+
+  return (moved > 0 || ch->eof || ch->line == ch->vsize) ? 1 : 0;
+}
+
+/* Writes the status of the current descriptor and raises the completion interrupt once the threshold is reached */
+void simComplete(dma_sim *sim, int istx)
+{
+  sim_chan *ch = &sim->chan[istx];
+  unsigned int status, cr, threshold;
+
+  status = STATUS_CMPLT | (ch->bytes & STATUS_TRANSF);
+  if(!istx){
+    if(ch->sof)
+      status |= STATUS_RXSOF;
+    if(ch->eof)
+      status |= STATUS_RXEOF;
+    SIM_DESC(sim,ch->desc,MC_CTL) = (ch->mc & ~(TDEST | TID)) | ch->dest;
+  }
+
+  // Data must be visible before the host can see the descriptor completed
+  __sync_synchronize();
+  SIM_DESC(sim,ch->desc,STATUS) = status;
+
+  ch->last = ch->desc;
+  ch->active = 0;
+
+  cr = SIM_REG(sim,istx,MM2S_DMACR);
+  if(!(cr & (DMACR_IOC_IrqEn | DMACR_Dly_IrqEn)))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ch->last_cmplt);
+  threshold = (cr & DMACR_IRQThreshold) >> IRQTHRESHOLD_SHIFT;
+  if(++ch->irq_count >= (threshold ? threshold : 1) && (cr & DMACR_IOC_IrqEn)){
+    ch->irq_count = 0;
+    simRaiseIRQ(sim, istx, DMASR_IOC_IRQ);
+  }
+}
+
+/* Raises the delay interrupt of an idle channel whose completions have not reached the threshold in time */
+void simDelayIRQ(dma_sim *sim, int istx)
+{
+  sim_chan *ch = &sim->chan[istx];
+  unsigned int cr = SIM_REG(sim,istx,MM2S_DMACR), delay;
+  struct timespec now;
+
+  delay = (cr & DMACR_IRQDelay) >> IRQDELAY_SHIFT;
+  if(ch->irq_count == 0 || delay == 0 || !(cr & DMACR_Dly_IrqEn))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if((now.tv_sec - ch->last_cmplt.tv_sec)*1000000000L + now.tv_nsec - ch->last_cmplt.tv_nsec < (long)delay*SIM_DELAY_NS)
+    return;
+
+  ch->irq_count = 0;
+  simRaiseIRQ(sim, istx, DMASR_DLY_IRQ);
+}
+
+/* Fetches the descriptor that follows the last completed one, if the tail has not been reached
+ * Returns: 1 if a descriptor was fetched, 0 if the channel is idle, -1 on error
+ */
+int simFetch(dma_sim *sim, int istx)
+{
+  sim_chan *ch = &sim->chan[istx];
+  unsigned int tail, desc, stride_ctl, off;
+
+  tail = SIM_REG(sim,istx,MM2S_TAILDESC) & TAILDESC_PTR;
+  if(tail == 0 || ch->last == tail)
+    return 0;
+
+  // Descriptors are written before TAILDESC
+  __sync_synchronize();
+
+  desc = ch->last ? SIM_DESC(sim,ch->last,NXTDESC) & NXTDESC_PTR : ch->first;
+  off = desc - PCIE2AXI;
+  if(desc < PCIE2AXI || off < BRAM_BASE || off + DESC_SIZE > BRAM_BASE + 0x1000){
+    simError(sim, istx, DMASR_SGDECERR, 0);
+    return -1;
+  }
+
+  ch->desc = desc;
+  ch->active = 1;
+
+  if(SIM_DESC(sim,desc,STATUS) & STATUS_CMPLT){
+    simError(sim, istx, DMASR_SGINTERR, 0); // Descriptor already completed: the ring was not recycled
+    return -1;
+  }
+
+  if(sim->cfg.fault_every && ++sim->fetched % sim->cfg.fault_every == 0){
+    simError(sim, istx, DMASR_DMASLVERR, STATUS_DMASLVERR);
+    return -1;
+  }
+
+  ch->addr = SIM_DESC(sim,desc,BUFFER_ADDRESS);
+  ch->ctl = SIM_DESC(sim,desc,CONTROL);
+  ch->mc = SIM_DESC(sim,desc,MC_CTL);
+  stride_ctl = SIM_DESC(sim,desc,STRIDE_CTL);
+
+  ch->vsize = (stride_ctl & VSIZE) >> VSIZE_SHIFT;
+  if(ch->vsize == 0){
+    // 1D descriptor
+    ch->hsize = ch->ctl & CONTROL_BUFFLEN;
+    ch->vsize = 1;
+    ch->stride = ch->hsize;
+  }
+  else{
+    ch->hsize = ch->ctl & HSIZE;
+    ch->stride = stride_ctl & STRIDE;
+  }
+
+  if(ch->hsize == 0){
+    simError(sim, istx, DMASR_DMAINTERR, STATUS_DMAINTERR);
+    return -1;
+  }
+
+  ch->line = ch->pos = ch->bytes = 0;
+  ch->sof = ch->eof = ch->framed = 0;
+
+  simStatus(sim, istx, 0, DMASR_IDLE);
+  return 1;
+}
+
+/* Runs a channel for one step
+ * Returns: 1 if the channel did some work, 0 otherwise
+ */
+int simChannel(dma_sim *sim, int istx)
+{
+  sim_chan *ch = &sim->chan[istx];
+  unsigned int cr = SIM_REG(sim,istx,MM2S_DMACR);
+  int ret;
+
+  if(cr & DMACR_RESET){
+    simReset(sim);
+    return 1;
+  }
+
+  simStatus(sim, istx, 0, 0);
+
+  if(!(cr & DMACR_RS)){
+    if(ch->running || !(ch->sr & DMASR_HALTED)){
+      ch->running = 0;
+      ch->active = 0;
+      simStatus(sim, istx, DMASR_HALTED, DMASR_IDLE);
+    }
+    return 0;
+  }
+
+  if(!ch->running){
+    // The host waits for Halted to deassert before writing TAILDESC: forget the one of the previous run
+    ch->running = 1;
+    ch->last = 0;
+    ch->first = SIM_REG(sim,istx,MM2S_CURDESC) & CURDESC_PTR;
+    SIM_REG(sim,istx,MM2S_TAILDESC) = 0;
+    simStatus(sim, istx, 0, DMASR_HALTED | DMASR_IDLE);
+    return 1;
+  }
+
+  if(!ch->active){
+    ret = simFetch(sim, istx);
+    // Idle once the tail has been processed
+    if(ret == 0 && ch->last != 0){
+      if(!(ch->sr & DMASR_IDLE))
+        simStatus(sim, istx, DMASR_IDLE, 0);
+      simDelayIRQ(sim, istx);
+    }
+    if(ret <= 0)
+      return ret < 0;
+  }
+
+  ret = istx ? simMM2S(sim, ch) : simS2MM(sim, ch);
+  if(ret < 0){
+    simError(sim, istx, DMASR_DMADECERR, STATUS_DMADECERR);
+    return 1;
+  }
+
+  if(ch->line == ch->vsize || ch->eof)
+    simComplete(sim, istx);
+
+  SIM_REG(sim,istx,MM2S_CURDESC) = ch->active ? ch->desc : ch->last;
+
+  return ret;
+}
+
+void *simThread(void *arg)
+{
+  dma_sim *sim = (dma_sim*)arg;
+  unsigned int idle = 0;
+  int work;
+
+  while(sim->running){
+    work = simChannel(sim, 1);
+    work |= simChannel(sim, 0);
+
+    if(work){
+      idle = 0;
+      continue;
+    }
+
+    if(++idle < SIM_IDLE_SPINS || sim->cfg.idle_us == 0)
+      sched_yield();
+    else
+      usleep(sim->cfg.idle_us);
+  }
+
+  return NULL;
+}
+
+/* Finds free bus addresses for a mapping; contiguous mappings never cross an AXI2PCIE window. Called with the lock held
+ * Returns: first bus address, 0 if the 32-bit bus space is exhausted
+ */
+unsigned long simFindBus(dma_sim *sim, unsigned long span, int contiguous)
+{
+  unsigned long pa = SIM_PA_BASE;
+  sim_map *m;
+  int i, moved = 1;
+
+  while(moved){
+    moved = 0;
+
+    if(contiguous && (pa & AXI2PCIE_MASK) != ((pa + span - 1) & AXI2PCIE_MASK))
+      pa = (pa + span - 1) & AXI2PCIE_MASK;
+
+    for(i = 0; i < SIM_MAPS; i++){
+      m = &sim->map[i];
+      if(m->in_use && pa < m->pa + m->span && m->pa < pa + span){
+        pa = m->pa + m->span;
+        moved = 1;
+      }
+    }
+  }
+
+  if(pa + span > 0x100000000UL)
+    return 0;
+
+  return pa;
+}
+
+/* Simulator backend */
+
+void *simMapBAR(void *dev)
+{
+  return ((dma_sim*)dev)->bar;
+}
+
+int simUnmapBAR(void *dev, void *bar)
+{
+  (void)dev; (void)bar;
+  return 0;
+}
+
+int simAddMap(dma_sim *sim, char *vaddr, unsigned long span, unsigned long seg, void *alloc)
+{
+  sim_map *m = NULL;
+  int i;
+
+  for(i = 0; i < SIM_MAPS; i++){
+    if(!sim->map[i].in_use){
+      m = &sim->map[i];
+      break;
+    }
+  }
+
+  if(m == NULL){
+    PRINT("Error: No free mappings in the simulator\n");
+    return -1;
+  }
+
+  m->pa = simFindBus(sim, span, seg == 0);
+  if(m->pa == 0){
+    PRINT("Error: Simulated bus address space exhausted\n");
+    return -1;
+  }
+
+  m->span = span;
+  m->vaddr = vaddr;
+  m->seg = seg;
+  m->alloc = alloc;
+  m->in_use = 1;
+
+  return i;
+}
+
+int simMapUmem(void *dev, void *mem, unsigned int size, pd_umem_t *um)
+{
+  dma_sim *sim = (dma_sim*)dev;
+  unsigned long seg = sim->cfg.seg_size, base, start, end;
+  int i, h;
+
+  // Every segment gets its own bus addresses, with a hole after it so that segments never merge
+  base = (unsigned long)mem & ~(seg - 1);
+  memset(um, 0, sizeof(pd_umem_t));
+  um->nents = ((unsigned long)mem + size - base + seg - 1) / seg;
+
+  um->sg = (pd_umem_sgentry_t*)malloc(um->nents*sizeof(pd_umem_sgentry_t));
+  if(um->sg == NULL){
+    PRINT("Error: Could not malloc sgentry structure\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&sim->lock);
+  h = simAddMap(sim, (char*)base, 2*um->nents*seg, seg, NULL);
+  if(h >= 0){
+    for(i = 0; i < um->nents; i++){
+      start = (i == 0) ? (unsigned long)mem : base + i*seg;
+      end = (i == um->nents - 1) ? (unsigned long)mem + size : base + (i + 1)*seg;
+      um->sg[i].addr = sim->map[h].pa + 2*i*seg + (start - base - i*seg);
+      um->sg[i].size = end - start;
+    }
+  }
+  pthread_mutex_unlock(&sim->lock);
+
+  if(h < 0){
+    free(um->sg);
+    return -1;
+  }
+
+  um->vma = (unsigned long)mem;
+  um->size = size;
+  um->handle_id = h;
+
+  return 0;
+}
+
+int simUnmapUmem(void *dev, pd_umem_t *um)
+{
+  dma_sim *sim = (dma_sim*)dev;
+
+  if(um->handle_id < 0 || um->handle_id >= SIM_MAPS || !sim->map[um->handle_id].in_use)
+    return -1;
+
+  pthread_mutex_lock(&sim->lock);
+  sim->map[um->handle_id].in_use = 0;
+  pthread_mutex_unlock(&sim->lock);
+
+  free(um->sg);
+  um->sg = NULL;
+
+  return 0;
+}
+
+int simSyncUmem(void *dev, pd_umem_t *um, int dir)
+{
+  (void)dev; (void)um; (void)dir;
+  // Host memory is coherent with the simulator, ordering is all a sync has to provide
+  __sync_synchronize();
+  return 0;
+}
+
+void *simAllocKmem(void *dev, unsigned int size, pd_kmem_t *km)
+{
+  dma_sim *sim = (dma_sim*)dev;
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  void *mem;
+  int h;
+
+  if(posix_memalign(&mem, page, size) != 0)
+    return NULL;
+
+  pthread_mutex_lock(&sim->lock);
+  h = simAddMap(sim, (char*)mem, (size + page - 1) & ~(page - 1), 0, mem);
+  pthread_mutex_unlock(&sim->lock);
+
+  if(h < 0){
+    free(mem);
+    return NULL;
+  }
+
+  km->pa = sim->map[h].pa;
+  km->size = size;
+  km->mem = mem;
+  km->handle_id = h;
+  km->pci_handle = NULL;
+
+  return mem;
+}
+
+int simFreeKmem(void *dev, pd_kmem_t *km)
+{
+  dma_sim *sim = (dma_sim*)dev;
+  void *mem;
+
+  if(km->handle_id < 0 || km->handle_id >= SIM_MAPS || sim->map[km->handle_id].alloc == NULL)
+    return -1;
+
+  pthread_mutex_lock(&sim->lock);
+  mem = sim->map[km->handle_id].alloc;
+  sim->map[km->handle_id].alloc = NULL;
+  sim->map[km->handle_id].in_use = 0;
+  pthread_mutex_unlock(&sim->lock);
+
+  free(mem);
+  return 0;
+}
+
+int simWaitIRQ(void *dev)
+{
+  dma_sim *sim = (dma_sim*)dev;
+  struct timespec ts;
+
+  // Bounded like the wait of pciDriver, callers check the registers again in any case
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += 10000000;
+  if(ts.tv_nsec >= 1000000000){
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&sim->lock);
+  while(sim->irq_pending == 0 && sim->running){
+    if(pthread_cond_timedwait(&sim->irq, &sim->lock, &ts) != 0)
+      break;
+  }
+  if(sim->irq_pending > 0)
+    sim->irq_pending--;
+  pthread_mutex_unlock(&sim->lock);
+
+  return 0;
+}
+
+const dma_ops sim_ops = {
+  "simulator",
+  simMapBAR,
+  simUnmapBAR,
+  simMapUmem,
+  simUnmapUmem,
+  simSyncUmem,
+  simAllocKmem,
+  simFreeKmem,
+  simWaitIRQ
+};
+
+int simOpen(dma_sim *sim, const dma_sim_cfg *cfg)
+{
+  memset(sim, 0, sizeof(dma_sim));
+
+  if(cfg != NULL)
+    sim->cfg = *cfg;
+  if(sim->cfg.ddr_size == 0)
+    sim->cfg.ddr_size = SIM_DDR_DEF;
+  if(sim->cfg.seg_size == 0)
+    sim->cfg.seg_size = sysconf(_SC_PAGESIZE);
+
+  if(sim->cfg.ddr_size > AXI_PCIE || (sim->cfg.seg_size & (sim->cfg.seg_size - 1))){
+    PRINT("Error: DDR3 must be below the PCIe window and segments a power of two\n");
+    return -1;
+  }
+
+  sim->bar = calloc(1, SIM_BAR_SIZE);
+  sim->ddr = (unsigned char*)calloc(1, sim->cfg.ddr_size);
+  sim->fifo = (unsigned char*)malloc(SIM_FIFO_SIZE);
+  if(sim->bar == NULL || sim->ddr == NULL || sim->fifo == NULL){
+    PRINT("Error: Could not allocate the simulated device\n");
+    goto err;
+  }
+
+  simReset(sim);
+
+  pthread_mutex_init(&sim->lock, NULL);
+  pthread_cond_init(&sim->irq, NULL);
+  sim->running = 1;
+
+  if(pthread_create(&sim->thread, NULL, simThread, sim) != 0){
+    PRINT("Error: Could not start the simulator thread\n");
+    pthread_mutex_destroy(&sim->lock);
+    pthread_cond_destroy(&sim->irq);
+    goto err;
+  }
+
+  return 0;
+
+err:
+  free(sim->bar);
+  free(sim->ddr);
+  free(sim->fifo);
+  sim->bar = NULL;
+  return -1;
+}
+
+int simClose(dma_sim *sim)
+{
+  int i;
+
+  if(sim->bar == NULL)
+    return -1;
+
+  pthread_mutex_lock(&sim->lock);
+  sim->running = 0;
+  pthread_cond_broadcast(&sim->irq);
+  pthread_mutex_unlock(&sim->lock);
+
+  pthread_join(sim->thread, NULL);
+
+  for(i = 0; i < SIM_MAPS; i++)
+    if(sim->map[i].alloc != NULL)
+      free(sim->map[i].alloc);
+
+  pthread_mutex_destroy(&sim->lock);
+  pthread_cond_destroy(&sim->irq);
+
+  free(sim->bar);
+  free(sim->ddr);
+  free(sim->fifo);
+  sim->bar = NULL;
+
+  return 0;
+}
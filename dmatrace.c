@@ -0,0 +1,191 @@
+/*******************************************************************
+ * Phase trace analysis: turns the timing records collected by the
+ * DMA contexts (see setTrace()) into per-phase histograms and
+ * percentiles, or exports them as CSV.
+ *******************************************************************/
+
+#include "pciedma.h"
+#include "dmatrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *trace_phase_names[TRACE_PHASES] = {
+  "map", "translate", "desc", "start", "tail", "idle", "status", "sync", "unmap"
+};
+
+const char *tracePhaseName(int phase)
+{
+  if(phase < 0 || phase >= TRACE_PHASES)
+    return "?";
+
+  return trace_phase_names[phase];
+}
+
+int traceSnapshot(dma_trace *tr, dma_trace_rec *recs, int max)
+{
+  unsigned long long head, idx;
+  dma_trace_rec *rec;
+  int n = 0;
+
+  head = tr->head;
+  idx = (head > TRACE_SLOTS) ? head - TRACE_SLOTS : 0;
+
+  for(; idx < head && n < max; idx++){
+    rec = &tr->rec[idx & (TRACE_SLOTS - 1)];
+
+    // A record is only valid if it holds the same position before and after the copy
+    if(rec->seq != idx + 1)
+      continue;
+    __sync_synchronize();
+    recs[n] = *rec;
+    __sync_synchronize();
+    if(rec->seq != idx + 1)
+      continue;
+
+    n++;
+  }
+
+  return n;
+}
+
+/* qsort() comparison of two durations */
+int cmpDuration(const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Returns the nearest-rank percentile of a sorted array of n durations */
+unsigned int tracePercentile(unsigned int *ns, unsigned int n, unsigned int pct)
+{
+  unsigned int rank = (n*pct + 99)/100;
+
+  return ns[rank > 0 ? rank - 1 : 0];
+}
+
+int traceStats(dma_trace *tr, dma_trace_stats *stats)
+{
+  dma_trace_rec *recs;
+  unsigned int *ns, n;
+  int nrecs, i, p, b;
+
+  memset(stats, 0, TRACE_PHASES*sizeof(dma_trace_stats));
+
+  recs = (dma_trace_rec*)malloc(TRACE_SLOTS*sizeof(dma_trace_rec));
+  ns = (unsigned int*)malloc(TRACE_SLOTS*sizeof(unsigned int));
+  if(recs == NULL || ns == NULL){
+    PRINT("Error: Could not malloc trace snapshot\n");
+    free(recs);
+    free(ns);
+    return -1;
+  }
+
+  nrecs = traceSnapshot(tr, recs, TRACE_SLOTS);
+
+  for(p = 0; p < TRACE_PHASES; p++){
+    n = 0;
+    for(i = 0; i < nrecs; i++){
+      if(recs[i].phase != p)
+        continue;
+
+      ns[n++] = recs[i].ns;
+      stats[p].total_ns += recs[i].ns;
+      stats[p].bytes += recs[i].count;
+
+      for(b = 0; b < TRACE_BUCKETS - 1 && (recs[i].ns >> (b + 1)) != 0; b++)
+        ;
+      stats[p].hist[b]++;
+    }
+
+    stats[p].count = n;
+    if(n == 0)
+      continue;
+
+    qsort(ns, n, sizeof(unsigned int), cmpDuration);
+    stats[p].min_ns = ns[0];
+    stats[p].max_ns = ns[n - 1];
+    stats[p].p50_ns = tracePercentile(ns, n, 50);
+    stats[p].p90_ns = tracePercentile(ns, n, 90);
+    stats[p].p99_ns = tracePercentile(ns, n, 99);
+  }
+
+  free(recs);
+  free(ns);
+
+  return nrecs;
+}
+
+int traceReport(dma_trace *tr, FILE *f)
+{
+  dma_trace_stats stats[TRACE_PHASES];
+  unsigned int peak;
+  int p, b, first, last;
+
+  if(traceStats(tr, stats) < 0)
+    return -1;
+
+  fprintf(f, "%-10s %8s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "avg ns", "min ns", "p50 ns", "p90 ns", "p99 ns", "max ns");
+  for(p = 0; p < TRACE_PHASES; p++){
+    if(stats[p].count == 0)
+      continue;
+
+    fprintf(f, "%-10s %8u %10llu %10u %10u %10u %10u %10u\n", tracePhaseName(p), stats[p].count, stats[p].total_ns/stats[p].count,
+            stats[p].min_ns, stats[p].p50_ns, stats[p].p90_ns, stats[p].p99_ns, stats[p].max_ns);
+  }
+
+  // One histogram per phase, limited to the buckets in use
+  for(p = 0; p < TRACE_PHASES; p++){
+    if(stats[p].count == 0)
+      continue;
+
+    first = -1;
+    last = 0;
+    peak = 0;
+    for(b = 0; b < TRACE_BUCKETS; b++){
+      if(stats[p].hist[b] == 0)
+        continue;
+      if(first < 0)
+        first = b;
+      last = b;
+      if(stats[p].hist[b] > peak)
+        peak = stats[p].hist[b];
+    }
+
+    fprintf(f, "\n%s:\n", tracePhaseName(p));
+    for(b = first; b <= last; b++)
+      fprintf(f, "  >= %10lu ns %8u %.*s\n", 1UL << b, stats[p].hist[b], (int)(40ULL*stats[p].hist[b]/peak),
+              "########################################");
+  }
+
+  return 0;
+}
+
+int traceExport(dma_trace *tr, FILE *f)
+{
+  dma_trace_rec *recs;
+  int n, i;
+
+  recs = (dma_trace_rec*)malloc(TRACE_SLOTS*sizeof(dma_trace_rec));
+  if(recs == NULL){
+    PRINT("Error: Could not malloc trace snapshot\n");
+    return -1;
+  }
+
+  n = traceSnapshot(tr, recs, TRACE_SLOTS);
+
+  fprintf(f, "phase,chan,start_ns,ns,count\n");
+  for(i = 0; i < n; i++)
+    fprintf(f, "%s,%s,%llu,%u,%u\n", tracePhaseName(recs[i].phase), recs[i].chan == 1 ? "mm2s" : recs[i].chan == 0 ? "s2mm" : "-",
+            recs[i].start_ns, recs[i].ns, recs[i].count);
+
+  free(recs);
+
+  return n;
+}
+
+void traceClear(dma_trace *tr)
+{
+  memset(tr, 0, sizeof(dma_trace));
+}
@@ -15,33 +15,28 @@
   #define PRINT(...) ((void)0)
 #endif
 
-/* GLOBAL VARIABLES */
-/*----------------------*/
-extern void * bar;
-
-
-unsigned int readFFTstatus()
+unsigned int readFFTstatus(dma_ctx *ctx)
 {
  
-  if (bar == NULL){
+  if (ctx->bar == NULL){
       PRINT("Error: BAR0 is not mapped\n");
       return -1;
   }
   
-  return ((unsigned int*)bar)[FFT_INDEX + 1];
+  return ((unsigned int*)ctx->bar)[FFT_INDEX + 1];
  
 }
 
-int configFFT(int size,int scaling, int fwdinv)
+int configFFT(dma_ctx *ctx, int size,int scaling, int fwdinv)
 {
   unsigned int ctl;
   
-  if (bar == NULL){
+  if (ctx->bar == NULL){
       PRINT("Error: BAR0 is not mapped\n");
       return -1;
   }
   
-    printf("Just wrote: %08x\n", ((unsigned int*)bar)[FFT_INDEX + 0]);
+    printf("Just wrote: %08x\n", regRead(ctx, FFT_BASE));
 
   
   if(size > 16 || size < 3){
@@ -59,18 +54,18 @@ int configFFT(int size,int scaling, int fwdinv)
   ctl = ctl | size;
   
   printf("Writing configuration: %08x\n",ctl);
-  ((unsigned int*)bar)[FFT_INDEX + 0] = ctl;
+  regWrite(ctx, FFT_BASE, ctl);
   
   
   return 0;
 }
 
-int setFFTsize(int size)
+int setFFTsize(dma_ctx *ctx, int size)
 {
   unsigned int ctl;
   unsigned int points, fwdinv, scaling;
   
-  if (bar == NULL){
+  if (ctx->bar == NULL){
       PRINT("Error: BAR0 is not mapped\n");
       return -1;
   }
@@ -80,7 +75,7 @@ int setFFTsize(int size)
       return -1;
   }
   
-  ctl = ((unsigned int*)bar)[FFT_INDEX + 0];
+  ctl = regRead(ctx, FFT_BASE); // Host shadow, no read over PCIe
   points = ctl & SIZE_MASK;
   fwdinv = (ctl & FWDINV_MASK);
   scaling = (ctl & SCALING_MASK);
@@ -89,19 +84,19 @@ int setFFTsize(int size)
   ctl = (scaling);
   ctl = ctl | fwdinv;
   ctl = ctl | size;
-  ((unsigned int*)bar)[FFT_INDEX + 0] = ctl;
+  regWrite(ctx, FFT_BASE, ctl);
 
   
   return 0;
 }
 
 // 0 forward; 1 - inverse
-int setFFTfwdinv(int fwdinv)
+int setFFTfwdinv(dma_ctx *ctx, int fwdinv)
 {
   unsigned int ctl;
   unsigned int points, fwdinv_ctl, scaling;
   
-  if (bar == NULL){
+  if (ctx->bar == NULL){
       PRINT("Error: BAR0 is not mapped\n");
       return -1;
   }
@@ -111,7 +106,7 @@ int setFFTfwdinv(int fwdinv)
       return -1;
   }
   
-  ctl = ((unsigned int*)bar)[FFT_INDEX + 0];
+  ctl = regRead(ctx, FFT_BASE);
   points = ctl & SIZE_MASK;
   fwdinv_ctl = (ctl & FWDINV_MASK);
   scaling = (ctl & SCALING_MASK);
@@ -121,23 +116,23 @@ int setFFTfwdinv(int fwdinv)
   ctl = (scaling);
   ctl = ctl | (fwdinv << FWDINV_SHIFT);
   ctl = ctl | points;
-  ((unsigned int*)bar)[FFT_INDEX + 0] = ctl;
+  regWrite(ctx, FFT_BASE, ctl);
 
   
   return 0;
 }
 
-int setFFTscaling(int scale_sched)
+int setFFTscaling(dma_ctx *ctx, int scale_sched)
 {
   unsigned int ctl;
   unsigned int points, fwdinv, scaling;
   
-  if (bar == NULL){
+  if (ctx->bar == NULL){
       PRINT("Error: BAR0 is not mapped\n");
       return -1;
   }
   
-  ctl = ((unsigned int*)bar)[FFT_INDEX + 0];
+  ctl = regRead(ctx, FFT_BASE);
   points = ctl & SIZE_MASK;
   fwdinv = (ctl & FWDINV_MASK);
   scaling = (ctl & SCALING_MASK);
@@ -146,21 +141,24 @@ int setFFTscaling(int scale_sched)
   ctl = ((scale_sched<<SCALING_SHIFT) & SCALING_MASK);
   ctl = ctl | fwdinv;
   ctl = ctl | points;
-  ((unsigned int*)bar)[FFT_INDEX + 0] = ctl;
+  regWrite(ctx, FFT_BASE, ctl);
 
   
   return 0;
 }
 
-int FFTreset()
+int FFTreset(dma_ctx *ctx)
 {
   
-  if (bar == NULL){
+  if (ctx->bar == NULL){
       PRINT("Error: BAR0 is not mapped\n");
       return -1;
   }
   
-  ((unsigned int*)bar)[FFT_RST_INDEX] = FFT_RST_CODE;
+  ((unsigned int*)ctx->bar)[FFT_RST_INDEX] = FFT_RST_CODE;
+
+  // The reset brings the control word back to its default
+  regInvalidate(ctx, FFT_BASE);
   
   return 0;
 }
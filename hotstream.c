@@ -2,6 +2,7 @@
 #include <stdio.h>
 
 pd_device_t dev; // PCIExpress based device handler
+dma_ctx ctx; // DMA context of the device
 int patternApplied = 0; // Boolean flag to indicate whether a pattern has been applied to a memory buffer
 int sendTransfType = 0; // Flag to indicate the type of send transfer being initiated (0 - Host to DDR; 1 - Host to Backplane; 2 - Host to Instruction Stream
 int recvTransfType = 0; // Flag to indicate the type of recv transfer being initiated (0 - DDR to Host; 1 - Backplane to Host; 2 - Instruction Stream to Host
@@ -64,7 +65,7 @@ int HotStream_copyInstrData(int CoreNum, void *idata0, int idata0_size, void *id
    // Configure DataStreamSwitch(DSS)
   DSSdest = 2; // 10 - Shared Memory
   DSSdest = DSSdest << 4; 
-  cmuWrite(CMU_KCR, (DSSdest & CMU_KCR_Dest));
+  cmuWrite(&ctx, CMU_KCR, (DSSdest & CMU_KCR_Dest));
  
  bar0 = 0; // Starting position of first instruction block
 
@@ -86,10 +87,10 @@ int HotStream_copyInstrData(int CoreNum, void *idata0, int idata0_size, void *id
    // Configure DataStreamSwitch(DSS)
   DSSdest = 2; // 10 - Instruction Stream
   DSSdest = DSSdest << 4; 
-  cmuWrite(CMU_KCR, (DSSdest & CMU_KCR_Dest));
+  cmuWrite(&ctx, CMU_KCR, (DSSdest & CMU_KCR_Dest));
   
   // Setup data copy from the host memory to the MM2S interface (stream target - CoreNum)
-  if(setupSend(&dev, idata0, idata0_size,CoreNum) < 0){
+  if(setupSend(&ctx, idata0, idata0_size,CoreNum) < 0){
     PRINT("Could not setup a data copy from the Host to the MM2S interface and Instruction Stream\n");
     return -1;
   } 
@@ -122,7 +123,7 @@ int HotStream_copyInstrData(int CoreNum, void *idata0, int idata0_size, void *id
 // Copy buffer 1 to the Instruction Stream
 
   // Setup data copy from the host memory to the MM2S interface (stream target - CoreNum)
-  if(setupSend(&dev, idata1, idata1_size,CoreNum) < 0){
+  if(setupSend(&ctx, idata1, idata1_size,CoreNum) < 0){
     PRINT("Could not setup a data copy from the Host to the MM2S interface and Instruction Stream\n");
     return -1;
   } 
@@ -156,10 +157,10 @@ void HotStream_setIntVector(unsigned long intv)
 {
  unsigned int mask32 = 0xFFFF;
 
- cmuWrite(CMU_KCML,(unsigned int)(intv & mask32));
- cmuWrite(CMU_KCMH,(unsigned int)((intv << 32) & mask32));
+ cmuWrite(&ctx, CMU_KCML,(unsigned int)(intv & mask32));
+ cmuWrite(&ctx, CMU_KCMH,(unsigned int)((intv << 32) & mask32));
  
- cmuWrite(CMU_KCR, CMU_KCR_SetInt); // Apply interrupt vector
+ cmuWrite(&ctx, CMU_KCR, CMU_KCR_SetInt); // Apply interrupt vector
 }
 
 void HotStream_resetCore(int CoreNum)
@@ -169,21 +170,21 @@ void HotStream_resetCore(int CoreNum)
 
  mask = mask | (bit << CoreNum);
 
- genReset(mask);
+ genReset(&ctx, mask);
  
 }
 
 void HotStream_resetCoreVector(unsigned long rstv)
 {
- genReset(rstv);
+ genReset(&ctx, rstv);
 }
 
 unsigned long HotStream_getInt()
 {
   unsigned long retval;
 
-  retval = cmuRead(CMU_KIVL);
-  retval = retval | ((unsigned long)cmuRead(CMU_KIVH))<<32;
+  retval = cmuRead(&ctx, CMU_KIVL);
+  retval = retval | ((unsigned long)cmuRead(&ctx, CMU_KIVH))<<32;
 
   return retval;  
 }
@@ -196,16 +197,16 @@ void HotStream_ackInt(int CoreNum)
 
   intMask64 = intMask64 | (bit << CoreNum);
 
-  cmuWrite(CMU_KIVL, (unsigned int)(intMask64 & mask32));
-  cmuWrite(CMU_KIVH, (unsigned int)((intMask64 << 32) & mask32));
+  cmuWrite(&ctx, CMU_KIVL, (unsigned int)(intMask64 & mask32));
+  cmuWrite(&ctx, CMU_KIVH, (unsigned int)((intMask64 << 32) & mask32));
 }
 
 void HotStream_ackIntVector(unsigned long rstv)
 {
   unsigned int mask32 = 0xFFFF;
 
-  cmuWrite(CMU_KIVL, (unsigned int)(rstv & mask32));
-  cmuWrite(CMU_KIVH, (unsigned int)((rstv << 32) & mask32));
+  cmuWrite(&ctx, CMU_KIVL, (unsigned int)(rstv & mask32));
+  cmuWrite(&ctx, CMU_KIVH, (unsigned int)((rstv << 32) & mask32));
 }
 
 // Framework Management
@@ -219,7 +220,7 @@ int HotStream_init()
 
   PRINT("Device file opened successfully\n");
 
-  if(initDMA(&dev) < 0) 
+  if(initDMA(&ctx, &dev) < 0) 
     PRINT("Could not initialize DMA engine\n");
 
   return 0;
@@ -227,7 +228,7 @@ int HotStream_init()
 
 int HotStream_close()
 {
-  if(stopDMA(&dev)<0)
+  if(stopDMA(&ctx)<0)
    return -1;
 
   return pd_close(&dev);
@@ -242,17 +243,17 @@ int HotStream_sendShMem(void *uBuf, unsigned int size, unsigned int offset)
   // Configure DataStreamSwitch(DSS)
   DSSdest = 0; // 00 - Shared Memory
   DSSdest = DSSdest << 4; 
-  cmuWrite(CMU_KCR, (DSSdest & CMU_KCR_Dest));
+  cmuWrite(&ctx, CMU_KCR, (DSSdest & CMU_KCR_Dest));
   
 
   // Setup data copy from the host memory to the MM2S interface (stream target - 0)
-  if(setupSend(&dev, uBuf, size,0) < 0){
+  if(setupSend(&ctx, uBuf, size,0) < 0){
     PRINT("Could not setup a data copy from the Host to the MM2S interface\n");
     return -1;
   }
 
   // Setup data copy from the S2MM interface to the Shared Memory (DDR)
-  if(setupRecvtoDDR(&dev, offset, size) < 0){
+  if(setupRecvtoDDR(&ctx, offset, size) < 0){
     PRINT("Could not setup a data copy from the S2MM interface to the Shared Memory\n");
     return -1;
   }
@@ -269,16 +270,16 @@ int HotStream_recvShMem(void *uBuf, unsigned int size, unsigned int offset)
    // Configure DataStreamSwitch(DSS)
   DSSdest = 0; // 00 - Shared Memory
   DSSdest = DSSdest << 4; 
-  cmuWrite(CMU_KCR, (DSSdest & CMU_KCR_Dest));
+  cmuWrite(&ctx, CMU_KCR, (DSSdest & CMU_KCR_Dest));
   
   // Setup data transfer from the Shared Memory to the MM2S interface
-  if(setupSendfromDDR(&dev, offset, size, 0) < 0){
+  if(setupSendfromDDR(&ctx, offset, size, 0) < 0){
     PRINT("Could not setup a data copy from the Shared Memory to the MM2S interface\n");
     return -1;
   }
 
   // Setup data transfer from the S2MM interface to the Host memory
-  if(setupRecv(&dev, uBuf, size) < 0){
+  if(setupRecv(&ctx, uBuf, size) < 0){
     PRINT("Could not setup a data copy from the S2MM interface to the Host memory\n");
     return -1;
   }
@@ -295,10 +296,10 @@ int HotStream_sendBplane(void *uBuf, unsigned int size, int CoreNum)
    // Configure DataStreamSwitch(DSS)
   DSSdest = 1; // 01 - Shared Memory
   DSSdest = DSSdest << 4; 
-  cmuWrite(CMU_KCR, (DSSdest & CMU_KCR_Dest));
+  cmuWrite(&ctx, CMU_KCR, (DSSdest & CMU_KCR_Dest));
   
   // Setup data copy from the host memory to the MM2S interface (stream target - CoreNum)
-  if(setupSend(&dev, uBuf, size,CoreNum) < 0){
+  if(setupSend(&ctx, uBuf, size,CoreNum) < 0){
     PRINT("Could not setup a data copy from the Host to the MM2S interface and backplane\n");
     return -1;
   } 
@@ -315,10 +316,10 @@ int HotStream_recvBplane(void *uBuf, unsigned int size, int CoreNum)
    // Configure DataStreamSwitch(DSS)
   DSSdest = 1; // 01 - Shared Memory
   DSSdest = DSSdest << 4; 
-  cmuWrite(CMU_KCR, (DSSdest & CMU_KCR_Dest));
+  cmuWrite(&ctx, CMU_KCR, (DSSdest & CMU_KCR_Dest));
   
   // Setup data copy from the S2MM interface to the Host memory (stream target - CoreNum)
-  if(setupRecv(&dev, uBuf, size) < 0){
+  if(setupRecv(&ctx, uBuf, size) < 0){
     PRINT("Could not setup a data copy from the S2MM interface to the Host memory\n");
     return -1;
   } 
@@ -338,14 +339,14 @@ int HotStream_startSend(int waitInt)
  
  if(sendTransfType == 0){ // Host to Shared Memory
    // Start DMA engine. Start by enabling the S2MM so that it blocks waiting for the MM2S 
-   if(startRecv(&dev, waitInt) < 0){
+   if(startRecv(&ctx, waitInt) < 0){
      PRINT("DMA Recv failed\n");
      return -1;
    }
  }
  
  // Now for the MM2S...
- if(startSend(&dev, waitInt) < 0){
+ if(startSend(&ctx, waitInt) < 0){
    PRINT("DMA Send failed\n");
    return -1;
  }
@@ -362,14 +363,14 @@ int HotStream_startRecv(int waitInt)
  
  if(recvTransfType == 0){ // Shared Memory to Host
    // Start DMA engine. Start MM2S channel 
-   if(startSend(&dev, waitInt) < 0){
+   if(startSend(&ctx, waitInt) < 0){
      PRINT("DMA Recv failed\n");
      return -1;
    }
  }
  
  // Now for the S2MM...
- if(startRecv(&dev, waitInt) < 0){
+ if(startRecv(&ctx, waitInt) < 0){
    PRINT("DMA Send failed\n");
    return -1;
  }
@@ -381,19 +382,19 @@ int HotStream_startRecv(int waitInt)
 int HotStream_checkSend(int closeMapping)
 {
  if(sendTransfType == 0){ // Host to Shared Memory
-   if(checkRecvNoBuf() < 0){
+   if(checkRecvNoBuf(&ctx) < 0){
      PRINT("Could not verify transfer from S2MM interface to the Shared Memory\n");
      return -1;
     }
  }
 
- if(checkSend() < 0){
+ if(checkSend(&ctx) < 0){
    PRINT("Could not verify transfer from Host to MM2S interface\n");
    return -1;
  }
 
  if(closeMapping){ // Terminate current mapping to bus device space
-  return freeSend(&dev);
+  return freeSend(&ctx);
  }
 
  return 0;
@@ -402,19 +403,19 @@ int HotStream_checkSend(int closeMapping)
 int HotStream_checkRecv(int closeMapping)
 {
  if(recvTransfType == 0){ // Shared Memory to Host
-   if(checkSend() < 0){
+   if(checkSend(&ctx) < 0){
      PRINT("Could not verify transfer from Shared Memory to MM2S interface\n");
      return -1;
    } 
  }
 
- if(checkRecv() < 0){
+ if(checkRecv(&ctx) < 0){
      PRINT("Could not verify transfer from S2MM interface to the Hosty\n");
      return -1;
     }
 
  if(closeMapping){
-   return freeRecv(&dev);
+   return freeRecv(&ctx);
  }
 
  return 0;
@@ -426,13 +427,13 @@ int HotStream_linear_send(unsigned int offset, unsigned int size)
 {
   if(sendTransfType == 0){
    // Apply Linear pattern to the data copied to the Shared Memory
-   if(applyLinear_recv(offset,size,size,size) < 0){
+   if(applyLinear_recv(&ctx, offset,size,size,size) < 0){
      PRINT("Could not apply linear pattern\n");
      return -1;
    }
   } 
 
-  if(applyLinear_send(offset,size,size,size) < 0){
+  if(applyLinear_send(&ctx, offset,size,size,size) < 0){
     PRINT("Could not apply linear pattern\n");
     return -1;
   }
@@ -444,13 +445,13 @@ int HotStream_linear_recv(unsigned int offset, unsigned int size)
 {
   if(recvTransfType == 0){
     // Apply Linear pattern to the data retrieved from the Shared Memory
-    if(applyLinear_send(offset,size,size,size) < 0){
+    if(applyLinear_send(&ctx, offset,size,size,size) < 0){
       PRINT("Could not apply linear pattern\n");
       return -1;
     }
    } 
 
-   if(applyLinear_recv(offset,size,size,size) < 0){
+   if(applyLinear_recv(&ctx, offset,size,size,size) < 0){
      PRINT("Could not apply linear pattern\n");
      return -1;
    }
@@ -462,13 +463,13 @@ int HotStream_2d_send(int offset, int hsize, int stride, int vsize)
 {
   if(sendTransfType == 0){
     // Apply Linear pattern to the data copied to the Shared Memory
-    if(apply2d_recv(offset,hsize,stride,vsize) < 0){
+    if(apply2d_recv(&ctx, offset,hsize,stride,vsize) < 0){
       PRINT("Could not apply 2D pattenn\n");
       return -1;
     }
    } 
 
-   if(apply2d_send(offset,hsize,stride,vsize) < 0){
+   if(apply2d_send(&ctx, offset,hsize,stride,vsize) < 0){
      PRINT("Could not apply 2D pattern\n");
      return -1;
    }
@@ -481,13 +482,13 @@ int HotStream_2d_recv(int offset, int hsize, int stride, int vsize)
 {
   if(recvTransfType == 0){
      // Apply Linear pattern to the data retrieved from the Shared Memory
-     if(apply2d_send(offset,hsize,stride,vsize) < 0){
+     if(apply2d_send(&ctx, offset,hsize,stride,vsize) < 0){
        PRINT("Could not apply 2D pattern\n");
        return -1;
      }
     } 
 
-    if(apply2d_recv(offset,hsize,stride,vsize) < 0){
+    if(apply2d_recv(&ctx, offset,hsize,stride,vsize) < 0){
       PRINT("Could not apply 2D pattern\n");
       return -1;
     }
@@ -504,13 +505,13 @@ int HotStream_block_recv(int bsize, int mat_size, int elem_size)
 {
   if(recvTransfType == 0){
      // Apply Linear pattern to the data retrieved from the Shared Memory
-     if(applyBlocking_send(bsize, mat_size, elem_size) < 0){
+     if(applyBlocking_send(&ctx, bsize, mat_size, elem_size) < 0){
        PRINT("Could not apply blocking pattern\n");
        return -1;
      }
     } 
 
-    if(applyBlocking_recv(bsize, mat_size, elem_size) < 0){
+    if(applyBlocking_recv(&ctx, bsize, mat_size, elem_size) < 0){
       PRINT("Could not apply blocking pattern\n");
       return -1;
     }
@@ -1,17 +1,73 @@
 #ifndef _DATA_PATTERNS_H_
 #define _DATA_PATTERNS_H_
 
-int apply2d_send(int offset, int hsize, int stride, int vsize);
+#include "pciedma.h"
 
-int apply2d_recv(int offset, int hsize, int stride, int vsize);
+/* One slice of a fan-out transfer: a 2D pattern of the buffer set up on the channel, sent to its own stream destination */
+typedef struct {
+  unsigned int offset;		// Start of the slice, in bytes from the start of the buffer
+  unsigned int hsize;		// Bytes per line
+  unsigned int stride;		// Bytes between the start of two lines
+  unsigned int vsize;		// Number of lines, 1 for a linear slice (stride = hsize)
+  int tdest;			// Stream destination (TDEST/TID) of the slice
+} dma_fanout;
 
-int applyBlocking_send(int bsize, int mat_size, int elem_size);
+int apply2d_send(dma_ctx *ctx, int offset, int hsize, int stride, int vsize);
 
-int applyBlocking_recv(int bsize, int mat_size, int elem_size);
+int apply2d_recv(dma_ctx *ctx, int offset, int hsize, int stride, int vsize);
 
-int applyLinear_send(int offset, int hsize, int stride, int total_size);
+int applyBlocking_send(dma_ctx *ctx, int bsize, int mat_size, int elem_size);
 
-int applyLinear_recv(int offset, int hsize, int stride, int total_size);
+int applyBlocking_recv(dma_ctx *ctx, int bsize, int mat_size, int elem_size);
+
+int applyLinear_send(dma_ctx *ctx, int offset, int hsize, int stride, int total_size);
+
+int applyLinear_recv(dma_ctx *ctx, int offset, int hsize, int stride, int total_size);
+
+/* applySG_send/applySG_recv - One descriptor per SG entry of the buffer (or registered slice) set up on the channel
+* Parameters: ctx - DMA context
+* Returns : 0 if successful, -1 otherwise
+*/
+int applySG_send(dma_ctx *ctx);
+
+int applySG_recv(dma_ctx *ctx);
+
+/* compile2d/compileLinear/compileBlocking/compileSG - Same patterns as the apply* calls, compiled into a program for the buffer
+* set up on the channel instead of being written to the BRAM; progLoad() replays the program (see progCompile())
+* Parameters: ctx - DMA context
+*	      istx - MM2S (1) or S2MM (0) channel
+*	      prog - will hold the program
+* Returns : 0 if successful, -1 otherwise
+*/
+int compile2d(dma_ctx *ctx, int istx, dma_prog *prog, int offset, int hsize, int stride, int vsize);
+
+int compileLinear(dma_ctx *ctx, int istx, dma_prog *prog, int offset, int hsize, int stride, int total_size);
+
+int compileBlocking(dma_ctx *ctx, int istx, dma_prog *prog, int bsize, int mat_size, int elem_size);
+
+int compileSG(dma_ctx *ctx, int istx, dma_prog *prog);
+
+/* applyFanout - Describes several slices of a buffer, each one bound to its own stream destination, as a single descriptor list.
+* Every slice goes out as its own frame, so a single start scatters the buffer across as many stream slaves
+* Parameters: umem - pointer to mapped user buffer
+*	      umem_pattern - pointer to hold resulting descriptor list
+*	      fan - slices, in the order they are sent
+*	      nfan - number of slices
+* Returns : 0 if successful, -1 otherwise
+*/
+int applyFanout(pd_umem_t *umem, pd_umem_pattern **umem_pattern, dma_fanout *fan, int nfan);
+
+/* applyFanout_send/compileFanout - Fan-out of the buffer set up on the MM2S channel, written to the BRAM or compiled into a
+* program; the stream destination given at setup is ignored
+* Parameters: ctx - DMA context
+*	      prog - will hold the program
+*	      fan - slices, in the order they are sent
+*	      nfan - number of slices
+* Returns : 0 if successful, -1 otherwise
+*/
+int applyFanout_send(dma_ctx *ctx, dma_fanout *fan, int nfan);
+
+int compileFanout(dma_ctx *ctx, dma_prog *prog, dma_fanout *fan, int nfan);
 
 
 /* compressData - Takes a 2D pattern and transforms it into a stream-ready block by allocating a new buffer. Pattern must fit within ubuf 
@@ -23,6 +79,6 @@ int applyLinear_recv(int offset, int hsize, int stride, int total_size);
 *	      vsize - VSIZE of the pattern
 * Returns : 0 if successful, -1 otherwise
 */
-int compressData(void *ubuf, void *new_ubuf, int *buf_size, unsigned int offset, unsigned int hsize, unsigned int stride, unsigned int vsize);
+int compressData(void *ubuf, void **new_ubuf, int *buf_size, unsigned int offset, unsigned int hsize, unsigned int stride, unsigned int vsize);
 
 #endif
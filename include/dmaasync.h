@@ -0,0 +1,163 @@
+#ifndef _DMAASYNC_H_
+#define _DMAASYNC_H_
+
+#include "pciedma.h"
+#include <pthread.h>
+
+/* ASYNCHRONOUS COMPLETION ENGINE */
+/* ------------------------------ */
+
+#define ASYNC_HIST		1024		// Completed transfers whose status can still be queried, per channel
+#define ASYNC_QUEUE		256		// Submissions that can wait for ring slots, per class; a power of 2 below ASYNC_HIST
+
+/* Priority classes, 0 being served first. Transfers are split into chunks so that a transfer of a higher class waits behind
+ * at most the chunks already in flight, never behind the whole of a bulk transfer */
+#define ASYNC_CLASSES		4
+#define ASYNC_CLASS_BITS	2		// Bits of a token holding the class
+#define ASYNC_CLASS_CTRL	0		// Latency-sensitive traffic: instruction loads, configuration frames
+#define ASYNC_CLASS_BULK	(ASYNC_CLASSES - 1)	// Class of asyncSubmit()
+
+#define ASYNC_CHUNK_DEF		0x10000		// Default chunk size; over HSIZE_MAX, so a contiguous chunk takes one 2D descriptor
+#define ASYNC_WINDOW_DEF	0x40000		// Default bytes in flight per channel, bounds the wait of a new transfer
+
+/* Called from the completion thread once a transfer is done
+ * token - token returned by asyncSubmit()
+ * status - 0 on success, -1 if the transfer failed
+ * bytes - size in bytes of the transfer
+ * arg - user argument given to asyncSubmit()
+ */
+typedef void (*dma_callback)(long token, int status, unsigned int bytes, void *arg);
+
+/* Chunk of a transfer in flight */
+typedef struct {
+  long token;			// Token of the transfer
+  unsigned int ndesc;		// Ring slots used by the chunk
+  unsigned int len;		// Size in bytes of the chunk
+  unsigned int bytes;		// Size in bytes of the transfer
+  dma_callback cb;		// Completion callback, NULL if none
+  void *arg;			// User argument of the callback
+  int status;			// -1 if the chunk could not be handed to the engine
+  int last;			// Last chunk of the transfer
+} dma_xfer;
+
+/* Submission waiting for ring slots */
+typedef struct {
+  volatile unsigned long seq;	// Queue position the entry is free for, that position + 1 once the request is published
+  dma_reg *reg;			// Registration handle
+  unsigned int offset, len;	// Slice of the registered buffer
+  dma_callback cb;		// Completion callback, NULL if none
+  void *arg;			// User argument of the callback
+} dma_req;
+
+/* Bounded multi-producer, single-consumer submission queue. Producers claim a position with a compare-and-swap and publish
+ * their request through the seq of its entry; only the completion thread dequeues
+ */
+typedef struct {
+  dma_req req[ASYNC_QUEUE];
+  volatile unsigned long enq;	// Next position to claim, shared by the producers
+  unsigned long deq;		// Next position to dequeue, completion thread only
+} dma_subq;
+
+/* Scheduling state of a priority class on one channel */
+typedef struct {
+  dma_subq q;			// Submissions of the class
+  dma_req cur;			// Transfer being split into chunks
+  long cur_token;		// Token of cur
+  unsigned int cur_off;		// Bytes of cur already posted
+  int active;			// cur holds a transfer not fully posted
+  int failed;			// A chunk of the oldest transfer in flight failed
+  long deficit;			// Bytes the class may still post in the current round
+  long done;			// Sequence number of the last completed transfer; completion thread writes it with the lock held
+  signed char status[ASYNC_HIST]; // Status of the last completed transfers, indexed by sequence number
+} dma_class;
+
+/* Completion engine driving both channels of a context in streaming mode. Submitting threads only enqueue, without locking;
+ * a dedicated thread schedules the queued requests into free ring slots, reaps the rings, runs the callbacks and signals the
+ * eventfd, so submitting threads never wait on the device nor on each other */
+typedef struct {
+  dma_ctx *ctx;			// DMA context driven by the engine; must not be used directly while the engine runs
+  pthread_t thread;		// Completion thread, the only one driving the context
+  pthread_mutex_t lock;		// Protects the completion state (done, status of the classes, stopped)
+  pthread_cond_t cond;		// Signalled on completion, and on submission while the completion thread is idle
+  volatile int running;		// Cleared by asyncStop()
+  volatile int idle;		// Completion thread is about to block until the next submission
+  int stopped;			// Completion thread has exited
+  int efd;			// eventfd incremented once per completed transfer, -1 if disabled
+  dma_class cls[2][ASYNC_CLASSES]; // Priority classes per channel (S2MM, MM2S)
+  unsigned int chunk;		// Largest chunk posted at once
+  unsigned int window;		// Bytes in flight above which no chunk is posted
+  unsigned int share[ASYNC_CLASSES]; // Relative bandwidth of each class, in chunks per round
+  dma_xfer xfer[2][RING_SLOTS];	// Chunks in flight per channel, in posting order; completion thread only
+  unsigned int head[2];		// Next free entry of xfer
+  unsigned int count[2];	// Chunks in flight
+  unsigned int inflight[2];	// Bytes in flight
+} dma_async;
+
+/* Starts the completion engine on a context: both channels are put in streaming mode and the completion thread is started
+ * Arguments: as - engine to initialize
+ * 	      ctx - DMA context previously initialized by initDMA()
+ * 	      use_eventfd - create an eventfd signalled on every completion (see asyncEventFd())
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int asyncInit(dma_async *as, dma_ctx *ctx, int use_eventfd);
+
+/* Queues a slice of a registered buffer and returns without waiting. Any number of threads may submit at once without
+ * locking; a submitter blocks only while the submission queue of the channel is full. Transfers of a channel are carried out
+ * in the order their submissions claimed a queue position
+ * Arguments: as - completion engine
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      reg - registration handle
+ * 	      offset, len - slice of the registered buffer
+ * 	      cb - callback run by the completion thread when the transfer is done, NULL if none
+ * 	      arg - user argument of the callback
+ * Returns: token identifying the transfer, -1 otherwise
+ */
+long asyncSubmit(dma_async *as, int istx, dma_reg *reg, unsigned int offset, unsigned int len, dma_callback cb, void *arg);
+
+/* Same as asyncSubmit() in a given priority class. Transfers of a class are carried out in submission order; between classes,
+ * the chunk posted next comes from the highest class that has not used up its share of the current round. Each chunk of a send
+ * goes out as a frame of its own. Receives ignore the class: the device decides which frame fills a buffer, so receive buffers
+ * are posted whole and in submission order
+ * Arguments: cls - priority class, ASYNC_CLASS_CTRL (first served) to ASYNC_CLASS_BULK
+ * 	      Other arguments as in asyncSubmit()
+ * Returns: token identifying the transfer, -1 otherwise
+ */
+long asyncSubmitClass(dma_async *as, int istx, int cls, dma_reg *reg, unsigned int offset, unsigned int len, dma_callback cb,
+                      void *arg);
+
+/* Sets the quality of service of the engine; to be called after asyncInit(), before the first submission
+ * Arguments: as - completion engine
+ * 	      chunk - largest piece of a transfer posted at once (ASYNC_CHUNK_DEF by default); smaller chunks preempt sooner
+ * 	      window - bytes in flight per channel above which no chunk is posted (ASYNC_WINDOW_DEF by default); a new transfer
+ * 	               waits for at most window + chunk bytes of other classes
+ * 	      share - relative bandwidth of each class under load, in chunks per round (8, 4, 2, 1 by default); NULL keeps them
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int asyncSetQos(dma_async *as, unsigned int chunk, unsigned int window, const unsigned int *share);
+
+/* Checks a transfer without blocking
+ * Arguments: as - completion engine
+ * 	      token - token returned by asyncSubmit()
+ * Returns: 1 if the transfer completed successfully, 0 if it is still in flight, -1 if it failed
+ */
+int asyncPoll(dma_async *as, long token);
+
+/* Waits until a transfer is done
+ * Arguments: as - completion engine
+ * 	      token - token returned by asyncSubmit()
+ * Returns: 0 on sucess, -1 if the transfer failed
+ */
+int asyncWait(dma_async *as, long token);
+
+/* Returns the eventfd of the engine, to be used with poll()/select(); each read returns the number of transfers completed
+ * since the previous read. -1 if the engine was started without eventfd
+ */
+int asyncEventFd(dma_async *as);
+
+/* Waits for the transfers in flight, stops the completion thread and takes both channels out of streaming mode
+ * Arguments: as - completion engine
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int asyncStop(dma_async *as);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef _DMABUF_H_
+#define _DMABUF_H_
+
+#include "pciedma.h"
+#include <stddef.h>
+
+/* DMA BUFFER ALLOCATOR */
+/* -------------------- */
+
+/* Backing of a buffer, also used as flags to restrict the allocator */
+#define DMABUF_HUGE_1G		0x1		// 1 GB hugepages
+#define DMABUF_HUGE_2M		0x2		// 2 MB hugepages
+#define DMABUF_PAGES		0x4		// Regular pages (transparent hugepages requested)
+#define DMABUF_ANY		(DMABUF_HUGE_1G | DMABUF_HUGE_2M | DMABUF_PAGES)
+
+/* DMA-ready buffer: allocated, pinned and registered with a context */
+typedef struct {
+  void *vaddr;			// User address of the buffer
+  size_t size;			// Size in bytes requested
+  size_t alloc_size;		// Size in bytes allocated (rounded up to the page size)
+  int kind;			// DMABUF_HUGE_1G, DMABUF_HUGE_2M or DMABUF_PAGES
+  dma_reg *reg;			// Registration of the buffer with the context
+  int nsegs;			// Physically contiguous segments the buffer maps to
+} dma_buf;
+
+/* Allocates a buffer backed by the largest pages available, trying 1 GB hugepages, then 2 MB hugepages, then regular pages,
+ * and registers it with the context. Larger pages give fewer SG entries and therefore fewer, larger descriptors. Hugepages
+ * larger than the buffer are skipped when a smaller backing is allowed
+ * Arguments: ctx - DMA context
+ * 	      size - size in bytes of the buffer
+ * 	      flags - backings allowed (DMABUF_* ORed together), DMABUF_ANY for all
+ * 	      buf - will hold the buffer
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int dmabufAlloc(dma_ctx *ctx, size_t size, int flags, dma_buf *buf);
+
+/* Unregisters and releases a buffer allocated with dmabufAlloc()
+ * Arguments: ctx - DMA context
+ * 	      buf - buffer to release
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int dmabufFree(dma_ctx *ctx, dma_buf *buf);
+
+/* KERNEL BUFFER POOL */
+/* ------------------ */
+
+#define KPOOL_SIZE_MAX		0x400000	// Largest kernel buffer; one descriptor of the 2D format can describe it
+
+/* Pool of physically contiguous kernel buffers of the same size, allocated once and handed out without pinning */
+typedef struct {
+  dma_ctx *ctx;			// Context the buffers were allocated with
+  dma_kbuf *bufs;		// Buffers of the pool
+  int nbufs;			// Number of buffers
+  unsigned int size;		// Size in bytes of each buffer
+  int next;			// Next buffer to look at in kpoolGet()
+} dma_kpool;
+
+/* Allocates the buffers of a pool. Each buffer is physically contiguous and falls within a single AXI2PCIE window, so a
+ * transfer from/to it is one translated entry that needs no pd_mapUserMemory() and no pd_syncUserMemory()
+ * Arguments: ctx - DMA context
+ * 	      pool - will hold the pool
+ * 	      nbufs - number of buffers
+ * 	      size - size in bytes of each buffer, at most KPOOL_SIZE_MAX
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int kpoolInit(dma_ctx *ctx, dma_kpool *pool, int nbufs, unsigned int size);
+
+/* Takes a free buffer from a pool
+ * Arguments: pool - kernel buffer pool
+ * Returns: the buffer, NULL if every buffer is in use
+ */
+dma_kbuf *kpoolGet(dma_kpool *pool);
+
+/* Returns a buffer to its pool; the buffer must not be used by a transfer in flight
+ * Arguments: pool - kernel buffer pool
+ * 	      kb - buffer obtained from kpoolGet()
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int kpoolPut(dma_kpool *pool, dma_kbuf *kb);
+
+/* Releases the buffers of a pool
+ * Arguments: pool - kernel buffer pool
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int kpoolFree(dma_kpool *pool);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef _DMADEMUX_H_
+#define _DMADEMUX_H_
+
+#include "pciedma.h"
+#include "dmabuf.h"
+
+/* RECEIVE DEMULTIPLEXER */
+/* --------------------- */
+
+#define DEMUX_STREAMS		32		// Streams told apart; TDEST and TID are 5 bits wide
+#define DEMUX_DEPTH		64		// Fragments each stream queue can hold, at least the buffers of the pool
+
+/* Field of the stream sideband that selects the queue of a frame */
+#define DEMUX_BY_TDEST		0
+#define DEMUX_BY_TID		1
+
+/* Fragment of a received frame: one pool buffer, filled by one descriptor. A frame larger than a pool buffer arrives as several
+ * fragments in a row, the last one flagged eof
+ */
+typedef struct {
+  dma_kbuf *kb;			// Buffer holding the data, owned by the caller until demuxRelease()
+  unsigned int len;		// Bytes received in the buffer
+  int tdest, tid;		// Stream sideband of the frame
+  int sof, eof;			// Fragment starts/ends its frame
+} dma_frag;
+
+/* Queue of the fragments received for one stream */
+typedef struct {
+  dma_frag frag[DEMUX_DEPTH];
+  unsigned int head, count;
+} dma_fragq;
+
+/* S2MM channel in streaming mode, kept supplied with pool buffers; completed buffers are routed to the queue of their stream */
+typedef struct {
+  dma_ctx *ctx;			// Context the S2MM channel belongs to
+  dma_kpool *pool;		// Buffers posted to the ring
+  int key;			// DEMUX_BY_TDEST or DEMUX_BY_TID
+  dma_kbuf *posted[RING_SLOTS];	// Buffer of each descriptor in flight, in ring order
+  unsigned int posted_head, posted_count;
+  dma_fragq q[DEMUX_STREAMS];	// Fragments waiting for the consumer of each stream
+} dma_demux;
+
+/* Puts the S2MM channel in streaming mode and posts pool buffers to it, one descriptor each, for frames of any number of
+ * producers. Every buffer of the pool must be free, and all of them reachable through the same AXI2PCIE window since buffers
+ * stay posted while others are received
+ * Arguments: ctx - DMA context
+ * 	      dmx - will hold the demultiplexer
+ * 	      pool - kernel buffers to receive into; buffers must fit a single descriptor
+ * 	      key - DEMUX_BY_TDEST or DEMUX_BY_TID
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int demuxInit(dma_ctx *ctx, dma_demux *dmx, dma_kpool *pool, int key);
+
+/* Routes the buffers completed since the last call to the queues of their streams and posts free pool buffers in their place
+ * Arguments: dmx - demultiplexer
+ * 	      wait - 1 to wait, following the wait policy of the channel, until at least one buffer completes
+ * Returns: number of fragments routed, -1 on error
+ */
+int demuxPoll(dma_demux *dmx, int wait);
+
+/* Takes the oldest fragment received for a stream
+ * Arguments: dmx - demultiplexer
+ * 	      stream - TDEST or TID of the stream, as selected at demuxInit()
+ * 	      frag - will hold the fragment
+ * 	      wait - 1 to wait until a fragment of the stream arrives
+ * Returns: 1 if a fragment was taken, 0 if none is queued (wait = 0), -1 on error
+ */
+int demuxRecv(dma_demux *dmx, int stream, dma_frag *frag, int wait);
+
+/* Hands the buffer of a fragment back, to be posted again
+ * Arguments: dmx - demultiplexer
+ * 	      frag - fragment taken with demuxRecv()
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int demuxRelease(dma_demux *dmx, dma_frag *frag);
+
+/* Stops the S2MM channel; buffers in flight and fragments not taken go back to the pool
+ * Arguments: dmx - demultiplexer
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int demuxStop(dma_demux *dmx);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef _DMAPIPE_H_
+#define _DMAPIPE_H_
+
+#include "pciedma.h"
+
+/* SEND/RECEIVE PIPELINE */
+/* --------------------- */
+
+#define PIPE_CHUNK_DEF		0xF000		// Default chunk size; fits a single HSIZE, and two page-aligned chunks over 4 KB
+					// pages (15 descriptors each) fit in the 31 usable ring slots
+
+/* Streams a registered input buffer to the device and the results back into a registered output buffer, chunk by chunk.
+ * Both channels run in streaming mode: receive chunks are posted ahead on the S2MM ring while send chunks are posted on the
+ * MM2S ring, so chunk k+1 is set up while chunk k is still draining and the link never waits for per-transfer setup
+ * Arguments: ctx - DMA context
+ * 	      sreg - registered input buffer
+ * 	      in_size - bytes to send from the start of sreg
+ * 	      rreg - registered output buffer
+ * 	      out_size - bytes to receive at the start of rreg
+ * 	      chunk - bytes per descriptor group; 0 selects PIPE_CHUNK_DEF
+ * 	      str_dest - stream destination of the input data
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int pipeStreamReg(dma_ctx *ctx, dma_reg *sreg, unsigned int in_size, dma_reg *rreg, unsigned int out_size, unsigned int chunk, int str_dest);
+
+/* Same as pipeStreamReg() for buffers that are not registered; both buffers are registered for the duration of the call
+ * Arguments: ctx - DMA context
+ * 	      in, in_size - input buffer
+ * 	      out, out_size - output buffer
+ * 	      chunk - bytes per descriptor group; 0 selects PIPE_CHUNK_DEF
+ * 	      str_dest - stream destination of the input data
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int pipeStream(dma_ctx *ctx, void *in, unsigned int in_size, void *out, unsigned int out_size, unsigned int chunk, int str_dest);
+
+#endif
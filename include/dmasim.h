@@ -0,0 +1,103 @@
+#ifndef _DMASIM_H_
+#define _DMASIM_H_
+
+#include "pciedma.h"
+#include <pthread.h>
+#include <time.h>
+
+/* SIMULATED AXI DMA BACKEND */
+/* ------------------------- */
+
+#define SIM_BAR_SIZE		0x10000		// Size of the simulated BAR0
+#define SIM_DDR_DEF		0x4000000	// Default size of the simulated DDR3 (64 MB)
+#define SIM_FIFO_SIZE		0x40000		// Bytes buffered in the loopback stream between MM2S and S2MM
+#define SIM_FRAMES		256		// Frames the loopback stream can hold
+#define SIM_MAPS		64		// User and kernel memory mappings the simulator can hold
+#define SIM_PA_BASE		0x10000000	// First bus address handed out to mappings
+#define SIM_BURST		0x10000		// Bytes a channel moves before the other channel gets its turn
+#define SIM_DELAY_NS		1000		// Length of one unit of the interrupt delay timer
+#define SIM_IDLE_SPINS		1000		// Idle iterations of the simulator thread before it starts sleeping
+
+/* Configuration of the simulator; fields left to zero take the defaults */
+typedef struct {
+  unsigned int ddr_size;	// Size in bytes of the simulated DDR3, SIM_DDR_DEF by default
+  unsigned int seg_size;	// Size of the physically contiguous segments user memory is split into, the page size by default
+  unsigned int discard_mask;	// Stream destinations (one bit per TDEST) whose data is consumed instead of looped back to S2MM
+  unsigned int idle_us;		// Sleep of the simulator thread when there is no work; 0 to spin
+  unsigned int fault_every;	// Every fault_every-th descriptor fetched fails with a slave error before moving data; 0 never
+} dma_sim_cfg;
+
+/* State of a simulated channel */
+typedef struct {
+  int running;			// DMACR.RS has been seen set
+  unsigned int sr;		// DMASR as last written by the simulator
+  unsigned int first;		// AXI address of the first descriptor after the channel was started
+  unsigned int last;		// AXI address of the last completed descriptor, 0 if none since the start
+  int active;			// A descriptor is being processed
+  unsigned int desc;		// AXI address of that descriptor
+  unsigned int addr, hsize, vsize, stride, ctl, mc; // Its buffer layout, CONTROL and MC_CTL words
+  unsigned int line, pos;	// Progress within the buffer
+  unsigned int bytes;		// Bytes moved for the descriptor
+  int sof, eof;			// Descriptor starts/ends a frame (S2MM)
+  int framed;			// Frame of the descriptor set up in the loopback stream (MM2S)
+  unsigned int dest;		// TDEST/TID of the frame received (S2MM)
+  unsigned int irq_count;	// Completions not covered by an interrupt yet
+  struct timespec last_cmplt;	// Time of the last completion, for the delay timer
+} sim_chan;
+
+/* Host memory made visible to the simulated device at a range of bus addresses */
+typedef struct {
+  unsigned long pa;		// First bus address
+  unsigned long span;		// Bus addresses covered
+  char *vaddr;			// Host address of the first segment
+  unsigned long seg;		// Segment size; segment i is seen at pa + 2*i*seg, 0 if the mapping is contiguous
+  void *alloc;			// Memory allocated by the simulator (kernel buffers), NULL for user memory
+  int in_use;
+} sim_map;
+
+/* Frame travelling through the loopback stream */
+typedef struct {
+  unsigned long long end;	// Stream position after its last byte, valid once closed
+  unsigned int dest;		// TDEST/TID it was sent with
+  int closed;			// Its last byte has been sent
+} sim_frame;
+
+/* Simulated device: the BAR is host memory and a thread plays the part of the AXI DMA. MM2S streams are looped back to
+ * S2MM, the AXI side of the PCIe bridge is translated through AXIBAR2PCIEBAR0 and the DDR3 is a host buffer
+ */
+typedef struct {
+  dma_sim_cfg cfg;
+  void *bar;			// Simulated BAR0
+  unsigned char *ddr;		// Simulated DDR3, at AXI address 0
+  sim_chan chan[2];		// S2MM (0) and MM2S (1) channels
+  unsigned char *fifo;		// Loopback stream
+  unsigned long long fifo_in;	// Bytes pushed into the stream
+  unsigned long long fifo_out;	// Bytes popped from the stream
+  sim_frame frame[SIM_FRAMES];	// Frames in the stream
+  unsigned int frame_in;	// Frames opened
+  unsigned int frame_out;	// Frames fully received
+  sim_map map[SIM_MAPS];	// Memory mappings
+  unsigned int irq_pending;	// Interrupts raised and not waited for
+  unsigned int fetched;		// Descriptors fetched by both channels, for fault injection
+  pthread_mutex_t lock;		// Protects the mappings and the interrupts
+  pthread_cond_t irq;		// Signalled when an interrupt is raised
+  pthread_t thread;		// Simulator thread
+  volatile int running;
+} dma_sim;
+
+extern const dma_ops sim_ops;
+
+/* Creates a simulated device and starts its thread; the device is then used through initDMAbackend(ctx, &sim_ops, sim)
+ * Arguments: sim - will hold the device
+ * 	      cfg - configuration, NULL for the defaults
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int simOpen(dma_sim *sim, const dma_sim_cfg *cfg);
+
+/* Stops the thread of a simulated device and releases it; contexts using it must be stopped first
+ * Arguments: sim - simulated device
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int simClose(dma_sim *sim);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef _DMATRACE_H_
+#define _DMATRACE_H_
+
+#include "pciedma.h"
+#include <stdio.h>
+
+/* PHASE TRACE ANALYSIS */
+/* -------------------- */
+
+#define TRACE_BUCKETS		32		// Histogram buckets; bucket b counts durations in [2^b, 2^(b+1)) ns, bucket 0 also counts 0 ns
+
+/* Latency statistics of one phase */
+typedef struct {
+  unsigned int count;		// Records of the phase
+  unsigned long long total_ns;	// Sum of their durations
+  unsigned long long bytes;	// Sum of their counts (bytes or descriptors, see dma_trace_rec)
+  unsigned int min_ns, max_ns;
+  unsigned int p50_ns, p90_ns, p99_ns;	// Percentiles of the durations
+  unsigned int hist[TRACE_BUCKETS];	// Log2 histogram of the durations
+} dma_trace_stats;
+
+/* Copies the complete records of a trace ring, oldest first. Records being written, or overwritten during the copy, are skipped
+ * Arguments: tr - trace ring
+ * 	      recs - will hold the records
+ * 	      max - room in recs, TRACE_SLOTS holds a full ring
+ * Returns: number of records copied
+ */
+int traceSnapshot(dma_trace *tr, dma_trace_rec *recs, int max);
+
+/* Computes the latency statistics of every phase from the records of a trace ring
+ * Arguments: tr - trace ring
+ * 	      stats - will hold the statistics, indexed by phase (TRACE_PHASES entries)
+ * Returns: number of records used, -1 on error
+ */
+int traceStats(dma_trace *tr, dma_trace_stats *stats);
+
+/* Prints a table of the statistics of every traced phase, with its histogram
+ * Arguments: tr - trace ring
+ * 	      f - output stream
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int traceReport(dma_trace *tr, FILE *f);
+
+/* Writes the records of a trace ring as CSV (phase,chan,start_ns,ns,count), for offline analysis
+ * Arguments: tr - trace ring
+ * 	      f - output stream
+ * Returns: number of records written, -1 on error
+ */
+int traceExport(dma_trace *tr, FILE *f);
+
+/* Discards the records of a trace ring; no context may be recording into it meanwhile
+ * Arguments: tr - trace ring
+ */
+void traceClear(dma_trace *tr);
+
+/* Returns the name of a phase */
+const char *tracePhaseName(int phase);
+
+#endif
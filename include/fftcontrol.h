@@ -1,3 +1,5 @@
+#include "pciedma.h"
+
 
 
 #define FFT_BASE	0x5000
@@ -15,14 +17,14 @@
 #define SCALING_SHIFT	9
 
 
-unsigned int readFFTstatus();
+unsigned int readFFTstatus(dma_ctx *ctx);
 
-int configFFT(int size,int scaling, int fwdinv);
+int configFFT(dma_ctx *ctx, int size,int scaling, int fwdinv);
 
-int setFFTsize(int size);
+int setFFTsize(dma_ctx *ctx, int size);
 
-int setFFTfwdinv(int fwdinv);
+int setFFTfwdinv(dma_ctx *ctx, int fwdinv);
 
-int setFFTscaling(int scale_sched);
+int setFFTscaling(dma_ctx *ctx, int scale_sched);
 
-int FFTreset();
+int FFTreset(dma_ctx *ctx);
@@ -6,6 +6,7 @@ typedef struct sg_pat{
   unsigned int hsize;
   unsigned int vsize;
   unsigned int stride;
+  int tdest;			// Stream destination of a TX descriptor, -1 for the one of the transfer
   struct sg_pat *next;
 } sgentry_pattern;
 
@@ -34,6 +35,15 @@ sgentry_pattern *sglist_new();
 */
 int sglist_push(sgentry_pattern *base, unsigned int addr, unsigned int hsize, unsigned int vsize, unsigned int stride);
 
+/* sglist_push_split - Pushes the descriptors describing a contiguous segment of any length. Segments beyond the 16-bit HSIZE
+* are described as HSIZE x VSIZE blocks (VSIZE up to 13 bits), plus a 1D descriptor for the remainder
+* Parameters: base - a pointer to the head of the stack
+* 	      addr - base address of the segment
+* 	      len - size in bytes of the segment
+* Returns: number of descriptors pushed, -1 otherwise
+*/
+int sglist_push_split(sgentry_pattern *base, unsigned int addr, unsigned int len);
+
 /* sglist_pop - Pops a descriptor from the beginning of the stack
 * Parameters: base - a pointer to the head of the stack
 * Returns: A pointer to a descriptor element
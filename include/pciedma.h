@@ -1,5 +1,9 @@
+#ifndef _PCIEDMA_H_
+#define _PCIEDMA_H_
+
 #include "/root/Documents/spaiagua/Swinger/pcie_dev_driver/pciDriver/include/lib/pciDriver.h"
 #include <stdarg.h>
+#include "patterns.h"
 
 #define MAX_KBUF (8*1024*1024)
 #define MAX_UBUF (64*1024*1024)
@@ -46,6 +50,8 @@
 #define DMACR_Err_IrqEn		0x4000		// Interrupt on Error Interrupt Enable (R/W)
 #define DMACR_IRQThreshold	0xFF0000	// Interrupt Threshold value - 8bits - (R/W)
 #define DMACR_IRQDelay		0xFF000000	// Interrupt Delay Time Out - 8bits - (R/W)
+#define IRQTHRESHOLD_SHIFT	16
+#define IRQDELAY_SHIFT		24
 
 #define DMASR_HALTED		0x1		// Run/Stop state of the DMA channel (RO)
 #define DMASR_IDLE		0x2		// Idle state of the DMA channel (RO)
@@ -61,6 +67,7 @@
 #define DMASR_ERR_IRQ		0x4000 		// Interrupt on Error (R/W)
 #define DMASR_IRQTHRESHOLDSTS	0xFF0000 		// Interrupt Threshold Status - 8bits - (RO)
 #define DMASR_IRQDELAYSTS	0xFF000000 		// Interrupt Delay Time Status - 8bits - (RO)
+#define DMASR_ERR_MASK		(DMASR_DMAINTERR | DMASR_DMASLVERR | DMASR_DMADECERR | DMASR_SGINTERR | DMASR_SGSLVERR | DMASR_SGDECERR)
 
 #define CURDESC_PTR		0xFFFFFFC0	// Current Descriptor Pointer - 26 bits - (RO) - Only written when DMACR.RS=0 and DMASR.Halted=1
 #define TAILDESC_PTR		0xFFFFFFC0	// Tail Descriptor Pointer - 26 bits - (R/W)
@@ -73,6 +80,11 @@
 #define CONTROL			0x18		// Control
 #define STATUS			0x1C		// Status
 
+#define DESC_SIZE		0x40		// Descriptors are placed 16 words apart in the BRAM
+#define RING_SLOTS		32		// Descriptor slots in each half (0x800 bytes) of the BRAM
+#define RING_FULL		-2		// Returned by the stream submit calls when the ring lacks free slots
+#define DESC_BURST		4		// 64-bit words of a descriptor copied to the BRAM (NXTDESC to STATUS)
+
 /* Bit Masks */
 #define NXTDESC_PTR		0xFFFFFFC0	// Descriptor pointer mask - 26 bits
 
@@ -100,6 +112,9 @@
 #define HSIZE			0xFFFF		// Number of bytes to transfer in each horizontal line (Substitutes CONTROL_BUFFLEN when using 2D Access)
 
 #define CONTROL_BUFFLEN		0x7FFFFF	// Buffer length - 23 bits
+#define DESC_SPLIT_LEN		0x400000	// Size of the pieces a segment over CONTROL_BUFFLEN is split into (1D descriptors)
+#define HSIZE_MAX		0xFFFF		// Largest HSIZE (and STRIDE) of a 2D descriptor
+#define VSIZE_MAX		0x1FFF		// Largest VSIZE of a 2D descriptor - 13 bits
 #define CONTROL_TXEOF		0x4000000	// Transmit End Of Frame - 1 bit - MM2S ONLY
 #define CONTROL_TXSOF		0x8000000	// Transmit Start Of Frame - 1 bit - MM2S ONLY
 
@@ -110,6 +125,7 @@
 #define STATUS_DMASLVERR	0x20000000	// DMA Slave Error - 1 bit
 #define STATUS_DMADECERR	0x40000000	// DMA Decode Error - 1 bit
 #define STATUS_CMPLT		0x80000000	// Completed transfer
+#define STATUS_ERR_MASK		(STATUS_DMAINTERR | STATUS_DMASLVERR | STATUS_DMADECERR)
 
 /* Register Mapping and Bit masks for the CMU */
 #define CMU_ICR			0x0		// Instruction Configuration Register
@@ -152,90 +168,393 @@
 
 /* ----------------- */
 
+/* DMA CONTEXT */
+/* ----------- */
+
+#define DMA_MAX_REG		16		// Number of buffers that can be registered with a context
+
+/* Part of a buffer addressable through one AXI2PCIE window */
+typedef struct {
+  unsigned int base;		// AXI2PCIE translation base of the window
+  unsigned int offset;		// Offset in bytes, within the buffer, of the first byte in the window
+  unsigned int size;		// Bytes of the buffer in the window
+} dma_window;
+
+/* Physically contiguous kernel buffer mapped into user space; transfers need no pinning, no cache sync and a single descriptor */
+typedef struct {
+  pd_kmem_t km;			// Kernel memory handle
+  void *vaddr;			// User address of the buffer
+  unsigned int size;		// Size in bytes of the buffer
+  unsigned int axi_addr;	// Address of the buffer on the AXI side
+  unsigned int base_axi2pcie;	// AXI2PCIE translation base of the buffer
+  int in_use;			// Buffer is handed out by its pool
+} dma_kbuf;
+
+/* Completion wait policies */
+#define DMA_WAIT_SPIN		0		// Busy-poll the status register until the condition is met
+#define DMA_WAIT_SLEEP		1		// Busy-poll for spin_ns, then sleep sleep_us between polls
+#define DMA_WAIT_IRQ		2		// Busy-poll for spin_ns, then block on the device interrupt between polls
+
+#define DMA_SPIN_DEF		20000		// Default busy-poll budget in ns
+#define DMA_SLEEP_DEF		1		// Default sleep between polls in us
+
+/* How a channel waits for the engine (completion, halt, reset) */
+typedef struct {
+  int mode;			// DMA_WAIT_SPIN, DMA_WAIT_SLEEP or DMA_WAIT_IRQ
+  unsigned long spin_ns;	// Busy-poll budget before backing off
+  unsigned int sleep_us;	// Sleep between polls once the budget is exhausted (DMA_WAIT_SLEEP)
+} dma_wait;
+
+/* Transfer phases timed by the tracer */
+#define TRACE_MAP		0		// Pinning and mapping of user memory
+#define TRACE_TRANSLATE		1		// Translation of the SG list to AXI addresses
+#define TRACE_DESC		2		// Copy of the descriptors to the BRAM
+#define TRACE_START		3		// Channel halt, CURDESC write and restart
+#define TRACE_TAIL		4		// TAILDESC write handing the descriptors to the engine
+#define TRACE_IDLE		5		// Wait for the channel to go idle or for a descriptor to complete
+#define TRACE_STATUS		6		// Walk of the descriptor status words
+#define TRACE_SYNC		7		// Cache sync of user memory
+#define TRACE_UNMAP		8		// Unmapping of user memory
+#define TRACE_PHASES		9
+
+#define TRACE_NOCHAN		2		// Channel of a record not tied to MM2S (1) or S2MM (0)
+#define TRACE_SLOTS		4096		// Records kept by a trace ring (power of two); older records are overwritten
+
+/* Timing of one phase of a transfer */
+typedef struct {
+  volatile unsigned long long seq;	// Position of the record in the ring plus one, 0 while it is being written
+  unsigned long long start_ns;	// Monotonic time at the start of the phase
+  unsigned int ns;		// Duration of the phase
+  unsigned short phase;		// TRACE_MAP to TRACE_UNMAP
+  unsigned short chan;		// MM2S (1), S2MM (0) or TRACE_NOCHAN
+  unsigned int count;		// Bytes (map, translate, sync, unmap) or descriptors (other phases) handled
+} dma_trace_rec;
+
+/* Ring of phase records; writers claim slots with an atomic increment, so contexts used from different threads can share one */
+typedef struct {
+  volatile unsigned long long head;	// Records claimed since the ring was cleared
+  dma_trace_rec rec[TRACE_SLOTS];
+} dma_trace;
+
+/* User buffer registered once with the device; its mapping and translated SG list are reused by every transfer until it is unregistered */
+typedef struct {
+  void *vaddr;			// User address of the buffer
+  unsigned int size;		// Size in bytes of the buffer
+  pd_umem_t um;			// Mapping of the buffer to device space
+  pd_umem_t *umem_tr;		// Translated SG list (AXI side) of the whole buffer
+  unsigned int base_axi2pcie;	// AXI2PCIE translation base of the first window of the buffer
+  dma_window *win;		// Consecutive parts of the buffer sharing an AXI2PCIE window
+  int nwin;			// Number of windows
+  int in_use;			// 1 if this pool entry holds a registration
+} dma_reg;
+
+/* Descriptor chain compiled once from a pattern (see progCompile()). The descriptor words are kept exactly as they are copied
+ * to the BRAM half of the channel, so replaying the chain costs a single burst copy instead of regenerating the pattern
+ */
+typedef struct {
+  int istx;			// MM2S (1) or S2MM (0) channel the program was compiled for
+  unsigned int nents;		// Number of descriptors (1 to RING_SLOTS)
+  unsigned int bytes;		// Bytes moved by the whole chain
+  unsigned int axi2pcie;	// AXI2PCIE translation base the buffer addresses refer to
+  dma_reg *reg;			// Registered buffer transferred, NULL if none
+  dma_kbuf *kbuf;		// Kernel buffer transferred, NULL if none
+  unsigned long long image[RING_SLOTS][DESC_BURST]; // Descriptor words, linked for the BRAM half of the channel
+} dma_prog;
+
+/* State of one direction (MM2S or S2MM) of the DMA engine */
+typedef struct {
+  pd_umem_t um;			// User memory mapped to device space
+  pd_umem_t *umem_tr;		// Mapped memory with addresses referred to the AXI side
+  int mapped;			// 1 if um holds a live mapping that must be released
+  dma_reg *reg;			// Registered buffer used by the current transfer, NULL if the channel owns its mapping
+  dma_kbuf *kbuf;		// Kernel buffer used by the current transfer, NULL if none
+  int istx;			// MM2S (1) or S2MM (0) channel
+  unsigned int reg_base;	// Offset of the channel registers relative to the MM2S registers (0x0 or 0x30)
+  dma_wait wait;		// Wait policy of the channel
+  int irq_en;			// Completion and error interrupts are enabled on the channel
+  unsigned int irq_threshold;	// Completed descriptors per completion interrupt (1-255)
+  unsigned int irq_delay;	// Delay timer for a partial batch, 0 disables it (0-255)
+  int ring_running;		// Channel is kept running in streaming (ring) mode
+  unsigned int ring_head;	// Next free descriptor slot
+  unsigned int ring_tail;	// Oldest submitted slot not yet completed
+  unsigned int ring_count;	// Number of submitted slots not yet completed
+  unsigned int ring_unflushed;	// Slots pushed since TAILDESC was last advanced
+  sgentry_pattern *pending;	// Descriptors waiting for a free slot (list head), NULL if none
+  unsigned int pending_nents;	// Number of descriptors in the pending list
+  int pending_sof;		// Next pending descriptor starts a frame
+  int chunked;			// One-shot transfer too long for the BRAM, fed through the ring by the refill engine
+  unsigned int desc_base;	// BRAM location of the first descriptor of this channel
+  unsigned int tail_desc;	// BRAM location of the tail descriptor of the current chain
+  unsigned int xfer_bytes;	// Bytes reported by the descriptors of the last completed chain
+  int armed;			// TAILDESC of the one-shot chain has been written
+  unsigned int seen_desc;	// First descriptor of the one-shot chain not yet seen completed by recvProgress()
+  unsigned int seen_bytes;	// Bytes of the descriptors seen completed so far
+  unsigned int synced_bytes;	// Bytes of seen_bytes already synced for the CPU
+  int seen_done;		// recvProgress() has seen the tail descriptor complete
+  unsigned int retries;		// In-place recoveries allowed per failed descriptor, 0 resets the BRAM on error (see setRecovery())
+  unsigned int retried;		// In-place recoveries of the descriptor that failed last
+  unsigned int fail_desc;	// CURDESC at the last error, to tell a repeated failure from a new one
+  unsigned int recovered;	// In-place recoveries since the context was initialized
+} dma_chan;
+
+/* Backend operations: access to the BAR, user/kernel memory mappings and interrupts. pd_ops drives a board through
+ * pciDriver; other backends (e.g. the simulator in dmasim.h) provide the same operations on their own device handle
+ */
+typedef struct {
+  const char *name;
+  void *(*map_bar)(void *dev);
+  int (*unmap_bar)(void *dev, void *bar);
+  int (*map_umem)(void *dev, void *mem, unsigned int size, pd_umem_t *um);
+  int (*unmap_umem)(void *dev, pd_umem_t *um);
+  int (*sync_umem)(void *dev, pd_umem_t *um, int dir);
+  void *(*alloc_kmem)(void *dev, unsigned int size, pd_kmem_t *km);
+  int (*free_kmem)(void *dev, pd_kmem_t *km);
+  int (*wait_irq)(void *dev);
+} dma_ops;
+
+extern const dma_ops pd_ops;
+
+#define REG_OWNED		7		// Registers only the host writes, kept in a shadow (see regRead())
+
+/* Per-device handle; owns the BAR mapping, the descriptor chains and the in-flight mappings of both channels.
+ * Contexts are independent from each other, so several boards (or several streams) can be driven from
+ * different threads as long as each context is used by a single thread at a time
+ */
+typedef struct {
+  pd_device_t *pdev;		// PCIe device handler, NULL for other backends
+  const dma_ops *ops;		// Backend operations
+  void *dev;			// Device handle of the backend
+  void *bar;			// Pointer to the PCIE aperture
+  dma_chan snd;			// MM2S channel
+  dma_chan recv;		// S2MM channel
+  int dest_tx;			// Stream destination of the MM2S descriptors
+  dma_reg reg[DMA_MAX_REG];	// Pool of registered buffers
+  unsigned long long shadow[2*RING_SLOTS][DESC_BURST]; // Host image of the descriptor slots of both channels
+  unsigned long long dirty;	// Slots modified in the shadow and not yet copied to the BRAM
+  dma_trace *trace;		// Phase timing records, NULL when tracing is off
+  unsigned int reg_shadow[REG_OWNED];	// Last value written to each write-owned register
+  unsigned int reg_valid;	// Write-owned registers whose shadow holds the device value (one bit each)
+} dma_ctx;
+
 /* Initializes the framework by mapping the BAR of the PCIE bridge and resetting the DMA engine; Should be called prior to anything else
- * Arguments: pdev - pcie device handler obtained from a successful call to open()
+ * Arguments: ctx - DMA context to initialize
+ * 	      pdev - pcie device handler obtained from a successful call to open()
  * Returns: 0 on sucess, -1 otherwise
  */
-int initDMA(pd_device_t *pdev);
+int initDMA(dma_ctx *ctx, pd_device_t *pdev);
+
+/* Same as initDMA() on any backend (pciDriver, simulator) */
+int initDMAbackend(dma_ctx *ctx, const dma_ops *ops, void *dev);
 
 /* Prepares a MM2S DMA transfer by mapping the user memory into device space, translating addresses and writing the SG descriptors to BRAM
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * 	      user_buffer - pointer to user buffer that holds the data to transmit
  * 	      buf_size - size in bytes of the data to transmit
+ * 	      str_dest - stream destination (slave address)
  * Returns: 0 on sucess, -1 otherwise
  */
-int setupSend(pd_device_t *pdev, void *user_buffer, unsigned int buf_size, int str_dest);
+int setupSend(dma_ctx *ctx, void *user_buffer, unsigned int buf_size, int str_dest);
 
 
 /* Test function to obtain data from the DDR3 memory */
-int setupSendfromDDR(pd_device_t *pdev, unsigned int address, unsigned int buf_size, int str_dest);
+int setupSendfromDDR(dma_ctx *ctx, unsigned int address, unsigned int buf_size, int str_dest);
 
 /* Test function to send data to the DDR3 memory */
-int setupRecvtoDDR(pd_device_t *pdev, unsigned int address, unsigned int buf_size);
+int setupRecvtoDDR(dma_ctx *ctx, unsigned int address, unsigned int buf_size);
 
 /* checkRecv with no associated user buffer */
-int checkRecvNoBuf();
+int checkRecvNoBuf(dma_ctx *ctx);
+
+
+void genReset(dma_ctx *ctx, unsigned long mask);
+
+unsigned int getInterrupt(dma_ctx *ctx);
+
+unsigned int cmuWrite(dma_ctx *ctx, unsigned int reg_offset, unsigned int data);
+
+unsigned int cmuRead(dma_ctx *ctx, unsigned int reg_offset);
+
+/* Maps and translates a user buffer once for any number of transfers */
+int registerBuffer(dma_ctx *ctx, void *user_buffer, unsigned int buf_size, dma_reg **reg);
+
+/* Releases a registration obtained from registerBuffer() */
+int unregisterBuffer(dma_ctx *ctx, dma_reg *reg);
+
+/* Prepares a MM2S DMA transfer of a slice of a registered buffer */
+int setupSendReg(dma_ctx *ctx, dma_reg *reg, unsigned int offset, unsigned int len, int str_dest);
+
+/* Prepares a S2MM DMA transfer into a slice of a registered buffer */
+int setupRecvReg(dma_ctx *ctx, dma_reg *reg, unsigned int offset, unsigned int len);
+
+/* Sets up a DMA MM2S/S2MM transfer from/to a slice of a kernel buffer */
+int setupSendKbuf(dma_ctx *ctx, dma_kbuf *kb, unsigned int offset, unsigned int len, int str_dest);
+
+int setupRecvKbuf(dma_ctx *ctx, dma_kbuf *kb, unsigned int offset, unsigned int len);
+
+/* Transfers a slice of a registered buffer of any size in one blocking call */
+int transferReg(dma_ctx *ctx, int istx, dma_reg *reg, unsigned int offset, unsigned int len, int str_dest);
+
+/* Soft-resets the MM2S/S2MM channel, clearing its error state */
+void MM2Sreset(dma_ctx *ctx);
+
+void S2MMreset(dma_ctx *ctx);
+
+/* Sets how a channel recovers from a DMA error */
+int setRecovery(dma_ctx *ctx, int istx, unsigned int retries);
+
+/* Sets how a channel waits for the engine */
+int setWaitPolicy(dma_ctx *ctx, int istx, int mode, unsigned long spin_ns, unsigned int sleep_us);
+
+/* Sets interrupt coalescing on a channel */
+int setIRQCoalesce(dma_ctx *ctx, int istx, unsigned int threshold, unsigned int delay);
+
+/* Turns phase tracing on or off */
+void setTrace(dma_ctx *ctx, dma_trace *trace);
+
+/* Returns the monotonic time in ns to pass to traceEnd(), 0 if tracing is off */
+unsigned long long traceStart(dma_ctx *ctx);
 
+/* Records a phase started at t0 in the trace ring of the context, if any */
+void traceEnd(dma_ctx *ctx, unsigned long long t0, int phase, int chan, unsigned int count);
 
-void genReset(unsigned long mask);
+/* Acknowledges the pending interrupts of a channel */
+unsigned int ackIRQ(dma_ctx *ctx, int istx);
 
-unsigned int getInterrupt();
+/* REGISTER ACCESS */
+/* --------------- */
 
-unsigned int cmuWrite(unsigned int reg_offset, unsigned int data);
+/* Reads a register of BAR0, from its shadow if it is write-owned */
+unsigned int regRead(dma_ctx *ctx, unsigned int offset);
 
-unsigned int cmuRead(unsigned int reg_offset);
+/* Writes a register of BAR0, updating its shadow if it is write-owned */
+void regWrite(dma_ctx *ctx, unsigned int offset, unsigned int value);
+
+/* Drops the shadow of a write-owned register changed by the device on its own */
+void regInvalidate(dma_ctx *ctx, unsigned int offset);
+
+/* STREAMING (RING) MODE */
+/* --------------------- */
+
+/* Completion of one descriptor recycled from a ring */
+typedef struct {
+  unsigned int status;		// STATUS word: bytes transferred and, on S2MM, RXSOF/RXEOF
+  unsigned int mc;		// MC_CTL word: on S2MM, TDEST and TID of the frame received
+} dma_compl;
+
+/* Puts a channel in streaming mode */
+int startStream(dma_ctx *ctx, int istx);
+
+/* Appends one descriptor to a running ring */
+int streamSubmit(dma_ctx *ctx, int istx, sgentry_pattern *desc, int sof, int eof);
+
+/* Appends a slice of a registered buffer to a running ring as a single frame */
+int streamSubmitReg(dma_ctx *ctx, int istx, dma_reg *reg, unsigned int offset, unsigned int len);
+
+/* Same as streamSubmitReg() without advancing TAILDESC */
+int streamPostReg(dma_ctx *ctx, int istx, dma_reg *reg, unsigned int offset, unsigned int len);
+
+/* Hands the descriptors posted since the last TAILDESC write to the engine */
+int streamFlush(dma_ctx *ctx, int istx);
+
+/* Recycles the descriptors completed by the engine since the last call */
+int streamReap(dma_ctx *ctx, int istx, unsigned int *bytes);
+
+/* Same as streamReap(), also reporting the completion of every recycled descriptor */
+int streamReapCompl(dma_ctx *ctx, int istx, dma_compl *compl, int max, unsigned int *bytes);
+
+/* Waits until at least one descriptor in flight has completed and recycles the completed ones */
+int streamWait(dma_ctx *ctx, int istx, unsigned int *bytes);
+
+/* Same as streamWait(), reporting completions as streamReapCompl() does */
+int streamWaitCompl(dma_ctx *ctx, int istx, dma_compl *compl, int max, unsigned int *bytes);
+
+/* Appends a slice of a kernel buffer to a running ring as a single frame */
+int streamSubmitKbuf(dma_ctx *ctx, int istx, dma_kbuf *kb, unsigned int offset, unsigned int len);
+
+/* Queues a descriptor list of any length as one frame on a channel in streaming mode */
+int streamSubmitPattern(dma_ctx *ctx, int istx, pd_umem_pattern *umem_pat);
+
+/* Moves pending descriptors into the slots freed by streamReap() */
+int streamRefill(dma_ctx *ctx, int istx);
+
+/* Stops a channel running in streaming mode */
+int stopStream(dma_ctx *ctx, int istx);
+
+/* DESCRIPTOR PROGRAMS */
+/* ------------------- */
+
+/* Compiles a pattern into a program for the buffer the channel is set up on */
+int progCompile(dma_ctx *ctx, int istx, pd_umem_pattern *umem_pat, dma_prog *prog);
+
+/* Loads a program on its channel in place of a setup and pattern call */
+int progLoad(dma_ctx *ctx, dma_prog *prog);
 
 /* Prepares a S2MM DMA transfer by mapping the user memory into device space, translating addresses and writing the SG descriptors to BRAM
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * 	      user_buffer - pointer to user buffer that holds the data to transmit
  * 	      buf_size - size in bytes of the data to transmit
- * 	      str_dest - stream destination (slave address)
  * Returns: 0 on sucess, -1 otherwise
  */
-int setupRecv(pd_device_t *pdev, void *user_buffer, unsigned int buf_size);
+int setupRecv(dma_ctx *ctx, void *user_buffer, unsigned int buf_size);
 
 /* Starts DMA MM2S transfer with the parameters set on the previous call to setupSend()
- * Arguments: blocking - 1 for interrupt mode, 0 for non blocking mode
+ * Arguments: ctx - DMA context
+ * 	      blocking - 1 for interrupt mode, 0 for non blocking mode
  * Returns: 0 on success, -1 otherwise
  */
-int startSend(pd_device_t *pdev, int blocking);
+int startSend(dma_ctx *ctx, int blocking);
 
 /* Starts DMA S2MM transfer with the parameters set on the previous call to setupRecv()
- * Arguments: blocking - 1 for interrupt mode, 0 for non blocking mode
+ * Arguments: ctx - DMA context
+ * 	      blocking - 1 for interrupt mode, 0 for non blocking mode
  * Returns: 0 on success, -1 otherwise
  */
-int startRecv(pd_device_t *pdev, int blocking);
+int startRecv(dma_ctx *ctx, int blocking);
 
 /* Checks if the DMA MM2S transfer is complete and there were no errors; this function should be always called before starting other transfer
- * Arguments: 
+ * Arguments: ctx - DMA context
  * Returns: 0 on success, -1 otherwise
  */
-int checkSend();
+int checkSend(dma_ctx *ctx);
 
 
 /* Checks if the DMA S2MM transfer is complete and there were no errors; 
  * This function should be always called before using the receive buffer because it performs necessary syncing between the user buffer and kernel buffer
- * Arguments: 
+ * Arguments: ctx - DMA context
  * Returns: 0 on success, -1 otherwise
  */
-int checkRecv();
+int checkRecv(dma_ctx *ctx);
+
+/* Called by checkRecvProgress() each time more of the receive buffer becomes final
+ * bytes - bytes from the start of the transfer that are final and synced for the CPU
+ * arg - user argument given to checkRecvProgress()
+ */
+typedef void (*dma_progress)(unsigned int bytes, void *arg);
+
+/* Reports how much of the S2MM transfer started by startRecv() is final, without waiting */
+int recvProgress(dma_ctx *ctx, unsigned int *bytes, int sync);
+
+/* Same as checkRecv(), reporting the progress of the transfer to a callback */
+int checkRecvProgress(dma_ctx *ctx, unsigned int step, dma_progress cb, void *arg);
 
 /* Frees the user memory mapping to bus device space previously done for MM2S transfer
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * Returns: 0 on sucess, -1 otherwise
  */
-int freeSend(pd_device_t *pdev);
+int freeSend(dma_ctx *ctx);
 
 
 /* Frees the user memory mapping to bus device space previously done for S2MM transfer
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * Returns: 0 on sucess, -1 otherwise
  */
-int freeRecv(pd_device_t *pdev);
+int freeRecv(dma_ctx *ctx);
 
 
 /* Stops the framework by unmpaping the pcie BAR
- * Arguments: pdev - pcie device handler obtained from a successful call to open()
+ * Arguments: ctx - DMA context previously initialized by initDMA()
  * Returns: 0 on sucess, -1 otherwise
  */
-int stopDMA(pd_device_t *pdev);
+int stopDMA(dma_ctx *ctx);
+
+#endif
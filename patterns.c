@@ -6,10 +6,7 @@
 #include "patterns.h"
 #include "pciedma.h"
 #include "desc_mgmt.h"
-
-/* GLOBAL VARIABLES FROM pciedma.h */
-pd_umem_t *umem_tr_snd, *umem_tr_recv;
-
+#include "data_patterns.h"
 
 sgentry_pattern *sglist_new()
 {
@@ -46,6 +43,7 @@ int sglist_push(sgentry_pattern *base, unsigned int addr, unsigned int hsize, un
  new->hsize = hsize;
  new->vsize = vsize;
  new->stride = stride;
+ new->tdest = -1;
  new->next = NULL;
  
  next->next = new;
@@ -53,6 +51,44 @@ int sglist_push(sgentry_pattern *base, unsigned int addr, unsigned int hsize, un
  return 0;
 }
 
+int sglist_push_split(sgentry_pattern *base, unsigned int addr, unsigned int len)
+{
+ unsigned int hsize, vsize, n;
+ int ndesc = 0;
+
+ if(len <= HSIZE_MAX)
+   return (sglist_push(base, addr, len, 1, len) < 0) ? -1 : 1;
+
+ // Look for HSIZE x VSIZE covering the whole segment with a single descriptor
+ for(n = (len + HSIZE_MAX - 1)/HSIZE_MAX; n <= VSIZE_MAX && len/n >= HSIZE_MAX/2; n++){
+   if(len % n == 0)
+     return (sglist_push(base, addr, len/n, n, len/n) < 0) ? -1 : 1;
+ }
+
+ // Otherwise full blocks of 32 KB lines, then the remainder as a 1D descriptor
+ hsize = 0x8000;
+ while(len >= hsize){
+   vsize = len/hsize;
+   if(vsize > VSIZE_MAX)
+     vsize = VSIZE_MAX;
+
+   if(sglist_push(base, addr, hsize, vsize, hsize) < 0)
+     return -1;
+   ndesc++;
+
+   addr += hsize*vsize;
+   len -= hsize*vsize;
+ }
+
+ if(len > 0){
+   if(sglist_push(base, addr, len, 1, len) < 0)
+     return -1;
+   ndesc++;
+ }
+
+ return ndesc;
+}
+
 sgentry_pattern *sglist_pop(sgentry_pattern *base)
 {
  sgentry_pattern *next;
@@ -191,6 +227,19 @@ int pattern2d(pd_umem_t *umem, pd_umem_pattern **umem_pattern, unsigned int offs
 	base_addr = stride - F;
       }
    }
+   else
+   {
+      // Segment ends on a line boundary: its lines go in one descriptor and the next segment starts with a line
+      if(hsize > 65535){
+	  PRINT("Hsize for current descriptor exceeds 16 bits. Please rearrange your data\n");
+	  return -1;
+      }
+      sglist_push((*umem_pattern)->sg,base_addr+(umem->sg[i]).addr,hsize,N,stride);
+      ndesc_final++;
+      vsize -= N;
+
+      base_addr = 0;
+   }
   }
  
  (*umem_pattern)->nents = ndesc_final;
@@ -343,15 +392,15 @@ int apply2dpattern(pd_umem_t *umem, pd_umem_pattern **umem_pattern, unsigned int
   return 0;
 }
 
-int apply2d_send(int offset, int hsize, int stride, int vsize)
+int apply2d_send(dma_ctx *ctx, int offset, int hsize, int stride, int vsize)
 {
  pd_umem_pattern *umem_pat;
 
- if (apply2dpattern(umem_tr_snd, &umem_pat, offset, hsize, stride, vsize) < 0){
+ if (apply2dpattern(ctx->snd.umem_tr, &umem_pat, offset, hsize, stride, vsize) < 0){
    return -1;
  }
 
- if (write_pattern_send(umem_pat) < 0){
+ if (write_pattern_send(ctx, umem_pat) < 0){
    return -1;
  }
 
@@ -359,15 +408,15 @@ int apply2d_send(int offset, int hsize, int stride, int vsize)
 }
 
 
-int apply2d_recv(int offset, int hsize, int stride, int vsize)
+int apply2d_recv(dma_ctx *ctx, int offset, int hsize, int stride, int vsize)
 {
  pd_umem_pattern *umem_pat;
 
- if (apply2dpattern(umem_tr_recv, &umem_pat, offset, hsize, stride, vsize) < 0){
+ if (apply2dpattern(ctx->recv.umem_tr, &umem_pat, offset, hsize, stride, vsize) < 0){
    return -1;
  }
 
- if (write_pattern_recv(umem_pat) < 0){
+ if (write_pattern_recv(ctx, umem_pat) < 0){
    return -1;
  }
 
@@ -375,17 +424,17 @@ int apply2d_recv(int offset, int hsize, int stride, int vsize)
 }
 
 
-int applyBlocking_send(int bsize, int mat_size, int elem_size)
+int applyBlocking_send(dma_ctx *ctx, int bsize, int mat_size, int elem_size)
 {
   pd_umem_pattern *umem_pat;
 
-  // Apply blocking pattern to the translated descriptor umem_tr_snd
-  if (applyBlocking(umem_tr_snd, &umem_pat, bsize, mat_size, elem_size) < 0){
+  // Apply blocking pattern to the translated descriptor of the MM2S channel
+  if (applyBlocking(ctx->snd.umem_tr, &umem_pat, bsize, mat_size, elem_size) < 0){
     return -1;
   }
  
   // Write patternized descriptor into BRAM and setup DMA send
-  if (write_pattern_send(umem_pat) < 0){
+  if (write_pattern_send(ctx, umem_pat) < 0){
     return -1;
   }
 
@@ -393,17 +442,17 @@ int applyBlocking_send(int bsize, int mat_size, int elem_size)
 }
 
 
-int applyBlocking_recv(int bsize, int mat_size, int elem_size)
+int applyBlocking_recv(dma_ctx *ctx, int bsize, int mat_size, int elem_size)
 {
   pd_umem_pattern *umem_pat;
 
-  // Apply blocking pattern to the translated descriptor umem_tr_recv
-  if (applyBlocking(umem_tr_recv, &umem_pat, bsize, mat_size, elem_size) < 0){
+  // Apply blocking pattern to the translated descriptor of the S2MM channel
+  if (applyBlocking(ctx->recv.umem_tr, &umem_pat, bsize, mat_size, elem_size) < 0){
     return -1;
   }
  
   // Write patternized descriptor into BRAM and setup DMA send
-  if (write_pattern_recv(umem_pat) < 0){
+  if (write_pattern_recv(ctx, umem_pat) < 0){
     return -1;
   }
 
@@ -432,15 +481,15 @@ int applyLinear(pd_umem_t *umem, pd_umem_pattern **umem_pattern, int offset, int
   return pattern2d(umem, umem_pattern, offset, hsize, stride, vsize);
 }
 
-int applyLinear_send(int offset, int hsize, int stride, int total_size)
+int applyLinear_send(dma_ctx *ctx, int offset, int hsize, int stride, int total_size)
 {
  pd_umem_pattern *umem_pat;
 
- if (applyLinear(umem_tr_snd, &umem_pat, offset, hsize, stride, total_size) <0){
+ if (applyLinear(ctx->snd.umem_tr, &umem_pat, offset, hsize, stride, total_size) <0){
    return -1;
  }
 
- if (write_pattern_send(umem_pat) < 0){
+ if (write_pattern_send(ctx, umem_pat) < 0){
    return -1;
  }
 
@@ -448,15 +497,68 @@ int applyLinear_send(int offset, int hsize, int stride, int total_size)
 }
 
 
-int applyLinear_recv(int offset, int hsize, int stride, int total_size)
+int applyLinear_recv(dma_ctx *ctx, int offset, int hsize, int stride, int total_size)
 {
  pd_umem_pattern *umem_pat;
 
- if (applyLinear(umem_tr_recv, &umem_pat, offset, hsize, stride, total_size) <0){
+ if (applyLinear(ctx->recv.umem_tr, &umem_pat, offset, hsize, stride, total_size) <0){
    return -1;
  }
 
- if (write_pattern_recv(umem_pat) < 0){
+ if (write_pattern_recv(ctx, umem_pat) < 0){
+   return -1;
+ }
+
+ return 0;
+}
+
+
+/* applySG - Applies the identity pattern: the SG entries of the mapped buffer in buffer order, entries above the 16-bit HSIZE
+ * being split into 2D descriptors by sglist_push_split()
+ * Parameters: umem - pointer to mapped user buffer
+ *	       umem_pattern - pointer to hold resulting descriptor list
+ */
+int applySG(pd_umem_t *umem, pd_umem_pattern **umem_pattern)
+{
+  int i, n;
+
+  if(create_pattern_struct(umem,umem_pattern)<0)
+	return -1;
+
+  for(i = 0; i < umem->nents; i++){
+    n = sglist_push_split((*umem_pattern)->sg,(umem->sg[i]).addr,(umem->sg[i]).size);
+    if(n < 0)
+      return -1;
+    (*umem_pattern)->nents += n;
+  }
+
+  return 0;
+}
+
+int applySG_send(dma_ctx *ctx)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (applySG(ctx->snd.umem_tr, &umem_pat) < 0){
+   return -1;
+ }
+
+ if (write_pattern_send(ctx, umem_pat) < 0){
+   return -1;
+ }
+
+ return 0;
+}
+
+int applySG_recv(dma_ctx *ctx)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (applySG(ctx->recv.umem_tr, &umem_pat) < 0){
+   return -1;
+ }
+
+ if (write_pattern_recv(ctx, umem_pat) < 0){
    return -1;
  }
 
@@ -501,6 +603,152 @@ int applyBlocking(pd_umem_t *umem, pd_umem_pattern **umem_pattern, int bsize, in
   return 0;
 }
 
+int compile2d(dma_ctx *ctx, int istx, dma_prog *prog, int offset, int hsize, int stride, int vsize)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (apply2dpattern(istx ? ctx->snd.umem_tr : ctx->recv.umem_tr, &umem_pat, offset, hsize, stride, vsize) < 0){
+   return -1;
+ }
+
+ return progCompile(ctx, istx, umem_pat, prog);
+}
+
+int compileLinear(dma_ctx *ctx, int istx, dma_prog *prog, int offset, int hsize, int stride, int total_size)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (applyLinear(istx ? ctx->snd.umem_tr : ctx->recv.umem_tr, &umem_pat, offset, hsize, stride, total_size) < 0){
+   return -1;
+ }
+
+ return progCompile(ctx, istx, umem_pat, prog);
+}
+
+int compileBlocking(dma_ctx *ctx, int istx, dma_prog *prog, int bsize, int mat_size, int elem_size)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (applyBlocking(istx ? ctx->snd.umem_tr : ctx->recv.umem_tr, &umem_pat, bsize, mat_size, elem_size) < 0){
+   return -1;
+ }
+
+ return progCompile(ctx, istx, umem_pat, prog);
+}
+
+int compileSG(dma_ctx *ctx, int istx, dma_prog *prog)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (applySG(istx ? ctx->snd.umem_tr : ctx->recv.umem_tr, &umem_pat) < 0){
+   return -1;
+ }
+
+ return progCompile(ctx, istx, umem_pat, prog);
+}
+
+/* patternRange - Describes a contiguous range of the buffer, across as many SG entries as it spans
+ * Parameters: umem - pointer to mapped user buffer
+ *	       umem_pattern - pattern to which the descriptors are appended
+ *	       offset - start of the range, in bytes
+ *	       len - size of the range, in bytes
+ */
+int patternRange(pd_umem_t *umem, pd_umem_pattern **umem_pattern, unsigned int offset, unsigned int len)
+{
+  unsigned int chunk;
+  int i, n;
+
+  if(len == 0 || offset + len > umem->size){
+    PRINT("Error: Range of %u bytes at offset %u exceeds buffer capacity (%lu)\n", len, offset, umem->size);
+    return -1;
+  }
+
+  for(i = 0; i < umem->nents && len > 0; i++){
+    if(offset >= (umem->sg[i]).size){
+      offset -= (umem->sg[i]).size;
+      continue;
+    }
+
+    chunk = (umem->sg[i]).size - offset;
+    if(chunk > len)
+      chunk = len;
+
+    n = sglist_push_split((*umem_pattern)->sg,(umem->sg[i]).addr + offset,chunk);
+    if(n < 0)
+      return -1;
+    (*umem_pattern)->nents += n;
+
+    len -= chunk;
+    offset = 0;
+  }
+
+  return 0;
+}
+
+int applyFanout(pd_umem_t *umem, pd_umem_pattern **umem_pattern, dma_fanout *fan, int nfan)
+{
+  sgentry_pattern *tail, *cur;
+  int i;
+
+  if(nfan <= 0){
+    PRINT("Error: Fan-out without slices\n");
+    return -1;
+  }
+
+  if(create_pattern_struct(umem,umem_pattern)<0)
+	return -1;
+
+  tail = (*umem_pattern)->sg;
+  for(i = 0; i < nfan; i++){
+    if(fan[i].tdest < 0){
+      PRINT("Error: Slice %d has no stream destination\n", i);
+      return -1;
+    }
+
+    // Slices without gaps are contiguous in the buffer and may span any number of SG entries
+    if(fan[i].vsize <= 1 || fan[i].stride == fan[i].hsize){
+      if(patternRange(umem, umem_pattern, fan[i].offset, fan[i].hsize*(fan[i].vsize ? fan[i].vsize : 1)) < 0)
+        return -1;
+    }
+    else if(pattern2d(umem, umem_pattern, fan[i].offset, fan[i].hsize, fan[i].stride, fan[i].vsize) < 0)
+      return -1;
+
+    // Descriptors appended for this slice carry its destination
+    for(cur = tail->next; cur != NULL; cur = cur->next){
+      cur->tdest = fan[i].tdest;
+      tail = cur;
+    }
+  }
+
+  return 0;
+}
+
+int applyFanout_send(dma_ctx *ctx, dma_fanout *fan, int nfan)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (applyFanout(ctx->snd.umem_tr, &umem_pat, fan, nfan) < 0){
+   return -1;
+ }
+
+ if (write_pattern_send(ctx, umem_pat) < 0){
+   return -1;
+ }
+
+ return 0;
+}
+
+int compileFanout(dma_ctx *ctx, dma_prog *prog, dma_fanout *fan, int nfan)
+{
+ pd_umem_pattern *umem_pat;
+
+ if (applyFanout(ctx->snd.umem_tr, &umem_pat, fan, nfan) < 0){
+   return -1;
+ }
+
+ return progCompile(ctx, 1, umem_pat, prog);
+}
+
 
 /* 
 int main()
@@ -19,6 +19,7 @@
 #include "pciedma.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
  #include <stdarg.h>
@@ -34,13 +35,6 @@
   #define PRINT(...) ((void)0)
 #endif
 
-/* GLOBAL VARIABLES */
-/*----------------------*/
-unsigned int tail_desc_snd, tail_desc_recv;
-pd_umem_t um_snd, um_recv;
-void *bar;
-int dest_tx; // Stream destination
-
 void print(const char *fmt, ...)
 {
  va_list args;
@@ -167,7 +161,7 @@ int addrTranslation(pd_umem_t *umem, pd_umem_t **umem_tr, unsigned int *base_ptr
 
 // All the remaining descriptors must fit within the addressable space of the AXI bus...
   for(i = 0; i < umem->nents; i++){
-	if((umem->sg[i]).addr & AXI2PCIE_MASK != base_addr){
+	if(((umem->sg[i]).addr & AXI2PCIE_MASK) != base_addr){
 	   PRINT("Error: Could not map descriptors into addressable range of the AXI bus\n");
 	   return(-1);
 	}
@@ -247,8 +241,9 @@ int checkDMAerrors(void *bar_ptr, unsigned int STATUSREG)
   return ret;
 }
 
-void MM2Sreset(void *bar_ptr)
+void MM2Sreset(dma_ctx *ctx)
 {
+  void *bar_ptr = ctx->bar;
   unsigned int read_reset;
   
  // Set soft reset bit
@@ -264,8 +259,9 @@ void MM2Sreset(void *bar_ptr)
   
 }
 
-void S2MMreset(void *bar_ptr)
+void S2MMreset(dma_ctx *ctx)
 {
+  void *bar_ptr = ctx->bar;
   unsigned int read_reset;
   
  // Set soft reset bit
@@ -289,8 +285,9 @@ void S2MMreset(void *bar_ptr)
  * buff_addr - address of the buffer associated with this descriptor
  * buff_len - length in bytes of the buffer
 //  * istx - TX descriptor (1) or RX descriptor (0)
+ * tdest - stream destination of TX descriptors
  */
-void write_desc(void *bar_ptr, unsigned int cur_desc, int first, int last, unsigned int buff_addr, unsigned int buff_len, int istx)
+void write_desc(void *bar_ptr, unsigned int cur_desc, int first, int last, unsigned int buff_addr, unsigned int buff_len, int istx, int tdest)
 {
   unsigned int write_nxt, ctl_reg, multichannel_reg, stride_reg;
   
@@ -312,8 +309,8 @@ void write_desc(void *bar_ptr, unsigned int cur_desc, int first, int last, unsig
   multichannel_reg = 0;
   
   if (istx){
-    multichannel_reg = multichannel_reg | (dest_tx & TDEST);
-    multichannel_reg = multichannel_reg | ((dest_tx << TID_SHIFT) & TID);
+    multichannel_reg = multichannel_reg | (tdest & TDEST);
+    multichannel_reg = multichannel_reg | ((tdest << TID_SHIFT) & TID);
     //multichannel_reg = multichannel_reg | ((0 << TUSER_SHIFT) & TUSER);
     multichannel_reg = multichannel_reg | ((ARCACHE_DEF << ARCACHE_SHIFT) & ARCACHE);
     //multichannel_reg = multichannel_reg | ((0 << ARUSER_SHIFT) & ARUSER);
@@ -349,10 +346,10 @@ void write_desc(void *bar_ptr, unsigned int cur_desc, int first, int last, unsig
 /* Setup SG Desriptors for a DMA transfer
  * 
  */
-int setupSGDesc(pd_umem_t *umem, void *bar_ptr, unsigned int base_loc, unsigned int *tail_desc, int istx)
+int setupSGDesc(pd_umem_t *umem, void *bar_ptr, unsigned int base_loc, unsigned int *tail_desc, int istx, int tdest)
 {
-  unsigned int next_desc, buff_addr, buff_len;
-  int i,last = 0;
+  unsigned int next_desc, buff_addr, buff_len, part;
+  int i,ndesc,d,last = 0;
   
   if(base_loc < BRAM_BASE || base_loc > BRAM_BASE + 0x1000){
       PRINT("Error: Base location for descriptor ring must be within the BRAM Adress Space\n");
@@ -365,29 +362,43 @@ int setupSGDesc(pd_umem_t *umem, void *bar_ptr, unsigned int base_loc, unsigned
   }
   
   PRINT("Number of SG entries: %d\n", umem->nents );
+
+  // Segments over the 23-bit buffer length are split into DESC_SPLIT_LEN pieces
+  ndesc = 0;
+  for(i=0;i<umem->nents;i++)
+    ndesc += ((umem->sg[i]).size + DESC_SPLIT_LEN - 1)/DESC_SPLIT_LEN;
+
+  // Descriptors past the end of the half would overwrite the descriptors of the other channel
+  if(ndesc > RING_SLOTS){
+      PRINT("Error: %d descriptors do not fit in the %d descriptor slots of the channel\n", ndesc, RING_SLOTS);
+      return -1;
+  }
 		
 	// Create descriptors and write them to the BRAM memory
 	next_desc = (unsigned int)base_loc;
+	d = 0;
 	for(i=0;i<umem->nents;i++) {
 		PRINT("Descriptor %d: %08x - %08x\n", i, (umem->sg[i]).addr, (umem->sg[i]).size);
 		
 		buff_addr = (umem->sg[i]).addr;
 		buff_len = (umem->sg[i]).size;
 		
-		if(buff_len >= 0x800000){
-		    PRINT("Error: Buffer is larger than 23 bits. Aborting\n");
-		    return -1;
-		}
-		
-		// Save the location of the tail descriptor
-		if(i == (umem->nents - 1)){
-		  *tail_desc = next_desc;
-		  last = 1;
-		}
+		while(buff_len > 0){
+		  part = (buff_len > DESC_SPLIT_LEN) ? DESC_SPLIT_LEN : buff_len;
+		  d++;
+
+		  // Save the location of the tail descriptor
+		  if(d == ndesc){
+		    *tail_desc = next_desc;
+		    last = 1;
+		  }
 
-                write_desc(bar_ptr, next_desc, (i==0), last, buff_addr, buff_len, istx);
+                  write_desc(bar_ptr, next_desc, (d==1), last, buff_addr, part, istx, tdest);
 		
-		next_desc += + 0x40; // Next descriptor is placed 16 words after current one
+		  buff_addr += part;
+		  buff_len -= part;
+		  next_desc += + 0x40; // Next descriptor is placed 16 words after current one
+		}
 	}
 
   return 0;  
@@ -491,8 +502,9 @@ void writeTailRecv(void *bar_ptr, unsigned int tail_desc)
 }
 
 
-int checkSendCompletion(void *bar_ptr,unsigned int desc_base)
+int checkSendCompletion(dma_ctx *ctx,unsigned int desc_base,unsigned int tail_desc)
 {
+  void *bar_ptr = ctx->bar;
  unsigned int status_reg, next_desc, total_size;
   int i;
  
@@ -501,7 +513,7 @@ int checkSendCompletion(void *bar_ptr,unsigned int desc_base)
   // Check for errors
   if(checkDMAerrors(bar_ptr, MM2S_DMASR) < 0){
       PRINT("Resetting MM2S channel\n");
-      MM2Sreset(bar_ptr);
+      MM2Sreset(ctx);
       return -1;
   }
  
@@ -536,7 +548,7 @@ int checkSendCompletion(void *bar_ptr,unsigned int desc_base)
     // Erase status descriptor
     ((unsigned int*)bar_ptr)[(next_desc/4) + (STATUS/4)] = 0;
 
-    if(next_desc == tail_desc_snd)
+    if(next_desc == tail_desc)
       break; // Reached end of descriptor chain
     
     next_desc = getPCIEaddr(((unsigned int*)bar_ptr)[(next_desc/4) + (NXTDESC/4)]);
@@ -553,15 +565,16 @@ int checkSendCompletion(void *bar_ptr,unsigned int desc_base)
   return 0;
 }
 
-int checkRecvCompletion(void *bar_ptr,unsigned int desc_base)
+int checkRecvCompletion(dma_ctx *ctx,unsigned int desc_base,unsigned int tail_desc)
 {
+  void *bar_ptr = ctx->bar;
   unsigned int status_reg, next_desc, total_size;
   int i; 
   
   // Check for errors
   if(checkDMAerrors(bar_ptr, S2MM_DMASR) < 0){
       PRINT("Resetting S2MM channel\n");
-      S2MMreset(bar_ptr);
+      S2MMreset(ctx);
       return -1;
   }
 
@@ -602,7 +615,7 @@ int checkRecvCompletion(void *bar_ptr,unsigned int desc_base)
     // Erase status descriptor
     ((unsigned int*)bar_ptr)[(next_desc/4) + (STATUS/4)] = 0;
 
-    if(next_desc == tail_desc_recv)
+    if(next_desc == tail_desc)
       break; // Reached end of descriptor chain
     
     next_desc = getPCIEaddr(((unsigned int*)bar_ptr)[(next_desc/4) + (NXTDESC/4)]);
@@ -652,60 +665,67 @@ int waitIOC(pd_device_t *pdev, void *bar_ptr)
 }
 
 /* Initializes the framework by mapping the BAR of the PCIE bridge and resetting the DMA engine; Should be called prior to anything else
- * Arguments: pdev - pcie device handler obtained from a successful call to open()
+ * Arguments: ctx - DMA context to initialize
+ * 	      pdev - pcie device handler obtained from a successful call to open()
  * Returns: 0 on sucess, -1 otherwise
  */
-int initDMA(pd_device_t *pdev)
+int initDMA(dma_ctx *ctx, pd_device_t *pdev)
 { 
- bar = pd_mapBAR(pdev,0);
- if (bar == NULL) {
+ memset(ctx, 0, sizeof(dma_ctx));
+ 
+ ctx->pdev = pdev;
+ ctx->snd.desc_base = BRAM_BASE;
+ ctx->recv.desc_base = BRAM_BASE + 0x800;
+ 
+ ctx->bar = pd_mapBAR(pdev,0);
+ if (ctx->bar == NULL) {
    PRINT("Error: Could not map BAR0\n");
    return -1;
  }
  
- resetBRAM(bar);
+ resetBRAM(ctx->bar);
  
   PRINT("Resetting DMA controller\n");
   // Reset DMA controller
-  MM2Sreset(bar);
+  MM2Sreset(ctx);
+  
  
   return 0;
 }
 
 /* Prepares a MM2S DMA transfer by mapping the user memory into device space, translating addresses and writing the SG descriptors to BRAM
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * 	      user_buffer - pointer to user buffer that holds the data to transmit
  * 	      buf_size - size in bytes of the data to transmit
  * 	      str_dest - stream destination (slave address) 
  * Returns: 0 on sucess, -1 otherwise
  */
-int setupSend(pd_device_t *pdev, void *user_buffer, unsigned int buf_size, int str_dest)
+int setupSend(dma_ctx *ctx, void *user_buffer, unsigned int buf_size, int str_dest)
 {
   pd_umem_t *umem_tr;
   unsigned int base_axi2pcie;
   
-  int i;
-  
-  if(bar == NULL){
+  if(ctx->bar == NULL){
       PRINT("Error: BAR pointer is not initialized\n");
       return -1;
   }
 
   // Map user buffer into device space
-  if(pd_mapUserMemory( pdev, user_buffer, buf_size, &um_snd) < 0){
+  if(pd_mapUserMemory( ctx->pdev, user_buffer, buf_size, &ctx->snd.um) < 0){
       PRINT("Error: Could not allocate provided user buffer\n");
       return -1;
   }
+  ctx->snd.mapped = 1;
   
   // Translate addresses to the AXI bus side
-  if( addrTranslation(&um_snd, &umem_tr, &base_axi2pcie) < 0){
+  if( addrTranslation(&ctx->snd.um, &umem_tr, &base_axi2pcie) < 0){
      PRINT("Error: Could not translate addresses for the AXI bus\n");
      return -1;
   }
 
   PRINT("Setting address translation\n");
   // Set Address translation in the PCIE Core
-  if( setAXI2PCIEbar(base_axi2pcie, bar) < 0){
+  if( setAXI2PCIEbar(base_axi2pcie, ctx->bar) < 0){
      PRINT("Error: Could not configure address translation on the PCIe core\n");
      return -1;
   }
@@ -713,75 +733,76 @@ int setupSend(pd_device_t *pdev, void *user_buffer, unsigned int buf_size, int s
    PRINT("Writing SG descriptors to BRAM\n");
    
    // Set stream destination
-   dest_tx = str_dest;
+   ctx->dest_tx = str_dest;
    
   // Setup translated SG descriptors in the BRAM
-  if(setupSGDesc(umem_tr,bar,BRAM_BASE,&tail_desc_snd,1) < 0){
+  if(setupSGDesc(umem_tr,ctx->bar,ctx->snd.desc_base,&ctx->snd.tail_desc,1,ctx->dest_tx) < 0){
       PRINT("Error: Could not setup DMA transfer\n");
       return -1;
   }
   
    PRINT("Setting up DMA send\n");  
-   if(setupDMAsend(bar,BRAM_BASE) < 0){
+   if(setupDMAsend(ctx->bar,ctx->snd.desc_base) < 0){
       PRINT("Error: Could not setup DMA transfer\n");
       return -1;
    }
   
+  free(umem_tr->sg);
   free(umem_tr);
   
   return 0;
 }
 
 /* Prepares a S2MM DMA transfer by mapping the user memory into device space, translating addresses and writing the SG descriptors to BRAM
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * 	      user_buffer - pointer to user buffer that holds the data to transmit
  * 	      buf_size - size in bytes of the data to transmit
  * Returns: 0 on sucess, -1 otherwise
  */
-int setupRecv(pd_device_t *pdev, void *user_buffer, unsigned int buf_size)
+int setupRecv(dma_ctx *ctx, void *user_buffer, unsigned int buf_size)
 {
   pd_umem_t *umem_tr;
   unsigned int base_axi2pcie;
-  
-  int i;
 
-  if(bar == NULL){
+  if(ctx->bar == NULL){
      PRINT("Error: BAR pointer is not initialized\n");
      return -1;
   }
   
   // Map user buffer into device space
-  if(pd_mapUserMemory( pdev, user_buffer, buf_size, &um_recv) < 0){
+  if(pd_mapUserMemory( ctx->pdev, user_buffer, buf_size, &ctx->recv.um) < 0){
       PRINT("Error: Could not allocate provided user buffer\n");
       return -1;
   }
+  ctx->recv.mapped = 1;
   
   // Translate addresses to the AXI bus side
-  if( addrTranslation(&um_recv, &umem_tr, &base_axi2pcie) < 0){
+  if( addrTranslation(&ctx->recv.um, &umem_tr, &base_axi2pcie) < 0){
      PRINT("Error: Could not translate addresses for the AXI bus\n");
      return -1;
   }
 
   PRINT("Setting address translation\n");
   // Set Address translation in the PCIE Core
-  if( setAXI2PCIEbar(base_axi2pcie, bar) < 0){
+  if( setAXI2PCIEbar(base_axi2pcie, ctx->bar) < 0){
      PRINT("Error: Could not configure address translation on the PCIe core\n");
      return -1;
   }
   
    PRINT("Writing SG descriptors to BRAM\n");
   // Setup translated SG descriptors in the BRAM
-  if(setupSGDesc(umem_tr,bar,BRAM_BASE+0x800,&tail_desc_recv,0) < 0){
+  if(setupSGDesc(umem_tr,ctx->bar,ctx->recv.desc_base,&ctx->recv.tail_desc,0,ctx->dest_tx) < 0){
       PRINT("Error: Could not setup DMA transfer\n");
       return -1;
   }
   
   PRINT("Setting up DMA receive\n");  
-   if(setupDMArecv(bar,BRAM_BASE+0x800) < 0){
+   if(setupDMArecv(ctx->bar,ctx->recv.desc_base) < 0){
       PRINT("Error: Could not setup DMA receive\n");
       return -1;
    }
   
+  free(umem_tr->sg);
   free(umem_tr);
 
   
@@ -789,16 +810,17 @@ int setupRecv(pd_device_t *pdev, void *user_buffer, unsigned int buf_size)
 }
 
 /* Starts DMA MM2S transfer with the parameters set on the previous call to setupSend()
- * Arguments: blocking - 1 for interrupt mode, 0 for non blocking mode
+ * Arguments: ctx - DMA context
+ * 	      blocking - 1 for interrupt mode, 0 for non blocking mode
  * Returns: 0 on success, -1 otherwise
  */
-int startSend(pd_device_t *pdev, int blocking)
+int startSend(dma_ctx *ctx, int blocking)
 {
-   writeTailSend(bar,tail_desc_snd);
+   writeTailSend(ctx->bar,ctx->snd.tail_desc);
    
    if(blocking){
      PRINT("Wait on interrupt\n");
-     if(waitIOC(pdev,bar)<0){
+     if(waitIOC(ctx->pdev,ctx->bar)<0){
 	PRINT("Error: Wait on interrupt failed\n");
      return -1;
      }
@@ -809,16 +831,17 @@ int startSend(pd_device_t *pdev, int blocking)
 
 
 /* Starts DMA S2MM transfer with the parameters set on the previous call to setupRecv()
- * Arguments: blocking - 1 for interrupt mode, 0 for non blocking mode
+ * Arguments: ctx - DMA context
+ * 	      blocking - 1 for interrupt mode, 0 for non blocking mode
  * Returns: 0 on success, -1 otherwise
  */
-int startRecv(pd_device_t *pdev, int blocking)
+int startRecv(dma_ctx *ctx, int blocking)
 {
-  writeTailRecv(bar,tail_desc_recv);
+  writeTailRecv(ctx->bar,ctx->recv.tail_desc);
   
   if(blocking){
      PRINT("Wait on interrupt\n");
-     if(waitIOC(pdev,bar)<0){
+     if(waitIOC(ctx->pdev,ctx->bar)<0){
 	PRINT("Error: Wait on interrupt failed\n");
      return -1;
      }
@@ -828,13 +851,13 @@ int startRecv(pd_device_t *pdev, int blocking)
 }
 
 /* Checks if the DMA MM2S transfer is complete and there were no errors; this function should be always called before starting other transfer
- * Arguments: 
+ * Arguments: ctx - DMA context
  * Returns: 0 on success, -1 otherwise
  */
-int checkSend()
+int checkSend(dma_ctx *ctx)
 {
   // Check DMA status and completion
-  if(checkSendCompletion(bar,BRAM_BASE) < 0){
+  if(checkSendCompletion(ctx,ctx->snd.desc_base,ctx->snd.tail_desc) < 0){
      PRINT("Error: DMA transfer failed\n");
      return -1;
   }
@@ -844,18 +867,18 @@ int checkSend()
 
 /* Checks if the DMA S2MM transfer is complete and there were no errors; 
  * This function should be always called before using the receive buffer because it performs necessary syncing between the user buffer and kernel buffer
- * Arguments: 
+ * Arguments: ctx - DMA context
  * Returns: 0 on success, -1 otherwise
  */
-int checkRecv()
+int checkRecv(dma_ctx *ctx)
 {
   // Check DMA status and completion
-  if(checkRecvCompletion(bar,BRAM_BASE+0x800) < 0){
+  if(checkRecvCompletion(ctx,ctx->recv.desc_base,ctx->recv.tail_desc) < 0){
      PRINT("Error: DMA transfer failed\n");
      return -1;
   }
   
-  if(pd_syncUserMemory(&um_recv, PD_DIR_FROMDEVICE) <0){
+  if(pd_syncUserMemory(&ctx->recv.um, PD_DIR_FROMDEVICE) <0){
       PRINT("Error: Could not sync user memory\n");
       return -1;
   }
@@ -864,51 +887,55 @@ int checkRecv()
 }
 
 /* Frees the user memory mapping to bus device space previously done for MM2S transfer
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * Returns: 0 on sucess, -1 otherwise
  */
-int freeSend(pd_device_t *pdev)
+int freeSend(dma_ctx *ctx)
 {
-   if(pd_unmapUserMemory( &um_snd ) < 0){
+   if(!ctx->snd.mapped)
+      return 0;
+
+   if(pd_unmapUserMemory( &ctx->snd.um ) < 0){
       PRINT("Error: Could not unmap user memory\n");
       return -1;
    }  
+   ctx->snd.mapped = 0;
    
    return 0;
 }
 
 /* Frees the user memory mapping to bus device space previously done for S2MM transfer
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * Returns: 0 on sucess, -1 otherwise
  */
-int freeRecv(pd_device_t *pdev)
+int freeRecv(dma_ctx *ctx)
 {
-   if(pd_unmapUserMemory( &um_recv ) < 0){
+   if(!ctx->recv.mapped)
+      return 0;
+
+   if(pd_unmapUserMemory( &ctx->recv.um ) < 0){
       PRINT("Error: Could not unmap user memory\n");
       return -1;
    }  
+   ctx->recv.mapped = 0;
    
    return 0;
 }
 
 /* Stops the framework by unmpaping the pcie BAR
- * Arguments: pdev - pcie device handler obtained from a successful call to open()
+ * Arguments: ctx - DMA context previously initialized by initDMA()
  * Returns: 0 on sucess, -1 otherwise
  */
-int stopDMA(pd_device_t *pdev)
+int stopDMA(dma_ctx *ctx)
 { 
-  if(pd_unmapBAR(pdev,0,bar)<0){
+  freeSend(ctx);
+  freeRecv(ctx);
+
+  if(pd_unmapBAR(ctx->pdev,0,ctx->bar)<0){
      PRINT("Error: Could not unmpap BAR0\n");
      return -1;
    }
+  ctx->bar = NULL;
  
   return 0;
 }
-
-
-
-
-
-
-
-
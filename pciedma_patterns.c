@@ -18,21 +18,16 @@
 
 #include "pciedma.h"
 #include "desc_mgmt.h"
+#include "data_patterns.h"
 #include "patterns.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 
 
-/* GLOBAL VARIABLES */
-/*----------------------*/
-unsigned int tail_desc_snd, tail_desc_recv;
-pd_umem_t um_snd, um_recv;
-pd_umem_t *umem_tr_snd, *umem_tr_recv;
-void *bar; // Pointer to the PCIE aperture
-int dest_tx; // Stream destination
-
 void print(const char *fmt, ...)
 {
  va_list args;
@@ -81,6 +76,235 @@ void print(const char *fmt, ...)
 
 
 
+// Register of a channel, addressed with the MM2S register offsets
+#define CHAN_REG(bar_ptr,chan,reg)	((volatile unsigned int*)(bar_ptr))[DMA_INDEX + (((chan)->reg_base + (reg))/4)]
+
+// BAR0 offset of a channel register, for regRead()/regWrite()
+#define CHAN_OFF(chan,reg)		(DMA_BASE + (chan)->reg_base + (reg))
+
+/* Writes the interrupt configuration of a channel (enables, threshold and delay) to its control register */
+void applyIRQ(dma_ctx *ctx, dma_chan *chan)
+{
+  unsigned int dmacr;
+
+  dmacr = regRead(ctx, CHAN_OFF(chan,MM2S_DMACR)) & ~(DMACR_IRQThreshold | DMACR_IRQDelay | DMACR_IOC_IrqEn | DMACR_Dly_IrqEn | DMACR_Err_IrqEn);
+  dmacr = dmacr | ((chan->irq_threshold << IRQTHRESHOLD_SHIFT) & DMACR_IRQThreshold);
+  dmacr = dmacr | ((chan->irq_delay << IRQDELAY_SHIFT) & DMACR_IRQDelay);
+
+  if(chan->irq_en){
+    dmacr = dmacr | DMACR_IOC_IrqEn | DMACR_Err_IrqEn;
+    if(chan->irq_delay)
+      dmacr = dmacr | DMACR_Dly_IrqEn;
+  }
+
+  regWrite(ctx, CHAN_OFF(chan,MM2S_DMACR), dmacr);
+}
+
+/* Sets interrupt coalescing on a channel: one completion interrupt is raised every threshold descriptors, and the delay
+ * timer raises one for a partial batch once the channel has been idle for delay timer periods. Interrupts are enabled
+ * on the channel; the setting is kept across channel restarts and resets
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      threshold - descriptors per interrupt (1-255)
+ * 	      delay - delay timer in timer periods (0-255), 0 disables the delay interrupt
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int setIRQCoalesce(dma_ctx *ctx, int istx, unsigned int threshold, unsigned int delay)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+
+  if(threshold < 1 || threshold > 255 || delay > 255){
+    PRINT("Error: Interrupt threshold must be within 1-255 and delay within 0-255\n");
+    return -1;
+  }
+
+  chan->irq_en = 1;
+  chan->irq_threshold = threshold;
+  chan->irq_delay = delay;
+
+  if(ctx->bar != NULL)
+    applyIRQ(ctx, chan);
+
+  return 0;
+}
+
+/* Acknowledges the pending interrupts of a channel
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * Returns: the interrupt bits that were pending (DMASR_IOC_IRQ, DMASR_DLY_IRQ, DMASR_ERR_IRQ)
+ */
+unsigned int ackIRQ(dma_ctx *ctx, int istx)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  unsigned int pending;
+
+  pending = CHAN_REG(ctx->bar,chan,MM2S_DMASR) & (DMASR_IOC_IRQ | DMASR_DLY_IRQ | DMASR_ERR_IRQ);
+  if(pending)
+    CHAN_REG(ctx->bar,chan,MM2S_DMASR) = pending; // Write 1 to clear
+
+  return pending;
+}
+
+/* Returns 1 if the other channel reported an error it can recover from (see setRecovery()). It may be the one feeding this
+ * channel (a send looped back to a receive), so waits on this channel end to let the caller recover it
+ */
+int peerError(dma_ctx *ctx, dma_chan *chan)
+{
+  dma_chan *other = chan->istx ? &ctx->recv : &ctx->snd;
+
+  return other->retries && (CHAN_REG(ctx->bar,other,MM2S_DMASR) & DMASR_ERR_MASK);
+}
+
+/* Returns 1 once the masked value of a channel register equals value or, for a completion wait, once the channel has halted
+ * or either channel reported an error
+ */
+int chanReady(dma_ctx *ctx, dma_chan *chan, unsigned int reg, unsigned int mask, unsigned int value, int irq)
+{
+  if((CHAN_REG(ctx->bar,chan,reg) & mask) == value)
+    return 1;
+
+  return irq && ((CHAN_REG(ctx->bar,chan,MM2S_DMASR) & (DMASR_HALTED | DMASR_ERR_MASK)) || peerError(ctx, chan));
+}
+
+/* Waits until the masked value of a channel register equals value, following the wait policy of the channel
+ * ctx - DMA context
+ * chan - channel whose register is polled
+ * reg - register offset, relative to the MM2S registers
+ * mask, value - condition to wait for
+ * irq - the condition is signalled by the completion interrupt, so DMA_WAIT_IRQ may block on it; the wait also ends if the
+ *       channel halts or reports an error, as it would never complete
+ */
+void waitChan(dma_ctx *ctx, dma_chan *chan, unsigned int reg, unsigned int mask, unsigned int value, int irq)
+{
+  struct timespec start, now;
+  unsigned long elapsed;
+
+  if(chanReady(ctx, chan, reg, mask, value, irq))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Busy-poll within the budget
+  while(1){
+    if(chanReady(ctx, chan, reg, mask, value, irq))
+      return;
+
+    if(chan->wait.mode == DMA_WAIT_SPIN)
+      continue;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec)*1000000000UL + now.tv_nsec - start.tv_nsec;
+    if(elapsed >= chan->wait.spin_ns)
+      break;
+  }
+
+  // A channel reset clears the interrupt configuration
+  if(irq && chan->wait.mode == DMA_WAIT_IRQ && !(regRead(ctx, CHAN_OFF(chan,MM2S_DMACR)) & DMACR_IOC_IrqEn))
+    applyIRQ(ctx, chan);
+
+  // Back off
+  while(!chanReady(ctx, chan, reg, mask, value, irq)){
+    // With a threshold above one, only the delay timer guarantees an interrupt at the end of a chain
+    if(irq && chan->wait.mode == DMA_WAIT_IRQ && (chan->irq_delay || chan->irq_threshold <= 1)){
+      if(ctx->ops->wait_irq(ctx->dev) < 0){
+        PRINT("Error: Could not wait for interrupt, falling back to sleeping\n");
+        chan->wait.mode = DMA_WAIT_SLEEP;
+      }
+      ackIRQ(ctx, chan->istx);
+    }
+    else
+      usleep(chan->wait.sleep_us);
+  }
+}
+
+/* Sets how a channel waits for the engine. Latency-critical deployments can busy-poll (DMA_WAIT_SPIN), CPU-frugal ones
+ * can back off to sleeping (DMA_WAIT_SLEEP) or to the device interrupt (DMA_WAIT_IRQ) once spin_ns has elapsed.
+ * The interrupt is only used to wait for completion; halt and reset waits fall back to sleeping
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      mode - DMA_WAIT_SPIN, DMA_WAIT_SLEEP or DMA_WAIT_IRQ
+ * 	      spin_ns - busy-poll budget in ns
+ * 	      sleep_us - sleep between polls in us (DMA_WAIT_SLEEP)
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int setWaitPolicy(dma_ctx *ctx, int istx, int mode, unsigned long spin_ns, unsigned int sleep_us)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+
+  if(mode != DMA_WAIT_SPIN && mode != DMA_WAIT_SLEEP && mode != DMA_WAIT_IRQ){
+    PRINT("Error: Unknown wait policy %d\n", mode);
+    return -1;
+  }
+
+  chan->wait.mode = mode;
+  chan->wait.spin_ns = spin_ns;
+  chan->wait.sleep_us = sleep_us;
+
+  // Completion interrupts are needed to block on them
+  if(mode == DMA_WAIT_IRQ){
+    chan->irq_en = 1;
+    if(ctx->bar != NULL)
+      applyIRQ(ctx, chan);
+  }
+
+  return 0;
+}
+
+/* Turns phase tracing on or off: every phase of the transfers of the context (see TRACE_*) is timed with the monotonic clock
+ * and recorded in the ring. dmatrace.h turns the records into histograms and percentiles
+ * Arguments: ctx - DMA context
+ * 	      trace - zeroed trace ring, possibly shared with other contexts; NULL turns tracing off
+ */
+void setTrace(dma_ctx *ctx, dma_trace *trace)
+{
+  ctx->trace = trace;
+}
+
+unsigned long long traceStart(dma_ctx *ctx)
+{
+  struct timespec ts;
+
+  if(ctx->trace == NULL)
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/* Records a phase started at t0 in the trace ring of the context, if any
+ * Arguments: ctx - DMA context
+ * 	      t0 - value returned by traceStart()
+ * 	      phase - TRACE_MAP to TRACE_UNMAP
+ * 	      chan - MM2S (1), S2MM (0) or TRACE_NOCHAN
+ * 	      count - bytes or descriptors handled by the phase
+ */
+void traceEnd(dma_ctx *ctx, unsigned long long t0, int phase, int chan, unsigned int count)
+{
+  dma_trace *tr = ctx->trace;
+  dma_trace_rec *rec;
+  unsigned long long idx, now;
+
+  if(tr == NULL || t0 == 0)
+    return;
+
+  now = traceStart(ctx);
+
+  // Claim a slot; readers skip it until seq shows it is complete
+  idx = __sync_fetch_and_add(&tr->head, 1);
+  rec = &tr->rec[idx & (TRACE_SLOTS - 1)];
+  rec->seq = 0;
+  __sync_synchronize();
+
+  rec->start_ns = t0;
+  rec->ns = (unsigned int)(now - t0);
+  rec->phase = phase;
+  rec->chan = chan;
+  rec->count = count;
+
+  __sync_synchronize();
+  rec->seq = idx + 1;
+}
+
 void dumpBRAM(void *bar)
 {
  int i;
@@ -98,8 +322,9 @@ void resetBRAM(void *bar)
  
  PRINT("Resetting BRAM contents\n");
  
-  for(i=0;i<4096/4;i++){
-  ((unsigned int*)bar)[BRAM_INDEX + i] = 0; 
+  // Cleared with 64-bit stores, halving the number of MMIO writes
+  for(i=0;i<4096/8;i++){
+  ((volatile unsigned long long*)bar)[BRAM_INDEX/2 + i] = 0; 
  }
 }
 
@@ -120,15 +345,17 @@ unsigned int getPCIEaddr(unsigned int axi_addr)
 }
 
 
-/* Set address translation from AXI to PCIe address space, by finding a base that makes all SG Entries addressable by the AXI bus 
+/* Set address translation from AXI to PCIe address space. SG entries are grouped by the AXI2PCIE window holding them (entries
+* crossing a window boundary are split), and each group is translated relative to its own window
 * umem - user memory mapped to the PCI device
 * umem_tr - user memory with addresses referred to the AXI side
-* base_ptr - base address for the AXI2PCIE translation
+* win - will hold the list of windows, in buffer order; must be freed by the caller
+* nwin - will hold the number of windows
 */
-int addrTranslation(pd_umem_t *umem, pd_umem_t **umem_tr, unsigned int *base_ptr)
+int addrTranslation(pd_umem_t *umem, pd_umem_t **umem_tr, dma_window **win, int *nwin)
 {
-  unsigned int base_addr;
-  int i;
+  unsigned int base_addr, addr, size, seg, pos;
+  int i, n, nents;
 
   if (umem->nents == 0){
      PRINT("Error: SG list is empty\n");
@@ -142,46 +369,92 @@ int addrTranslation(pd_umem_t *umem, pd_umem_t **umem_tr, unsigned int *base_ptr
      return(-1);
   }
 
+  // Count the translated entries: an entry is split wherever it crosses into the next window
+  nents = 0;
+  for(i = 0; i < umem->nents; i++){
+	addr = (umem->sg[i]).addr;
+	nents += (((addr + (umem->sg[i]).size - 1) & AXI2PCIE_MASK) - (addr & AXI2PCIE_MASK))/(~AXI2PCIE_MASK + 1) + 1;
+  }
+
   (*umem_tr)->vma = umem->vma;
   (*umem_tr)->size = umem->size;
   (*umem_tr)->handle_id = umem->handle_id;
-  (*umem_tr)->nents = umem->nents;
+  (*umem_tr)->nents = nents;
   (*umem_tr)->pci_handle = umem->pci_handle;
   
-  (*umem_tr)->sg = (pd_umem_sgentry_t*)malloc(sizeof(pd_umem_sgentry_t)*umem->nents);
-  if((*umem_tr)->sg == NULL){
+  (*umem_tr)->sg = (pd_umem_sgentry_t*)malloc(sizeof(pd_umem_sgentry_t)*nents);
+  *win = (dma_window*)malloc(sizeof(dma_window)*nents);
+  if((*umem_tr)->sg == NULL || *win == NULL){
      PRINT("Error: Could not malloc sgentry structure\n");
+     free((*umem_tr)->sg);
+     free(*win);
+     free(*umem_tr);
      return(-1);
   }
 
-  // Get base address from first SG descriptor
-  base_addr = (umem->sg[0]).addr & AXI2PCIE_MASK;
-
-  // All the remaining descriptors must fit within the addressable space of the AXI bus...
+  n = 0;
+  *nwin = 0;
+  pos = 0;
   for(i = 0; i < umem->nents; i++){
-	if((umem->sg[i]).addr & AXI2PCIE_MASK != base_addr){
-	   PRINT("Error: Could not map descriptors into addressable range of the AXI bus\n");
-	   return(-1);
+	addr = (umem->sg[i]).addr;
+	size = (umem->sg[i]).size;
+
+	while(size > 0){
+	  base_addr = addr & AXI2PCIE_MASK;
+	  seg = base_addr + (~AXI2PCIE_MASK + 1) - addr; // Bytes left in the window
+	  if(seg > size)
+	    seg = size;
+
+	  // Open a new window whenever the base changes
+	  if(*nwin == 0 || (*win)[*nwin - 1].base != base_addr){
+	    (*win)[*nwin].base = base_addr;
+	    (*win)[*nwin].offset = pos;
+	    (*win)[*nwin].size = 0;
+	    (*nwin)++;
+	  }
+	  (*win)[*nwin - 1].size += seg;
+
+	  // Save translated address
+	  ((*umem_tr)->sg[n]).addr = addr - base_addr + AXI_PCIE; // maps the address to the correct position within the PCIE_Bridge Base Address
+	  ((*umem_tr)->sg[n]).size = seg;
+	  n++;
+
+	  addr += seg;
+	  size -= seg;
+	  pos += seg;
 	}
-
-	// Save translated address
-	((*umem_tr)->sg[i]).addr = (umem->sg[i]).addr - base_addr + AXI_PCIE; // maps the address to the correct position within the PCIE_Bridge Base Address
-	((*umem_tr)->sg[i]).size = (umem->sg[i]).size;
   }
 
-  *base_ptr = base_addr;
+  if(*nwin > 1)
+    PRINT("Buffer spans %d AXI2PCIE windows\n", *nwin);
+
   return(0);  
 }
 
+/* Returns the window of a registered buffer holding a whole slice, -1 if the slice spans several windows */
+int regWindow(dma_reg *reg, unsigned int offset, unsigned int len)
+{
+  int i;
+
+  for(i = 0; i < reg->nwin; i++){
+    if(offset >= reg->win[i].offset && offset + len <= reg->win[i].offset + reg->win[i].size)
+      return i;
+  }
+
+  PRINT("Error: Slice %d+%d spans several AXI2PCIE windows, use transferReg()\n", offset, len);
+  return -1;
+}
+
 /* Setup an entry in the AXI2PCIEbar register
+ * ctx - DMA context
  * base_ptr - pointer to the base of the memory range that will hold the transferred data
- * bar_ptr - pointer to the mapped BAR0 of the PCIE core
  */
-int setAXI2PCIEbar(unsigned int base_ptr, void *bar_ptr)
+int setAXI2PCIEbar(dma_ctx *ctx, unsigned int base_ptr)
 {
   unsigned int prev_ptr;
   
-  prev_ptr = ((unsigned int*)bar_ptr)[AXIBAR2PCIEBAR0/4];
+  // Served from the shadow once the vector has been read or written
+  prev_ptr = regRead(ctx, AXIBAR2PCIEBAR0);
   // Print current AXI2PCIE Vector for debugging
   PRINT("Previous AXI2PCIE Vector: %08x\n",prev_ptr);
   
@@ -190,13 +463,16 @@ int setAXI2PCIEbar(unsigned int base_ptr, void *bar_ptr)
   
   // Set new AXI2PCIE Vector
   PRINT("Setting AXI2PCIE Vector to: %08x\n",base_ptr);
-  ((unsigned int*)bar_ptr)[AXIBAR2PCIEBAR0/4] = base_ptr;
+  regWrite(ctx, AXIBAR2PCIEBAR0, base_ptr);
   
-  // Check if vector changed successfuly
-  if(base_ptr != ((unsigned int*)bar_ptr)[AXIBAR2PCIEBAR0/4]){
+#ifdef DEBUG
+  // Check if vector changed successfuly; the read back is a round trip, so only debug builds pay for it
+  if(base_ptr != ((volatile unsigned int*)ctx->bar)[AXIBAR2PCIEBAR0/4]){
       PRINT("AXI2PCIE Vector configuration failed.\n");
+      regInvalidate(ctx, AXIBAR2PCIEBAR0);
       return -1;
   }
+#endif
   
   return 0;
 }
@@ -212,7 +488,7 @@ int checkDMAerrors(void *bar_ptr, unsigned int STATUSREG)
    PRINT("Error: DMA Internal Error\n");
    ret = -1; 
  }
- if(status_reg & DMASR_SGSLVERR){
+ if(status_reg & DMASR_DMASLVERR){
    PRINT("Error: DMA Slave Error\n");
   ret = -1; 
  }
@@ -231,69 +507,138 @@ int checkDMAerrors(void *bar_ptr, unsigned int STATUSREG)
    PRINT("Error: DMA Scatter Gather Decode Error\n");
   ret = -1; 
  }
- 
- if(ret == -1){
-   //dumpBRAM(bar_ptr);
-   resetBRAM(bar_ptr); 
- }
+
   return ret;
 }
 
-void MM2Sreset(void *bar_ptr)
+/* Soft-resets the MM2S/S2MM channel, clearing its error state; the channel is left halted
+ * Arguments: ctx - DMA context
+ */
+void MM2Sreset(dma_ctx *ctx)
 {
-  unsigned int read_reset;
-  
  // Set soft reset bit
- ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] | DMACR_RESET;
+ regWrite(ctx, DMA_BASE + MM2S_DMACR, regRead(ctx, DMA_BASE + MM2S_DMACR) | DMACR_RESET);
 
  // Check if reset is done
- do{
-   read_reset = ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] & DMACR_RESET;
-   usleep(10); // Sleep for 10 us
-   
-}
- while(read_reset != 0);
-  
+ waitChan(ctx, &ctx->snd, MM2S_DMACR, DMACR_RESET, 0, 0);
+
+ // The reset restores the control registers of both channels to their defaults
+ regInvalidate(ctx, DMA_BASE + MM2S_DMACR);
+ regInvalidate(ctx, DMA_BASE + S2MM_DMACR);
 }
 
-void S2MMreset(void *bar_ptr)
+void S2MMreset(dma_ctx *ctx)
 {
-  unsigned int read_reset;
-  
  // Set soft reset bit
- ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] | DMACR_RESET;
+ regWrite(ctx, DMA_BASE + S2MM_DMACR, regRead(ctx, DMA_BASE + S2MM_DMACR) | DMACR_RESET);
  
  // Check if reset is done
- do{
-   read_reset = ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] & DMACR_RESET;
-   usleep(10); // Sleep for 10 us
-   
+ waitChan(ctx, &ctx->recv, MM2S_DMACR, DMACR_RESET, 0, 0);
+
+ regInvalidate(ctx, DMA_BASE + MM2S_DMACR);
+ regInvalidate(ctx, DMA_BASE + S2MM_DMACR);
 }
- while(read_reset != 0);
-  
+
+void write_desc_linked(dma_ctx *ctx, unsigned int cur_desc, unsigned int nxt_desc, int first, int last, sgentry_pattern desc_pat, int istx, int tdest);
+void fillDesc(unsigned int *desc, unsigned int nxt_desc, int first, int last, sgentry_pattern desc_pat, int istx, int tdest);
+int destBreak(sgentry_pattern *cur, sgentry_pattern *next);
+
+/* Returns the shadow copy of the descriptor slot at a BRAM location and marks it as dirty
+ * ctx - DMA context
+ * cur_desc - location of the descriptor in the BRAM
+ */
+unsigned int *shadowDesc(dma_ctx *ctx, unsigned int cur_desc)
+{
+  unsigned int slot = (cur_desc - BRAM_BASE)/DESC_SIZE;
+
+  ctx->dirty |= 1ULL << slot;
+  return (unsigned int*)ctx->shadow[slot];
+}
+
+/* Copies the dirty descriptor slots of the shadow into the BRAM as 64-bit stores; must be called before the engine is
+ * pointed at the descriptors (CURDESC/TAILDESC writes)
+ * ctx - DMA context
+ */
+void flushDesc(dma_ctx *ctx)
+{
+  volatile unsigned long long *dst;
+  unsigned long long t0;
+  unsigned int slot, n = 0;
+  int i, chan;
+
+  if(ctx->dirty == 0)
+    return;
+
+  // MM2S slots come first in the shadow, S2MM slots after them
+  chan = !(ctx->dirty >> RING_SLOTS) ? 1 : !(ctx->dirty & ((1ULL << RING_SLOTS) - 1)) ? 0 : TRACE_NOCHAN;
+  t0 = traceStart(ctx);
+
+  for(slot = 0; ctx->dirty != 0; slot++){
+    if(!(ctx->dirty & (1ULL << slot)))
+      continue;
+
+    dst = (volatile unsigned long long*)((char*)ctx->bar + BRAM_BASE + slot*DESC_SIZE);
+    for(i = 0; i < DESC_BURST; i++)
+      dst[i] = ctx->shadow[slot][i];
+
+    ctx->dirty &= ~(1ULL << slot);
+    n++;
+  }
+
+  traceEnd(ctx, t0, TRACE_DESC, chan, n);
 }
 
-/* Write a 2D DMA descriptor to BRAM
- * bar_ptr - pointer to the mapped BAR0 of the PCIE core
+/* Write a 2D DMA descriptor to the descriptor shadow
+ * ctx - DMA context
  * cur_desc - location of BRAM on which the current descriptor must be written to
  * first - first descriptor in the chain
  * last - indicates if it is the last descriptor in the chain
  * desc_pat - Structure containing the 2D desriptor to be written to the BRAM, using AXI addresses
  * istx - TX descriptor (1) or RX descriptor (0)
+ * tdest - stream destination of TX descriptors
  */
-void write_desc_pattern(void *bar_ptr, unsigned int cur_desc, int first, int last, sgentry_pattern desc_pat, int istx)
+void write_desc_pattern(dma_ctx *ctx, unsigned int cur_desc, int first, int last, sgentry_pattern desc_pat, int istx, int tdest)
 {
-  unsigned int write_nxt, ctl_reg, multichannel_reg, stride_reg;
+  unsigned int nxt_desc;
   
   if(!last)
-  	write_nxt = (cur_desc + 0x40); // Write next descriptor pointer (absolute address)
+  	nxt_desc = (cur_desc + 0x40); // Write next descriptor pointer (absolute address)
   else
-	write_nxt = cur_desc;
+	nxt_desc = cur_desc;
+
+  write_desc_linked(ctx, cur_desc, nxt_desc, first, last, desc_pat, istx, tdest);
+}
+
+/* Write a 2D DMA descriptor to the descriptor shadow with an explicit next descriptor pointer; the status of the slot is cleared
+ * ctx - DMA context
+ * cur_desc - location of BRAM on which the current descriptor must be written to
+ * nxt_desc - location of BRAM of the descriptor that follows the current one
+ * first - first descriptor in the frame (sets SOF)
+ * last - last descriptor in the frame (sets EOF)
+ * desc_pat - Structure containing the 2D desriptor to be written to the BRAM, using AXI addresses
+ * istx - TX descriptor (1) or RX descriptor (0)
+ * tdest - stream destination of TX descriptors, unless desc_pat carries its own
+ */
+void write_desc_linked(dma_ctx *ctx, unsigned int cur_desc, unsigned int nxt_desc, int first, int last, sgentry_pattern desc_pat, int istx, int tdest)
+{
+  fillDesc(shadowDesc(ctx, cur_desc), nxt_desc, first, last, desc_pat, istx, tdest);
+}
+
+/* Fills the words of a 2D DMA descriptor, NXTDESC to STATUS, wherever the descriptor is being built (shadow or program image)
+ * desc - descriptor words
+ * Other arguments as in write_desc_linked()
+ */
+void fillDesc(unsigned int *desc, unsigned int nxt_desc, int first, int last, sgentry_pattern desc_pat, int istx, int tdest)
+{
+  unsigned int write_nxt, ctl_reg, multichannel_reg, stride_reg;
 
-  write_nxt = getAXIaddr(write_nxt);
-  ((unsigned int*)bar_ptr)[(cur_desc/4) + (NXTDESC/4)] = write_nxt;
+  write_nxt = getAXIaddr(nxt_desc);
+  desc[NXTDESC/4] = write_nxt;
   
-  ((unsigned int*)bar_ptr)[(cur_desc/4) + (BUFFER_ADDRESS/4)] = desc_pat.addr;
+  desc[BUFFER_ADDRESS/4] = desc_pat.addr;
+
+  if(desc_pat.tdest >= 0)
+    tdest = desc_pat.tdest;
   
   
   // Changes for multichannel and 2D patterns support
@@ -303,8 +648,8 @@ void write_desc_pattern(void *bar_ptr, unsigned int cur_desc, int first, int las
   multichannel_reg = 0;
   
   if (istx){
-    multichannel_reg = multichannel_reg | (dest_tx & TDEST);
-    multichannel_reg = multichannel_reg | ((dest_tx << TID_SHIFT) & TID);
+    multichannel_reg = multichannel_reg | (tdest & TDEST);
+    multichannel_reg = multichannel_reg | ((tdest << TID_SHIFT) & TID);
     //multichannel_reg = multichannel_reg | ((0 << TUSER_SHIFT) & TUSER);
     multichannel_reg = multichannel_reg | ((ARCACHE_DEF << ARCACHE_SHIFT) & ARCACHE);
     //multichannel_reg = multichannel_reg | ((0 << ARUSER_SHIFT) & ARUSER);
@@ -314,7 +659,7 @@ void write_desc_pattern(void *bar_ptr, unsigned int cur_desc, int first, int las
     //multichannel_reg = multichannel_reg | ((0 << AWUSER_SHIFT) & AWUSER);
   }
   
-  ((unsigned int*)bar_ptr)[(cur_desc/4) + (MC_CTL/4)] = multichannel_reg;
+  desc[MC_CTL/4] = multichannel_reg;
 
   // Write Stride Control Register
   stride_reg = 0;
@@ -322,7 +667,7 @@ void write_desc_pattern(void *bar_ptr, unsigned int cur_desc, int first, int las
   stride_reg = (desc_pat.stride & STRIDE); // Set up stride
   stride_reg = stride_reg | ((desc_pat.vsize << VSIZE_SHIFT) & VSIZE);
   
-  ((unsigned int*)bar_ptr)[(cur_desc/4) + (STRIDE_CTL/4)] = stride_reg;
+  desc[STRIDE_CTL/4] = stride_reg;
   //-------------------------------------------------
   
   // Write Control Register
@@ -333,16 +678,51 @@ void write_desc_pattern(void *bar_ptr, unsigned int cur_desc, int first, int las
   if(last)
     ctl_reg = ctl_reg | CONTROL_TXEOF; // and End of Frame to 1 to signal the end of the frame
   
-  ((unsigned int*)bar_ptr)[(cur_desc/4) + (CONTROL/4)] = ctl_reg;
+  desc[CONTROL/4] = ctl_reg;
+  desc[STATUS/4] = 0;
+}
+
+/* Returns the BRAM location of a descriptor slot of a channel
+ * chan - channel owning the slot
+ * slot - index of the slot within the half of the BRAM used by the channel
+ */
+unsigned int slotAddr(dma_chan *chan, unsigned int slot)
+{
+  return chan->desc_base + (slot % RING_SLOTS)*DESC_SIZE;
+}
+
+/* Reads back the STATUS words of consecutive descriptor slots of a channel in one pass. Statuses are never cleared after
+ * completion: every slot is rewritten, STATUS included, through the shadow before the engine can fetch it again
+ * ctx - DMA context
+ * chan - channel owning the slots
+ * slot - first slot, wrapping around the half of the BRAM used by the channel
+ * n - number of slots, at most RING_SLOTS
+ * status - will hold the status word of each slot
+ */
+void readStatus(dma_ctx *ctx, dma_chan *chan, unsigned int slot, unsigned int n, unsigned int *status)
+{
+  volatile unsigned int *bram = (volatile unsigned int*)ctx->bar;
+  unsigned int i;
+
+  for(i = 0; i < n; i++)
+    status[i] = bram[(slotAddr(chan, slot + i)/4) + (STATUS/4)];
+}
+
+/* Returns 1 if the frame of a descriptor must end before the next one: TDEST has to stay constant within a frame, so a change of
+ * stream destination closes it
+ */
+int destBreak(sgentry_pattern *cur, sgentry_pattern *next)
+{
+  return next != NULL && next->tdest != cur->tdest;
 }
 
 /* Setup SG Desriptors for a DMA transfer
  * 
  */
-int setupSGDesc_pattern(pd_umem_pattern *umem_pat, void *bar_ptr, unsigned int base_loc, unsigned int *tail_desc, int istx)
+int setupSGDesc_pattern(pd_umem_pattern *umem_pat, dma_ctx *ctx, unsigned int base_loc, unsigned int *tail_desc, int istx, int tdest)
 {
   unsigned int next_desc, buff_addr, buff_len;
-  int i,last = 0;
+  int i,last = 0, sof = 1, eof;
   sgentry_pattern *cur_desc;
   
   if(base_loc < BRAM_BASE || base_loc > BRAM_BASE + 0x800){
@@ -369,7 +749,9 @@ int setupSGDesc_pattern(pd_umem_pattern *umem_pat, void *bar_ptr, unsigned int b
 		  last = 1;
 		}
 
-                write_desc_pattern(bar_ptr, next_desc, (i==0), last, *cur_desc, istx);
+		eof = last || destBreak(cur_desc, umem_pat->sg->next);
+                write_desc_linked(ctx, next_desc, last ? next_desc : next_desc + 0x40, sof, eof, *cur_desc, istx, tdest);
+		sof = eof;
 		
 		// Free popped descriptor
 		free(cur_desc);
@@ -377,12 +759,16 @@ int setupSGDesc_pattern(pd_umem_pattern *umem_pat, void *bar_ptr, unsigned int b
 		next_desc += + 0x40; // Next descriptor is placed 16 words after current one
 	}
 
+  // Copy the whole chain to the BRAM at once
+  flushDesc(ctx);
+
   return 0;  
 }
 
-int setupDMAsend(void *bar_ptr, unsigned int cur_desc)
+int setupDMAsend(dma_ctx *ctx, unsigned int cur_desc)
 {
-  unsigned int read_status;
+  void *bar_ptr = ctx->bar;
+  unsigned long long t0 = traceStart(ctx);
   
     //0. Check if DMA engine is still running
      if(!(((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMASR/4)] & DMASR_HALTED)){
@@ -391,37 +777,35 @@ int setupDMAsend(void *bar_ptr, unsigned int cur_desc)
     }
     
     // Stop the MM2S channel by setting run/stop bit to 0
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] & ~DMACR_RS;
+    regWrite(ctx, DMA_BASE + MM2S_DMACR, regRead(ctx, DMA_BASE + MM2S_DMACR) & ~DMACR_RS);
+    
+    // CURDESC may only be written once the channel is halted
+    waitChan(ctx, &ctx->snd, MM2S_DMASR, DMASR_HALTED, DMASR_HALTED, 0);
     
     //1. Write absolute address of the starting descriptor to the DMA controller
     ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_CURDESC/4)] = getAXIaddr(cur_desc);
+    ctx->snd.armed = 0;
+    ctx->snd.retried = 0;
     
     //2. Start the MM2S channel running by setting run/stop bit to 1
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] | DMACR_RS;
+    regWrite(ctx, DMA_BASE + MM2S_DMACR, regRead(ctx, DMA_BASE + MM2S_DMACR) | DMACR_RS);
     
     // DMASR.Halted bit should deassert
-    do{
-      read_status = ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMASR/4)] & DMASR_HALTED;
-      usleep(10); // wait for 10 us
-    }while(read_status != 0);
+    waitChan(ctx, &ctx->snd, MM2S_DMASR, DMASR_HALTED, 0, 0);
     
     PRINT("MM2S channel is running\n");
     
-    //3. Optionally enable interrupts
-    //((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] | DMACR_IOC_IrqEn;
-    //((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] | DMACR_Err_IrqEn;
-
-    
-    // Write 0x1 to the IRQThreshold
-    //((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] & ~DMACR_IRQThreshold;
-    //((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] | (0x1 << 16);    
+    //3. Interrupt enables, threshold and delay as set by setIRQCoalesce() (disabled by default)
+    applyIRQ(ctx, &ctx->snd);
     
+    traceEnd(ctx, t0, TRACE_START, 1, 0);
     return 0;
 }
 
-int setupDMArecv(void *bar_ptr, unsigned int cur_desc)
+int setupDMArecv(dma_ctx *ctx, unsigned int cur_desc)
 {
-  unsigned int read_status;
+  void *bar_ptr = ctx->bar;
+  unsigned long long t0 = traceStart(ctx);
   
     //0. Check if DMA engine is still running
      if(!(((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMASR/4)] & DMASR_HALTED)){
@@ -430,76 +814,223 @@ int setupDMArecv(void *bar_ptr, unsigned int cur_desc)
     }
     
     // Stop the S2MM channel by setting run/stop bit to 0
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] & ~DMACR_RS;
+    regWrite(ctx, DMA_BASE + S2MM_DMACR, regRead(ctx, DMA_BASE + S2MM_DMACR) & ~DMACR_RS);
+    
+    // CURDESC may only be written once the channel is halted
+    waitChan(ctx, &ctx->recv, MM2S_DMASR, DMASR_HALTED, DMASR_HALTED, 0);
     
     //1. Write absolute address of the starting descriptor to the DMA controller
     cur_desc = getAXIaddr(cur_desc);
     ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_CURDESC/4)] = cur_desc;
     PRINT("Setting current descriptor on S2MM to: %08x\n",cur_desc);
+    ctx->recv.armed = 0;
+    ctx->recv.retried = 0;
     
     //2. Start the S2MM channel running by setting run/stop bit to 1
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] | DMACR_RS;
+    regWrite(ctx, DMA_BASE + S2MM_DMACR, regRead(ctx, DMA_BASE + S2MM_DMACR) | DMACR_RS);
     
     // DMASR.Halted bit should deassert
-    do{
-      read_status = ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMASR/4)] & DMASR_HALTED;
-      usleep(10); // sleep for 10 us
-    }while(read_status != 0);
+    waitChan(ctx, &ctx->recv, MM2S_DMASR, DMASR_HALTED, 0, 0);
     
     PRINT("S2MM channel is running\n");
     
-    //3. Optionally enable interrupts
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] | DMACR_IOC_IrqEn;
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] | DMACR_Err_IrqEn;
-
-    // Write 0x1 to the IRQThreshold
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] & ~DMACR_IRQThreshold;
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] | (0x1 << 16);
-    
+    //3. Interrupt enables, threshold and delay as set by setIRQCoalesce() (one interrupt per descriptor by default)
+    applyIRQ(ctx, &ctx->recv);
     
+    traceEnd(ctx, t0, TRACE_START, 0, 0);
     return 0;
 }
 
+int streamQueue(dma_chan *chan, pd_umem_pattern *umem_pat);
+
+/* Prepares a one-shot transfer whose descriptor chain does not fit in the BRAM half of the channel. The channel is started in
+ * streaming mode and the descriptors are kept pending; startSend()/startRecv() hand the first window to the engine and
+ * checkSend()/checkRecv() refill completed slots until the whole chain has been transferred
+ * Returns: 0 on success, -1 otherwise
+ */
+int setupChunked(dma_ctx *ctx, int istx, pd_umem_pattern *umem_pat)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+
+  PRINT("Number of SG entries: %d (chunked over %d slots)\n", umem_pat->nents, RING_SLOTS - 1);
+
+  if(startStream(ctx, istx) < 0)
+    return -1;
+
+  if(streamQueue(chan, umem_pat) < 0){
+    stopStream(ctx, istx);
+    return -1;
+  }
+
+  chan->chunked = 1;
+  chan->xfer_bytes = 0;
+  return 0;
+}
+
+/* Waits until the descriptor at a BRAM location is completed or either channel reports an error, following the wait policy of the channel */
+void waitDesc(dma_ctx *ctx, dma_chan *chan, unsigned int cur_desc)
+{
+  volatile unsigned int *status = &((volatile unsigned int*)ctx->bar)[(cur_desc/4) + (STATUS/4)];
+  struct timespec start, now;
+  unsigned long elapsed;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while(!(*status & STATUS_CMPLT) && !(CHAN_REG(ctx->bar,chan,MM2S_DMASR) & (DMASR_ERR_IRQ | DMASR_ERR_MASK)) && !peerError(ctx, chan)){
+    if(chan->wait.mode == DMA_WAIT_SPIN)
+      continue;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec)*1000000000UL + now.tv_nsec - start.tv_nsec;
+    if(elapsed < chan->wait.spin_ns)
+      continue;
+
+    // Block on the interrupt only if one is bound to come: a full batch is in flight or the delay timer covers a partial one
+    if(chan->wait.mode == DMA_WAIT_IRQ && chan->irq_en && (chan->irq_delay || chan->ring_count >= chan->irq_threshold)){
+      if(ctx->ops->wait_irq(ctx->dev) < 0){
+        PRINT("Error: Could not wait for interrupt, falling back to sleeping\n");
+        chan->wait.mode = DMA_WAIT_SLEEP;
+      }
+      ackIRQ(ctx, chan->istx);
+    }
+    else
+      usleep(chan->wait.sleep_us);
+  }
+}
+
+/* Reaps the completed slots of a chunked transfer and refills them from its pending list
+ * Returns: number of descriptors completed, -1 on error
+ */
+int pumpChunked(dma_ctx *ctx, int istx)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  unsigned int bytes;
+  int n;
+
+  n = streamReap(ctx, istx, &bytes);
+  if(n < 0){
+    PRINT("Resetting %s channel\n", istx ? "MM2S" : "S2MM");
+    stopStream(ctx, istx);
+    chan->chunked = 0;
+    if(istx)
+      MM2Sreset(ctx);
+    else
+      S2MMreset(ctx);
+    return -1;
+  }
+  chan->xfer_bytes += bytes;
+
+  if(streamRefill(ctx, istx) < 0){
+    stopStream(ctx, istx);
+    chan->chunked = 0;
+    return -1;
+  }
+
+  return n;
+}
+
+/* Drains a chunked transfer: reaps completed slots and refills them until the pending list is empty, then leaves streaming mode
+ * Returns: 0 on success, -1 otherwise
+ */
+int drainChunked(dma_ctx *ctx, int istx)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  dma_chan *other = istx ? &ctx->recv : &ctx->snd;
+  unsigned int bytes;
+  int n, ndesc = 0;
+
+  while(chan->pending_nents > 0 || chan->ring_count > 0){
+    n = pumpChunked(ctx, istx);
+    if(n < 0)
+      return -1;
+    ndesc += n;
+
+    // A chunked transfer on the other channel may be what this one waits for (a send feeding a receive): keep it fed, and
+    // never block on this channel while the other one needs refilling
+    if(other->chunked){
+      if(pumpChunked(ctx, !istx) < 0)
+        return -1;
+      if(n == 0 && chan->wait.mode != DMA_WAIT_SPIN)
+        usleep(chan->wait.sleep_us);
+      continue;
+    }
+
+    if(n == 0 && chan->ring_count > 0){
+      n = streamWait(ctx, istx, &bytes);
+      if(n <= 0)
+        continue; // Errors are reported by the next streamReap()
+      chan->xfer_bytes += bytes;
+      ndesc += n;
+    }
+  }
+
+  PRINT("%s: Total bytes transferred over %d descriptors: %d\n", istx ? "MM2S" : "S2MM", ndesc, chan->xfer_bytes);
+
+  stopStream(ctx, istx);
+  chan->chunked = 0;
+
+  return 0;
+}
+
 /* Writes the descriptors resulting from patternization into the BRAM and configures the DMA send transfer
-* Arguments: umem_pat - pointer to structure containing the descriptors resulting from patternization
+* Arguments: ctx - DMA context
+*	     umem_pat - pointer to structure containing the descriptors resulting from patternization
 * Returns: 0 on success, -1 otherwise
 */
-int write_pattern_send(pd_umem_pattern *umem_pat)
+int write_pattern_send(dma_ctx *ctx, pd_umem_pattern *umem_pat)
 {
+  if(ctx->snd.ring_running){
+      PRINT("Error: MM2S channel is in streaming mode\n");
+      return -1;
+  }
+
+  // Chains longer than the BRAM half of the channel are fed through the ring by the refill engine
+  if(umem_pat->nents > RING_SLOTS)
+    return setupChunked(ctx, 1, umem_pat);
+
   // Setup translated SG descriptors in the BRAM
-  if(setupSGDesc_pattern(umem_pat,bar,BRAM_BASE,&tail_desc_snd,1) < 0){ 
+  if(setupSGDesc_pattern(umem_pat,ctx,ctx->snd.desc_base,&ctx->snd.tail_desc,1,ctx->dest_tx) < 0){ 
       PRINT("Error: Could not setup DMA transfer\n");
       return -1; 
   }
 
   PRINT("Setting up DMA send\n");
-  if(setupDMAsend(bar,BRAM_BASE) < 0){    
-     PRINT("Error: Could not setup DMA transfer\n");                                                                                                             
-     return -1;                                                                                                                                                  
+  if(setupDMAsend(ctx,ctx->snd.desc_base) < 0){    
+     PRINT("Error: Could not setup DMA transfer\n");
+     return -1;
   }  
   
-  free(umem_tr_snd);                                                                                                                                             
-}                                                                                                                                                                
+  return 0;
+}
 
 /* Writes the descriptors resulting from patternization into the BRAM and configures the DMA receive transfer
-* Arguments: umem_pat - pointer to structure containing the descriptors resulting from patternization
+* Arguments: ctx - DMA context
+*	     umem_pat - pointer to structure containing the descriptors resulting from patternization
 * Returns: 0 on success, -1 otherwise
 */
-int write_pattern_recv(pd_umem_pattern *umem_pat)
+int write_pattern_recv(dma_ctx *ctx, pd_umem_pattern *umem_pat)
 {
+  if(ctx->recv.ring_running){
+      PRINT("Error: S2MM channel is in streaming mode\n");
+      return -1;
+  }
+
+  // Chains longer than the BRAM half of the channel are fed through the ring by the refill engine
+  if(umem_pat->nents > RING_SLOTS)
+    return setupChunked(ctx, 0, umem_pat);
+
   // Setup translated SG descriptors in the BRAM
-  if(setupSGDesc_pattern(umem_pat,bar,BRAM_BASE+0x800,&tail_desc_recv,0) < 0){ 
+  if(setupSGDesc_pattern(umem_pat,ctx,ctx->recv.desc_base,&ctx->recv.tail_desc,0,ctx->dest_tx) < 0){ 
     PRINT("Error: Could not setup DMA transfer\n");
     return -1; 
   }
  
   PRINT("Setting up DMA receive\n");
-  if(setupDMArecv(bar,BRAM_BASE+0x800) < 0){ 
+  if(setupDMArecv(ctx,ctx->recv.desc_base) < 0){ 
     PRINT("Error: Could not setup DMA transfer\n");
     return -1; 
   }
   
-  free(umem_tr_recv);
+  return 0;
 }
 
 
@@ -520,101 +1051,260 @@ void writeTailRecv(void *bar_ptr, unsigned int tail_desc)
     PRINT("S2MM Tail descriptor register: %08x\n", tail_desc);
 }
 
-
-int checkSendCompletion(void *bar_ptr,unsigned int desc_base)
+/* Sets how a channel recovers from a DMA error (decode, slave or internal error). By default the BRAM is wiped, the engine
+ * is reset and the transfer fails, so the caller has to set it up again. With recovery enabled the failed descriptor is
+ * located from CURDESC and the descriptor status words, the engine is reset and the channel resumes from that descriptor
+ * with the descriptors and buffer mappings it already had; the transfer only fails once the same descriptor has failed
+ * more than retries times. The data of the failed descriptor is transferred again from its start, so an MM2S frame
+ * interrupted by the error reaches the stream in two parts. The soft reset is shared by both channels: the other channel
+ * is resumed the same way if it was running, and the descriptor it was processing restarts from its start too
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      retries - recoveries allowed per failed descriptor, 0 disables recovery
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int setRecovery(dma_ctx *ctx, int istx, unsigned int retries)
 {
- unsigned int status_reg, next_desc, total_size;
-  int i;
- 
-  //dumpBRAM(bar_ptr);
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
 
-  // Check for errors
-  if(checkDMAerrors(bar_ptr, MM2S_DMASR) < 0){
-      PRINT("Resetting MM2S channel\n");
-      MM2Sreset(bar_ptr);
-      return -1;
-  }
- 
-  PRINT("Current descriptor being worked on: %08x\n",((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_CURDESC/4)]);
- 
-   // Check if DMA Channel is Idle
-  do{
-    status_reg = ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMASR/4)] & DMASR_IDLE;
-    usleep(1);
-//	PRINT("status_reg: %08x\n");
-  }while(status_reg != DMASR_IDLE);
-    
-  PRINT("MM2S channel is idle\n");
- 
+  chan->retries = retries;
+  chan->retried = 0;
 
-  // Check all transmitted descriptors
-  next_desc = desc_base;
-  total_size = 0;
-  i = 0;
-  while(1){
-    status_reg = ((unsigned int*)bar_ptr)[(next_desc/4) + (STATUS/4)];
-    
-    if(status_reg & STATUS_CMPLT)
-    	PRINT("Descriptor %d transfer completed successfuly\n",i);
-    else{
-    	PRINT("Error: Could not complete descriptor %d transfer\n",i);
-	break;
-    }
+  return 0;
+}
 
-    total_size += status_reg & STATUS_TRANSF;
+/* Restarts a channel after a soft reset from its first descriptor not completed, with the descriptors left in the BRAM.
+ * The status words from that descriptor on are cleared, and TAILDESC is only written if the engine has work left
+ * ctx - DMA context
+ * chan - channel to restart
+ */
+void resumeChan(dma_ctx *ctx, dma_chan *chan)
+{
+  volatile unsigned int *bram = (volatile unsigned int*)ctx->bar;
+  unsigned int cur_desc, tail_desc, i;
+  int left;
+
+  if(chan->ring_running){
+    // Slots completed before the error are left for streamReap()
+    for(i = 0; i < chan->ring_count; i++)
+      if((bram[(slotAddr(chan, chan->ring_tail + i)/4) + (STATUS/4)] & (STATUS_CMPLT | STATUS_ERR_MASK)) != STATUS_CMPLT)
+        break;
+
+    cur_desc = slotAddr(chan, chan->ring_tail + i);
+    tail_desc = slotAddr(chan, chan->ring_head + RING_SLOTS - 1);
+    left = (i < chan->ring_count);
+
+    for(; i < chan->ring_count; i++)
+      shadowDesc(ctx, slotAddr(chan, chan->ring_tail + i))[STATUS/4] = 0;
+  }
+  else{
+    // One-shot chains lie in consecutive slots
+    cur_desc = chan->desc_base;
+    tail_desc = chan->tail_desc;
+    while(cur_desc != tail_desc && (bram[(cur_desc/4) + (STATUS/4)] & (STATUS_CMPLT | STATUS_ERR_MASK)) == STATUS_CMPLT)
+      cur_desc += DESC_SIZE;
 
-    // Erase status descriptor
-    ((unsigned int*)bar_ptr)[(next_desc/4) + (STATUS/4)] = 0;
+    left = (bram[(cur_desc/4) + (STATUS/4)] & (STATUS_CMPLT | STATUS_ERR_MASK)) != STATUS_CMPLT;
 
-    if(next_desc == tail_desc_snd)
-      break; // Reached end of descriptor chain
-    
-    next_desc = getPCIEaddr(((unsigned int*)bar_ptr)[(next_desc/4) + (NXTDESC/4)]);
-    i++;
+    // A chain that was fully transferred stays halted, its completion check only walks the status words
+    if(chan->armed && !left)
+      return;
+
+    if(left)
+      for(i = cur_desc; i <= tail_desc; i += DESC_SIZE)
+        shadowDesc(ctx, i)[STATUS/4] = 0;
 
+    // Without TAILDESC the engine waits for startSend()/startRecv()
+    left = left && chan->armed;
   }
 
-     
-  PRINT("MM2S: Total bytes sent over %d descriptors: %d\n",i+1,total_size);
+  // The descriptors to run again are rewritten whole from the shadow, so that BRAM and shadow stay the same
+  flushDesc(ctx);
 
-   // Stop the MM2S channel by setting run/stop bit to 0
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMACR/4)] & ~DMACR_RS;
-    
-  return 0;
+  PRINT("Resuming %s channel at descriptor %08x\n", chan->istx ? "MM2S" : "S2MM", cur_desc);
+
+  CHAN_REG(ctx->bar,chan,MM2S_CURDESC) = getAXIaddr(cur_desc);
+  regWrite(ctx, CHAN_OFF(chan,MM2S_DMACR), regRead(ctx, CHAN_OFF(chan,MM2S_DMACR)) | DMACR_RS);
+  waitChan(ctx, chan, MM2S_DMASR, DMASR_HALTED, 0, 0);
+
+  // The reset cleared the interrupt configuration
+  applyIRQ(ctx, chan);
+
+  if(left)
+    CHAN_REG(ctx->bar,chan,MM2S_TAILDESC) = getAXIaddr(tail_desc);
 }
 
-int checkRecvCompletion(void *bar_ptr,unsigned int desc_base)
+/* Returns 1 if a channel that reported a DMA error is within its recovery budget; an error at another descriptor than the
+ * previous one means the channel made progress in between, and starts a new budget
+ */
+int canRecover(dma_ctx *ctx, dma_chan *chan)
 {
-  unsigned int status_reg, next_desc, total_size;
-  int i; 
-  
-  // Check for errors
-  if(checkDMAerrors(bar_ptr, S2MM_DMASR) < 0){
-      PRINT("Resetting S2MM channel\n");
-      S2MMreset(bar_ptr);
+  unsigned int cur_desc = CHAN_REG(ctx->bar,chan,MM2S_CURDESC) & CURDESC_PTR;
+
+  if(cur_desc != chan->fail_desc){
+    chan->fail_desc = cur_desc;
+    chan->retried = 0;
+  }
+
+  return chan->retried < chan->retries;
+}
+
+/* Recovers a channel that reported a DMA error without touching the BRAM or the buffer mappings: the engine is reset and
+ * the channel resumes from the descriptor that failed, as does the other channel if it was running (see setRecovery())
+ * ctx - DMA context
+ * chan - channel that reported the error
+ * Returns: 0 if the channel was resumed, -1 if recovery is disabled or exhausted
+ */
+int recoverChan(dma_ctx *ctx, dma_chan *chan)
+{
+  dma_chan *other = chan->istx ? &ctx->recv : &ctx->snd;
+  unsigned int other_sr;
+  int other_run;
+
+  if(!canRecover(ctx, chan))
+    return -1;
+
+  // The reset clears the errors of the other channel too: it must be able to recover from them
+  other_sr = CHAN_REG(ctx->bar,other,MM2S_DMASR);
+  if((other_sr & DMASR_ERR_MASK) && !canRecover(ctx, other))
+    return -1;
+
+  // A running channel has its descriptors set up; a channel halted by an error has them if it was started
+  other_run = !(other_sr & DMASR_HALTED) || ((other_sr & DMASR_ERR_MASK) && (other->ring_running || other->armed));
+
+  PRINT("Recovering %s channel (%d of %d): DMASR %08x, failed descriptor %08x\n", chan->istx ? "MM2S" : "S2MM",
+        chan->retried + 1, chan->retries, CHAN_REG(ctx->bar,chan,MM2S_DMASR), CHAN_REG(ctx->bar,chan,MM2S_CURDESC));
+
+  chan->retried++;
+  chan->recovered++;
+  if(other_sr & DMASR_ERR_MASK){
+    other->retried++;
+    other->recovered++;
+  }
+
+  if(chan->istx)
+    MM2Sreset(ctx);
+  else
+    S2MMreset(ctx);
+
+  resumeChan(ctx, chan);
+  if(other_run)
+    resumeChan(ctx, other);
+
+  return 0;
+}
+
+/* Waits until a one-shot chain is idle, recovering in place the errors of the channel and those of the other channel when
+ * they keep it from completing (a send looped back to a receive)
+ * Returns: 0 once the channel is idle or halted, -1 on an error that could not be recovered
+ */
+int waitChain(dma_ctx *ctx, dma_chan *chan)
+{
+  while(1){
+    waitChan(ctx, chan, MM2S_DMASR, DMASR_IDLE, DMASR_IDLE, 1);
+
+    if(checkDMAerrors(ctx->bar, chan->reg_base + MM2S_DMASR) < 0){
+      if(recoverChan(ctx, chan) < 0)
+        return -1;
+    }
+    else if(!(CHAN_REG(ctx->bar,chan,MM2S_DMASR) & (DMASR_IDLE | DMASR_HALTED)) && peerError(ctx, chan)){
+      if(recoverChan(ctx, chan->istx ? &ctx->recv : &ctx->snd) < 0)
+        return -1;
+    }
+    else
+      return 0;
+  }
+}
+
+int checkSendCompletion(dma_ctx *ctx,unsigned int desc_base,unsigned int tail_desc)
+{
+  void *bar_ptr = ctx->bar;
+ unsigned int status[RING_SLOTS], total_size;
+  unsigned long long t0;
+  int i, ndesc;
+ 
+  //dumpBRAM(bar_ptr);
+
+  PRINT("Current descriptor being worked on: %08x\n",((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_CURDESC/4)]);
+ 
+   // Check if DMA Channel is Idle; errors end the wait and are recovered in place if setRecovery() allows it
+  t0 = traceStart(ctx);
+  if(waitChain(ctx, &ctx->snd) < 0){
+      PRINT("Resetting MM2S channel\n");
+      resetBRAM(bar_ptr);
+      MM2Sreset(ctx);
+      ctx->snd.armed = 0;
       return -1;
   }
+  traceEnd(ctx, t0, TRACE_IDLE, 1, 0);
+    
+  PRINT("MM2S channel is idle\n");
+ 
+
+  // Check all transmitted descriptors: the chain lies in consecutive slots, its statuses are read back in one pass
+  t0 = traceStart(ctx);
+  ndesc = (tail_desc - desc_base)/DESC_SIZE + 1;
+  readStatus(ctx, &ctx->snd, (desc_base - ctx->snd.desc_base)/DESC_SIZE, ndesc, status);
+  total_size = 0;
+  for(i = 0; ; i++){
+    if(status[i] & STATUS_CMPLT)
+    	PRINT("Descriptor %d transfer completed successfuly\n",i);
+    else{
+    	PRINT("Error: Could not complete descriptor %d transfer\n",i);
+	break;
+    }
+
+    total_size += status[i] & STATUS_TRANSF;
+
+    if(i == ndesc - 1)
+      break; // Reached end of descriptor chain
+  }
+
+  traceEnd(ctx, t0, TRACE_STATUS, 1, i+1);
+  PRINT("MM2S: Total bytes sent over %d descriptors: %d\n",i+1,total_size);
+  ctx->snd.xfer_bytes = total_size;
+
+   // Stop the MM2S channel by setting run/stop bit to 0
+    regWrite(ctx, DMA_BASE + MM2S_DMACR, regRead(ctx, DMA_BASE + MM2S_DMACR) & ~DMACR_RS);
+    ctx->snd.armed = 0;
+    
+  return 0;
+}
 
+int checkRecvCompletion(dma_ctx *ctx,unsigned int desc_base,unsigned int tail_desc)
+{
+  void *bar_ptr = ctx->bar;
+  unsigned int status[RING_SLOTS], status_reg, next_desc, total_size;
+  unsigned long long t0;
+  int i, ndesc; 
+  
   PRINT("Current descriptor being worked on: %08x\n",((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_CURDESC/4)]); 
 
-  // Check if DMA Channel is Idle
-  do{
-    status_reg = ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMASR/4)] & DMASR_IDLE;
-    usleep(1);
-  }while(status_reg != DMASR_IDLE);
+  // Check if DMA Channel is Idle; errors end the wait and are recovered in place if setRecovery() allows it
+  t0 = traceStart(ctx);
+  if(waitChain(ctx, &ctx->recv) < 0){
+      PRINT("Resetting S2MM channel\n");
+      resetBRAM(bar_ptr);
+      S2MMreset(ctx);
+      ctx->recv.armed = 0;
+      return -1;
+  }
+  traceEnd(ctx, t0, TRACE_IDLE, 0, 0);
   
   PRINT("S2MM channel is idle\n");
 
   
- // Check all transmitted descriptors
-  next_desc = desc_base;
+ // Check all transmitted descriptors: the chain lies in consecutive slots, its statuses are read back in one pass
+  t0 = traceStart(ctx);
+  ndesc = (tail_desc - desc_base)/DESC_SIZE + 1;
+  readStatus(ctx, &ctx->recv, (desc_base - ctx->recv.desc_base)/DESC_SIZE, ndesc, status);
   total_size = 0;
-  i = 0;
-  while(1){
+  for(i = 0; ; i++){
+    next_desc = desc_base + i*DESC_SIZE;
 
 PRINT("S2MM: CHECKING DESCRIPTOR: %08X\n",next_desc);
 
-    status_reg = ((unsigned int*)bar_ptr)[(next_desc/4) + (STATUS/4)];
+    status_reg = status[i];
     
     if(status_reg & STATUS_CMPLT)
     	PRINT("Descriptor %d transfer completed successfuly\n",i);
@@ -626,23 +1316,18 @@ PRINT("S2MM: CHECKING DESCRIPTOR: %08X\n",next_desc);
     
     PRINT("S2MM RXEOF: %08x\n",status_reg & STATUS_RXEOF);  
     PRINT("S2MM RXSOF: %08x\n",status_reg & STATUS_RXSOF); 
-    PRINT("S2MM TDEST: %08x\n",status_reg & TDEST);
-    PRINT("S2MM TUSER: %08x\n",(status_reg >> TID_SHIFT) & TID);
+    PRINT("S2MM TDEST: %08x\n",((unsigned int*)bar_ptr)[(next_desc/4) + (MC_CTL/4)] & TDEST);
+    PRINT("S2MM TID: %08x\n",(((unsigned int*)bar_ptr)[(next_desc/4) + (MC_CTL/4)] & TID) >> TID_SHIFT);
 
     total_size += status_reg & STATUS_TRANSF;
-
-    // Erase status descriptor
-    ((unsigned int*)bar_ptr)[(next_desc/4) + (STATUS/4)] = 0;
-   PRINT("TAIL_DESC: %08X\n",tail_desc_recv); 
-    if(next_desc == tail_desc_recv)
+   PRINT("TAIL_DESC: %08X\n",tail_desc); 
+    if(next_desc == tail_desc)
       break; // Reached end of descriptor chain
-    
-    next_desc = getPCIEaddr(((unsigned int*)bar_ptr)[(next_desc/4) + (NXTDESC/4)]);
-    i++;
-
   }
  
+  traceEnd(ctx, t0, TRACE_STATUS, 0, i+1);
   PRINT("S2MM: Total bytes sent over %d descriptors: %d\n",i+1,total_size);
+  ctx->recv.xfer_bytes = total_size;
 
   if(status_reg & STATUS_CMPLT)
     PRINT("Descriptor transfer completed successfuly\n");
@@ -652,16 +1337,18 @@ PRINT("S2MM: CHECKING DESCRIPTOR: %08X\n",next_desc);
   } 
   
   // Stop the S2MM channel by setting run/stop bit to 0
-    ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] =  ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMACR/4)] & ~DMACR_RS;
+    regWrite(ctx, DMA_BASE + S2MM_DMACR, regRead(ctx, DMA_BASE + S2MM_DMACR) & ~DMACR_RS);
+    ctx->recv.armed = 0;
     
   return 0;
 }
 
-int waitIOC(pd_device_t *pdev, void *bar_ptr)
+int waitIOC(dma_ctx *ctx)
 {
+ void *bar_ptr = ctx->bar;
  unsigned int status_reg_s2mm, status_reg_mm2s;
  
- if( pd_waitForInterrupt(pdev, 0) < 0){
+ if( ctx->ops->wait_irq(ctx->dev) < 0){
     PRINT("Error: Could not wait for interrupt\n");
     return -1;
  } 
@@ -679,65 +1366,306 @@ int waitIOC(pd_device_t *pdev, void *bar_ptr)
  if(status_reg_s2mm & DMASR_ERR_IRQ)
    PRINT("Received interrupt on error for S2MM completion\n");
 
+ // Acknowledge the interrupts (write 1 to clear)
+ ((unsigned int*)bar_ptr)[DMA_INDEX + (MM2S_DMASR/4)] = status_reg_mm2s & (DMASR_IOC_IRQ | DMASR_DLY_IRQ | DMASR_ERR_IRQ);
+ ((unsigned int*)bar_ptr)[DMA_INDEX + (S2MM_DMASR/4)] = status_reg_s2mm & (DMASR_IOC_IRQ | DMASR_DLY_IRQ | DMASR_ERR_IRQ);
+
  return 0;
   
 }
 
+/* Releases the translated SG list of a channel and, if the channel owns a user memory mapping, unmaps it
+ * ctx - DMA context
+ * chan - channel whose in-flight mapping is released
+ */
+int releaseChan(dma_ctx *ctx, dma_chan *chan)
+{
+  unsigned long long t0;
+  int ret = 0;
+
+  if(chan->umem_tr != NULL){
+    free(chan->umem_tr->sg);
+    free(chan->umem_tr);
+    chan->umem_tr = NULL;
+  }
+
+  if(chan->mapped){
+    t0 = traceStart(ctx);
+    if(ctx->ops->unmap_umem(ctx->dev, &chan->um) < 0){
+      PRINT("Error: Could not unmap user memory\n");
+      ret = -1;
+    }
+    traceEnd(ctx, t0, TRACE_UNMAP, chan->istx, chan->um.size);
+    chan->mapped = 0;
+  }
+
+  // Registered buffers keep their mapping until unregisterBuffer(), kernel buffers until they are returned to their pool
+  chan->reg = NULL;
+  chan->kbuf = NULL;
+
+  return ret;
+}
+
+/* Builds a translated SG list covering only a slice of another translated SG list
+ * umem_tr - translated SG list of the whole buffer
+ * offset - offset in bytes of the slice
+ * len - size in bytes of the slice
+ * slice - will hold the translated SG list of the slice
+ */
+int sliceTranslation(pd_umem_t *umem_tr, unsigned int offset, unsigned int len, pd_umem_t **slice)
+{
+  unsigned int pos, skip, seg;
+  int i, n;
+
+  if(len == 0 || offset + len > umem_tr->size){
+     PRINT("Error: Slice %d+%d exceeds the registered buffer\n", offset, len);
+     return -1;
+  }
+
+  *slice = (pd_umem_t*)malloc(sizeof(pd_umem_t));
+  if(*slice == NULL){
+     PRINT("Error: Could not malloc umem structure\n");
+     return(-1);
+  }
+
+  (*slice)->sg = (pd_umem_sgentry_t*)malloc(sizeof(pd_umem_sgentry_t)*umem_tr->nents);
+  if((*slice)->sg == NULL){
+     PRINT("Error: Could not malloc sgentry structure\n");
+     free(*slice);
+     return(-1);
+  }
+
+  (*slice)->vma = umem_tr->vma + offset;
+  (*slice)->size = len;
+  (*slice)->handle_id = umem_tr->handle_id;
+  (*slice)->pci_handle = umem_tr->pci_handle;
+
+  // Copy the entries that intersect [offset, offset+len), clipping the first and the last one
+  pos = 0;
+  n = 0;
+  for(i = 0; i < umem_tr->nents && len > 0; i++){
+    seg = (umem_tr->sg[i]).size;
+    
+    if(pos + seg <= offset){
+      pos += seg;
+      continue;
+    }
+
+    skip = (offset > pos) ? offset - pos : 0;
+    seg -= skip;
+    if(seg > len)
+      seg = len;
+
+    ((*slice)->sg[n]).addr = (umem_tr->sg[i]).addr + skip;
+    ((*slice)->sg[n]).size = seg;
+    n++;
+
+    len -= seg;
+    pos += (umem_tr->sg[i]).size;
+  }
+
+  (*slice)->nents = n;
+  return 0;
+}
+
+/* Allocates a translated SG list with a single entry, used for transfers to/from the DDR3 that need no user mapping
+ * ctx - DMA context
+ * chan - channel that will hold the translated list
+ * address - AXI address of the DDR3 block
+ * buf_size - size in bytes of the block
+ */
+int setupChanDDR(dma_ctx *ctx, dma_chan *chan, unsigned int address, unsigned int buf_size)
+{
+  releaseChan(ctx, chan);
+
+  // Create a umem structure with translated addresses
+  chan->umem_tr = (pd_umem_t*)malloc(sizeof(pd_umem_t));
+  if(chan->umem_tr == NULL){
+     PRINT("Error: Could not malloc umem structure\n");
+     return(-1);
+  }
+
+  chan->umem_tr->vma = 0x0; // Not used
+  chan->umem_tr->size = buf_size; // Read a buf_size block 
+  chan->umem_tr->handle_id = 0; // Not used
+  chan->umem_tr->nents = 1;
+  chan->umem_tr->pci_handle = 0x0; // Not used
+  
+  chan->umem_tr->sg = (pd_umem_sgentry_t*)malloc(sizeof(pd_umem_sgentry_t)*1);
+  if(chan->umem_tr->sg == NULL){
+     PRINT("Error: Could not malloc sgentry structure\n");
+     free(chan->umem_tr);
+     chan->umem_tr = NULL;
+     return(-1);
+  }
+  
+  // Read a buf_size block from the DDR3
+  (chan->umem_tr->sg[0]).addr = 0x00000000 + address; // DDR3 base address (through the AXI2AXI connector) 
+  (chan->umem_tr->sg[0]).size = buf_size;
+
+  return 0;
+}
+
+/* pciDriver backend */
+
+void *pdMapBAR(void *dev)
+{
+  return pd_mapBAR((pd_device_t*)dev, 0);
+}
+
+int pdUnmapBAR(void *dev, void *bar)
+{
+  return pd_unmapBAR((pd_device_t*)dev, 0, bar);
+}
+
+int pdMapUmem(void *dev, void *mem, unsigned int size, pd_umem_t *um)
+{
+  return pd_mapUserMemory((pd_device_t*)dev, mem, size, um);
+}
+
+int pdUnmapUmem(void *dev, pd_umem_t *um)
+{
+  (void)dev;
+  return pd_unmapUserMemory(um);
+}
+
+int pdSyncUmem(void *dev, pd_umem_t *um, int dir)
+{
+  (void)dev;
+  return pd_syncUserMemory(um, dir);
+}
+
+void *pdAllocKmem(void *dev, unsigned int size, pd_kmem_t *km)
+{
+  return pd_allocKernelMemory((pd_device_t*)dev, size, km);
+}
+
+int pdFreeKmem(void *dev, pd_kmem_t *km)
+{
+  (void)dev;
+  return pd_freeKernelMemory(km);
+}
+
+int pdWaitIRQ(void *dev)
+{
+  return pd_waitForInterrupt((pd_device_t*)dev, 0);
+}
+
+const dma_ops pd_ops = {
+  "pciDriver",
+  pdMapBAR,
+  pdUnmapBAR,
+  pdMapUmem,
+  pdUnmapUmem,
+  pdSyncUmem,
+  pdAllocKmem,
+  pdFreeKmem,
+  pdWaitIRQ
+};
+
 /* Initializes the framework by mapping the BAR of the PCIE bridge and resetting the DMA engine; Should be called prior to anything else
- * Arguments: pdev - pcie device handler obtained from a successful call to open()
+ * Arguments: ctx - DMA context to initialize
+ * 	      pdev - pcie device handler obtained from a successful call to open()
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int initDMA(dma_ctx *ctx, pd_device_t *pdev)
+{
+ if(initDMAbackend(ctx, &pd_ops, pdev) < 0)
+   return -1;
+
+ ctx->pdev = pdev;
+ return 0;
+}
+
+/* Same as initDMA() on any backend
+ * Arguments: ctx - DMA context to initialize
+ * 	      ops - backend operations
+ * 	      dev - device handle of the backend, passed to every operation
  * Returns: 0 on sucess, -1 otherwise
  */
-int initDMA(pd_device_t *pdev)
+int initDMAbackend(dma_ctx *ctx, const dma_ops *ops, void *dev)
 { 
- bar = pd_mapBAR(pdev,0);
- if (bar == NULL) {
+ memset(ctx, 0, sizeof(dma_ctx));
+ 
+ ctx->ops = ops;
+ ctx->dev = dev;
+ ctx->snd.desc_base = BRAM_BASE; // MM2S descriptors use the lower half of the BRAM
+ ctx->recv.desc_base = BRAM_BASE + 0x800; // S2MM descriptors use the upper half of the BRAM
+ ctx->snd.istx = 1;
+ ctx->snd.reg_base = MM2S_DMACR;
+ ctx->recv.istx = 0;
+ ctx->recv.reg_base = S2MM_DMACR;
+ ctx->snd.wait.mode = ctx->recv.wait.mode = DMA_WAIT_SLEEP;
+ ctx->snd.wait.spin_ns = ctx->recv.wait.spin_ns = DMA_SPIN_DEF;
+ ctx->snd.wait.sleep_us = ctx->recv.wait.sleep_us = DMA_SLEEP_DEF;
+ ctx->snd.irq_threshold = ctx->recv.irq_threshold = 1;
+ ctx->recv.irq_en = 1; // S2MM interrupts on every descriptor, MM2S interrupts are off until configured
+ 
+ ctx->bar = ops->map_bar(dev);
+ if (ctx->bar == NULL) {
    PRINT("Error: Could not map BAR0\n");
    return -1;
  }
  
- resetBRAM(bar);
+ resetBRAM(ctx->bar);
  
   PRINT("Resetting DMA controller\n");
   // Reset DMA controller
-  MM2Sreset(bar);
+  MM2Sreset(ctx);
   
  
   return 0;
 }
 
 /* Prepares a MM2S DMA transfer by mapping the user memory into device space, translating addresses and writing the SG descriptors to BRAM
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * 	      user_buffer - pointer to user buffer that holds the data to transmit
  * 	      buf_size - size in bytes of the data to transmit
  * 	      str_dest - stream destination (slave address) 
  * Returns: 0 on sucess, -1 otherwise
  */
-int setupSend(pd_device_t *pdev, void *user_buffer, unsigned int buf_size, int str_dest)
+int setupSend(dma_ctx *ctx, void *user_buffer, unsigned int buf_size, int str_dest)
 {
   unsigned int base_axi2pcie;
+  unsigned long long t0;
+  dma_window *win;
+  int nwin;
   
-  int i;
-  
-  if(bar == NULL){
+  if(ctx->bar == NULL){
       PRINT("Error: BAR pointer is not initialized\n");
       return -1;
   }
 
+  releaseChan(ctx, &ctx->snd);
+
   // Map user buffer into device space
-  if(pd_mapUserMemory(pdev, user_buffer, buf_size, &um_snd) < 0){
+  t0 = traceStart(ctx);
+  if(ctx->ops->map_umem(ctx->dev, user_buffer, buf_size, &ctx->snd.um) < 0){
       PRINT("Error: Could not allocate provided user buffer\n");
       return -1;
   }
+  ctx->snd.mapped = 1;
+  traceEnd(ctx, t0, TRACE_MAP, 1, buf_size);
   
   // Translate addresses to the AXI bus side
-  if(addrTranslation(&um_snd, &umem_tr_snd, &base_axi2pcie) < 0){
+  t0 = traceStart(ctx);
+  if(addrTranslation(&ctx->snd.um, &ctx->snd.umem_tr, &win, &nwin) < 0){
      PRINT("Error: Could not translate addresses for the AXI bus\n");
      return -1;
   }
+  traceEnd(ctx, t0, TRACE_TRANSLATE, 1, buf_size);
+
+  // A single transfer is addressed through one window; larger buffers go through registerBuffer() and transferReg()
+  base_axi2pcie = win[0].base;
+  free(win);
+  if(nwin > 1){
+     PRINT("Error: Buffer spans %d AXI2PCIE windows, register it and use transferReg()\n", nwin);
+     return -1;
+  }
 
   PRINT("Setting address translation\n");
   // Set Address translation in the PCIE Core
-  if(setAXI2PCIEbar(base_axi2pcie, bar) < 0){
+  if(setAXI2PCIEbar(ctx, base_axi2pcie) < 0){
      PRINT("Error: Could not configure address translation on the PCIe core\n");
      return -1;
   }
@@ -745,99 +1673,64 @@ int setupSend(pd_device_t *pdev, void *user_buffer, unsigned int buf_size, int s
    PRINT("Writing SG descriptors to BRAM\n");
    
    // Set stream destination
-   dest_tx = str_dest;
+   ctx->dest_tx = str_dest;
    
   return 0;
 }
 
 // Memory Map to Stream (Reads from the DDR and puts the data in the MM2S interface)
-int setupSendfromDDR(pd_device_t *pdev, unsigned int address, unsigned int buf_size, int str_dest)
+int setupSendfromDDR(dma_ctx *ctx, unsigned int address, unsigned int buf_size, int str_dest)
 {
-  // Create a umem structure with translated addresses
-  umem_tr_snd = (pd_umem_t*)malloc(sizeof(pd_umem_t));
-  if(umem_tr_snd == NULL){
-     PRINT("Error: Could not malloc umem structure\n");
-     return(-1);
-  }
-
-  umem_tr_snd->vma = 0x0; // Not used
-  umem_tr_snd->size = buf_size; // Read a buf_size block 
-  umem_tr_snd->handle_id = 0; // Not used
-  umem_tr_snd->nents = 1;
-  umem_tr_snd->pci_handle = 0x0; // Not used
-  
-  umem_tr_snd->sg = (pd_umem_sgentry_t*)malloc(sizeof(pd_umem_sgentry_t)*1);
-  if(umem_tr_snd->sg == NULL){
-     PRINT("Error: Could not malloc sgentry structure\n");
-     return(-1);
-  }
-  
-  // Read a buf_size block from the DDR3
-  (umem_tr_snd->sg[0]).addr = 0x00000000 + address; // DDR3 base address (through the AXI2AXI connector) 
-  (umem_tr_snd->sg[0]).size = buf_size;
+  if(setupChanDDR(ctx, &ctx->snd, address, buf_size) < 0)
+    return -1;
   
   PRINT("Writing SG descriptors to BRAM\n");
   
   // Set stream destination
-   dest_tx = str_dest;
+   ctx->dest_tx = str_dest;
   
   return(0);  
 }
 
-void genReset(unsigned long mask)
+void genReset(dma_ctx *ctx, unsigned long mask)
 {
  unsigned int mask32 = 0xFFFF;
 
  // Write reset mask to register 2
- ((unsigned int*)bar)[CMU_INDEX + (CMU_KCML/4)] = (mask & mask32);
+ regWrite(ctx, CMU_BASE + CMU_KCML, mask & mask32);
 
- ((unsigned int*)bar)[CMU_INDEX + (CMU_KCMH/4)] = (mask >> 32) & mask32;
+ regWrite(ctx, CMU_BASE + CMU_KCMH, (mask >> 32) & mask32);
  
  // Trigger reset by setting bit 0 of register 1 to 1
- ((unsigned int*)bar)[CMU_INDEX + (CMU_KCR/4)] = CMU_ICR_RS;
+ regWrite(ctx, CMU_BASE + CMU_KCR, CMU_ICR_RS);
+
+ // The reset bit self-clears, the next access has to read the device again
+ regInvalidate(ctx, CMU_BASE + CMU_KCR);
 
 }
 
-unsigned int getInterrupt()
+unsigned int getInterrupt(dma_ctx *ctx)
 {
-  return ((unsigned int*)bar)[CMU_INDEX + (CMU_KIVL/4)];
+  return ((unsigned int*)ctx->bar)[CMU_INDEX + (CMU_KIVL/4)];
 }
 
-unsigned int cmuWrite(unsigned int reg_offset, unsigned int data)
+unsigned int cmuWrite(dma_ctx *ctx, unsigned int reg_offset, unsigned int data)
 {
- ((unsigned int*)bar)[CMU_INDEX + (reg_offset/4)] = data;
+ regWrite(ctx, CMU_BASE + reg_offset, data);
+
+ return data;
 }
 
-unsigned int cmuRead(unsigned int reg_offset)
+unsigned int cmuRead(dma_ctx *ctx, unsigned int reg_offset)
 {
- return ((unsigned int*)bar)[CMU_INDEX + (reg_offset/4)];
+ return regRead(ctx, CMU_BASE + reg_offset);
 }
 
 // Stream to Memory Map (Obtains data from the S2MM interface and writes to the DDR)
-int setupRecvtoDDR(pd_device_t *pdev, unsigned int address, unsigned int buf_size)
+int setupRecvtoDDR(dma_ctx *ctx, unsigned int address, unsigned int buf_size)
 {
-  // Create a umem structure with translated addresses
-  umem_tr_recv = (pd_umem_t*)malloc(sizeof(pd_umem_t));
-  if(umem_tr_recv == NULL){
-     PRINT("Error: Could not malloc umem structure\n");
-     return(-1);
-  }
-
-  umem_tr_recv->vma = 0x0; // Not used
-  umem_tr_recv->size = buf_size; // Read a buf_size block 
-  umem_tr_recv->handle_id = 0; // Not used
-  umem_tr_recv->nents = 1;
-  umem_tr_recv->pci_handle = 0x0; // Not used
-  
-  umem_tr_recv->sg = (pd_umem_sgentry_t*)malloc(sizeof(pd_umem_sgentry_t)*1);
-  if(umem_tr_recv->sg == NULL){
-     PRINT("Error: Could not malloc sgentry structure\n");
-     return(-1);
-  }
-  
-  // Read a buf_size block from the DDR3
-  (umem_tr_recv->sg[0]).addr = 0x00000000 + address; // DDR3 base address (through the AXI2AXI connector) 
-  (umem_tr_recv->sg[0]).size = buf_size;
+  if(setupChanDDR(ctx, &ctx->recv, address, buf_size) < 0)
+    return -1;
   
   PRINT("Writing Recv SG descriptors to BRAM\n");
   
@@ -845,100 +1738,984 @@ int setupRecvtoDDR(pd_device_t *pdev, unsigned int address, unsigned int buf_siz
 }
 
 /* Prepares a S2MM DMA transfer by mapping the user memory into device space, translating addresses and writing the SG descriptors to BRAM
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * 	      user_buffer - pointer to user buffer that holds the data to transmit
  * 	      buf_size - size in bytes of the data to transmit
  * Returns: 0 on sucess, -1 otherwise
  */
-int setupRecv(pd_device_t *pdev, void *user_buffer, unsigned int buf_size)
+int setupRecv(dma_ctx *ctx, void *user_buffer, unsigned int buf_size)
 {
-  unsigned int base_axi2pcie;
+  unsigned long long t0;
+  dma_window *win;
+  int nwin;
   
-  int i;
-
-  if(bar == NULL){
+  if(ctx->bar == NULL){
      PRINT("Error: BAR pointer is not initialized\n");
      return -1;
   }
+
+  releaseChan(ctx, &ctx->recv);
   
   // Map user buffer into device space
-  if(pd_mapUserMemory( pdev, user_buffer, buf_size, &um_recv) < 0){
+  t0 = traceStart(ctx);
+  if(ctx->ops->map_umem(ctx->dev, user_buffer, buf_size, &ctx->recv.um) < 0){
       PRINT("Error: Could not allocate provided user buffer\n");
       return -1;
   }
+  ctx->recv.mapped = 1;
+  traceEnd(ctx, t0, TRACE_MAP, 0, buf_size);
   
   // Translate addresses to the AXI bus side
-  if( addrTranslation(&um_recv, &umem_tr_recv, &base_axi2pcie) < 0){
+  t0 = traceStart(ctx);
+  if( addrTranslation(&ctx->recv.um, &ctx->recv.umem_tr, &win, &nwin) < 0){
      PRINT("Error: Could not translate addresses for the AXI bus\n");
      return -1;
   }
+  traceEnd(ctx, t0, TRACE_TRANSLATE, 0, buf_size);
+
+  free(win);
+  if(nwin > 1){
+     PRINT("Error: Buffer spans %d AXI2PCIE windows, register it and use transferReg()\n", nwin);
+     return -1;
+  }
 
   return 0; 
 }
 
-/* Starts DMA MM2S transfer with the parameters set on the previous call to setupSend()
- * Arguments: blocking - 1 for interrupt mode, 0 for non blocking mode
- * Returns: 0 on success, -1 otherwise
+/* Registers a user buffer with the device: the buffer is mapped and its SG list translated only once, so that later transfers
+ * can reference any part of it through setupSendReg()/setupRecvReg() without pinning memory again
+ * Arguments: ctx - DMA context
+ * 	      user_buffer - pointer to the user buffer
+ * 	      buf_size - size in bytes of the buffer
+ * 	      reg - will hold the registration handle
+ * Returns: 0 on sucess, -1 otherwise
  */
-int startSend(pd_device_t *pdev, int blocking)
+int registerBuffer(dma_ctx *ctx, void *user_buffer, unsigned int buf_size, dma_reg **reg)
 {
+  dma_reg *r = NULL;
+  unsigned long long t0;
+  int i;
 
-//PRINT("INSIDE STARTSEND\n");
-//dumpBRAM(bar);
-
-   writeTailSend(bar,tail_desc_snd);
-  
-   if(blocking){
-     PRINT("Wait on interrupt\n");
-     if(waitIOC(pdev,bar)<0){
-	PRINT("Error: Wait on interrupt failed\n");
+  if(ctx->bar == NULL){
+     PRINT("Error: BAR pointer is not initialized\n");
      return -1;
-     }
-   }
-
-   return 0;  
-}
+  }
 
+  // Find a free entry in the pool
+  for(i = 0; i < DMA_MAX_REG; i++){
+    if(!ctx->reg[i].in_use){
+      r = &ctx->reg[i];
+      break;
+    }
+  }
 
-/* Starts DMA S2MM transfer with the parameters set on the previous call to setupRecv()
- * Arguments: blocking - 1 for interrupt mode, 0 for non blocking mode
- * Returns: 0 on success, -1 otherwise
- */
-int startRecv(pd_device_t *pdev, int blocking)
-{
-  writeTailRecv(bar,tail_desc_recv);
-  
-  if(blocking){
-     PRINT("Wait on interrupt\n");
-     if(waitIOC(pdev,bar)<0){
-	PRINT("Error: Wait on interrupt failed\n");
+  if(r == NULL){
+     PRINT("Error: No free entries in the registered buffer pool\n");
      return -1;
-     }
-   }
-   
-   return 0;  
-}
+  }
 
-/* Checks if the DMA MM2S transfer is complete and there were no errors; this function should be always called before starting other transfer
- * Arguments: 
- * Returns: 0 on success, -1 otherwise
- */
-int checkSend()
-{
-  // Check DMA status and completion
-  if(checkSendCompletion(bar,BRAM_BASE) < 0){
-     PRINT("Error: DMA transfer failed\n");
+  // Map user buffer into device space
+  t0 = traceStart(ctx);
+  if(ctx->ops->map_umem(ctx->dev, user_buffer, buf_size, &r->um) < 0){
+      PRINT("Error: Could not allocate provided user buffer\n");
+      return -1;
+  }
+  traceEnd(ctx, t0, TRACE_MAP, TRACE_NOCHAN, buf_size);
+
+  // Translate addresses to the AXI bus side
+  t0 = traceStart(ctx);
+  if(addrTranslation(&r->um, &r->umem_tr, &r->win, &r->nwin) < 0){
+     PRINT("Error: Could not translate addresses for the AXI bus\n");
+     ctx->ops->unmap_umem(ctx->dev, &r->um);
      return -1;
   }
-  
+  traceEnd(ctx, t0, TRACE_TRANSLATE, TRACE_NOCHAN, buf_size);
+  r->base_axi2pcie = r->win[0].base;
+
+  r->vaddr = user_buffer;
+  r->size = buf_size;
+  r->in_use = 1;
+
+  PRINT("Registered buffer %p (%d bytes, %d SG entries)\n", user_buffer, buf_size, r->um.nents);
+
+  *reg = r;
   return 0;
 }
 
+/* Releases a registration previously obtained from registerBuffer(); channels still referencing it are released too
+ * Arguments: ctx - DMA context
+ * 	      reg - registration handle
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int unregisterBuffer(dma_ctx *ctx, dma_reg *reg)
+{
+  unsigned long long t0;
+
+  if(reg == NULL || !reg->in_use)
+    return -1;
+
+  if(ctx->snd.reg == reg)
+    releaseChan(ctx, &ctx->snd);
+  if(ctx->recv.reg == reg)
+    releaseChan(ctx, &ctx->recv);
+
+  free(reg->umem_tr->sg);
+  free(reg->umem_tr);
+  free(reg->win);
+  reg->umem_tr = NULL;
+  reg->win = NULL;
+  reg->in_use = 0;
+
+  t0 = traceStart(ctx);
+  if(ctx->ops->unmap_umem(ctx->dev, &reg->um) < 0){
+      PRINT("Error: Could not unmap user memory\n");
+      return -1;
+  }
+  traceEnd(ctx, t0, TRACE_UNMAP, TRACE_NOCHAN, reg->size);
+
+  return 0;
+}
+
+/* Points a channel to a slice of a registered buffer and sets the matching address translation
+ * ctx - DMA context
+ * chan - channel that will transfer the slice
+ * reg - registration handle
+ * offset, len - slice of the registered buffer
+ */
+int setupChanReg(dma_ctx *ctx, dma_chan *chan, dma_reg *reg, unsigned int offset, unsigned int len)
+{
+  unsigned long long t0;
+  int w;
+
+  if(ctx->bar == NULL){
+     PRINT("Error: BAR pointer is not initialized\n");
+     return -1;
+  }
+
+  if(reg == NULL || !reg->in_use){
+     PRINT("Error: Buffer is not registered\n");
+     return -1;
+  }
+
+  releaseChan(ctx, chan);
+
+  w = regWindow(reg, offset, len);
+  if(w < 0)
+     return -1;
+
+  t0 = traceStart(ctx);
+  if(sliceTranslation(reg->umem_tr, offset, len, &chan->umem_tr) < 0)
+     return -1;
+  traceEnd(ctx, t0, TRACE_TRANSLATE, chan->istx, len);
+
+  chan->reg = reg;
+
+  // Set Address translation in the PCIE Core
+  if(setAXI2PCIEbar(ctx, reg->win[w].base) < 0){
+     PRINT("Error: Could not configure address translation on the PCIe core\n");
+     return -1;
+  }
+
+  return 0;
+}
+
+/* Prepares a MM2S DMA transfer of a slice of a registered buffer; the pattern functions then apply to the slice
+ * Arguments: ctx - DMA context
+ * 	      reg - registration handle
+ * 	      offset - offset in bytes of the slice within the registered buffer
+ * 	      len - size in bytes of the slice
+ * 	      str_dest - stream destination (slave address)
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int setupSendReg(dma_ctx *ctx, dma_reg *reg, unsigned int offset, unsigned int len, int str_dest)
+{
+  unsigned long long t0;
+
+  if(setupChanReg(ctx, &ctx->snd, reg, offset, len) < 0)
+    return -1;
+
+  // The buffer may have been written by the CPU since it was registered
+  t0 = traceStart(ctx);
+  if(ctx->ops->sync_umem(ctx->dev, &reg->um, PD_DIR_TODEVICE) < 0){
+      PRINT("Error: Could not sync user memory\n");
+      return -1;
+  }
+  traceEnd(ctx, t0, TRACE_SYNC, 1, reg->size);
+
+  // Set stream destination
+  ctx->dest_tx = str_dest;
+
+  return 0;
+}
+
+/* Prepares a S2MM DMA transfer into a slice of a registered buffer; the pattern functions then apply to the slice
+ * Arguments: ctx - DMA context
+ * 	      reg - registration handle
+ * 	      offset - offset in bytes of the slice within the registered buffer
+ * 	      len - size in bytes of the slice
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int setupRecvReg(dma_ctx *ctx, dma_reg *reg, unsigned int offset, unsigned int len)
+{
+  return setupChanReg(ctx, &ctx->recv, reg, offset, len);
+}
+
+/* Points a channel to a slice of a kernel buffer: a single translated entry, no mapping to release */
+int setupChanKbuf(dma_ctx *ctx, dma_chan *chan, dma_kbuf *kb, unsigned int offset, unsigned int len)
+{
+  if(ctx->bar == NULL){
+     PRINT("Error: BAR pointer is not initialized\n");
+     return -1;
+  }
+
+  if(kb == NULL || len == 0 || offset + len > kb->size){
+     PRINT("Error: Slice %d+%d exceeds the kernel buffer\n", offset, len);
+     return -1;
+  }
+
+  if(setupChanDDR(ctx, chan, kb->axi_addr + offset, len) < 0)
+     return -1;
+
+  chan->kbuf = kb;
+
+  // Set Address translation in the PCIE Core
+  if(setAXI2PCIEbar(ctx, kb->base_axi2pcie) < 0){
+     PRINT("Error: Could not configure address translation on the PCIe core\n");
+     return -1;
+  }
+
+  return 0;
+}
+
+/* Sets up a DMA MM2S/S2MM transfer from/to a slice of a kernel buffer: a single translated entry, with no mapping and no
+ * cache sync. The descriptors are then written by any of the apply* calls as for the other setup calls
+ * Arguments: ctx - DMA context
+ * 	      kb - kernel buffer (see kpoolGet())
+ * 	      offset, len - slice of the kernel buffer
+ * 	      str_dest - stream destination (send only)
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int setupSendKbuf(dma_ctx *ctx, dma_kbuf *kb, unsigned int offset, unsigned int len, int str_dest)
+{
+  if(setupChanKbuf(ctx, &ctx->snd, kb, offset, len) < 0)
+    return -1;
+
+  // Set stream destination
+  ctx->dest_tx = str_dest;
+
+  return 0;
+}
+
+int setupRecvKbuf(dma_ctx *ctx, dma_kbuf *kb, unsigned int offset, unsigned int len)
+{
+  return setupChanKbuf(ctx, &ctx->recv, kb, offset, len);
+}
+
+/* Transfers a slice of a registered buffer of any size in one call, blocking until it completes. The slice is split at the
+ * AXI2PCIE window boundaries and the parts are transferred in sequence, the translation being reprogrammed for each one.
+ * The other channel must not be running a transfer meanwhile, since both share the translation register
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      reg - registration handle
+ * 	      offset, len - slice of the registered buffer
+ * 	      str_dest - stream destination (MM2S only)
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int transferReg(dma_ctx *ctx, int istx, dma_reg *reg, unsigned int offset, unsigned int len, int str_dest)
+{
+  unsigned int start, end, part;
+  int i;
+
+  if(reg == NULL || !reg->in_use){
+     PRINT("Error: Buffer is not registered\n");
+     return -1;
+  }
+
+  if(len == 0 || offset + len > reg->size){
+     PRINT("Error: Slice %d+%d exceeds the registered buffer\n", offset, len);
+     return -1;
+  }
+
+  // One sub-transfer per window intersecting the slice
+  for(i = 0; i < reg->nwin; i++){
+    start = (offset > reg->win[i].offset) ? offset : reg->win[i].offset;
+    end = reg->win[i].offset + reg->win[i].size;
+    if(end > offset + len)
+      end = offset + len;
+    if(start >= end)
+      continue;
+    part = end - start;
+
+    if(istx){
+      if(setupSendReg(ctx, reg, start, part, str_dest) < 0 || applySG_send(ctx) < 0)
+        return -1;
+      if(startSend(ctx, 0) < 0 || checkSend(ctx) < 0)
+        return -1;
+    }
+    else{
+      if(setupRecvReg(ctx, reg, start, part) < 0 || applySG_recv(ctx) < 0)
+        return -1;
+      if(startRecv(ctx, 0) < 0 || checkRecv(ctx) < 0)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Puts a channel in streaming mode: the descriptor slots of the channel are linked into a ring and the channel is started once
+ * and left running. Descriptors are then appended with streamSubmit() and recycled with streamReap(), each costing only a few
+ * register writes instead of a full channel restart.
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * Returns: 0 on success, -1 otherwise
+ */
+int startStream(dma_ctx *ctx, int istx)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  unsigned int cur_desc, *desc;
+  unsigned long long t0;
+  int i;
+
+  if(ctx->bar == NULL){
+     PRINT("Error: BAR pointer is not initialized\n");
+     return -1;
+  }
+
+  if(chan->ring_running)
+     return 0;
+
+  // Link every slot to the next one, the last slot pointing back to the first
+  for(i = 0; i < RING_SLOTS; i++){
+    cur_desc = slotAddr(chan, i);
+    desc = shadowDesc(ctx, cur_desc);
+    desc[NXTDESC/4] = getAXIaddr(slotAddr(chan, i+1));
+    desc[STATUS/4] = 0;
+  }
+  flushDesc(ctx);
+
+  chan->ring_head = 0;
+  chan->ring_tail = 0;
+  chan->ring_count = 0;
+  chan->ring_unflushed = 0;
+  chan->retried = 0;
+
+  // Stop the channel, point it to the first slot and start it; it stays idle until TAILDESC is written
+  t0 = traceStart(ctx);
+  regWrite(ctx, CHAN_OFF(chan,MM2S_DMACR), regRead(ctx, CHAN_OFF(chan,MM2S_DMACR)) & ~DMACR_RS);
+  waitChan(ctx, chan, MM2S_DMASR, DMASR_HALTED, DMASR_HALTED, 0);
+  CHAN_REG(ctx->bar,chan,MM2S_CURDESC) = getAXIaddr(slotAddr(chan, 0));
+  regWrite(ctx, CHAN_OFF(chan,MM2S_DMACR), regRead(ctx, CHAN_OFF(chan,MM2S_DMACR)) | DMACR_RS);
+
+  // DMASR.Halted bit should deassert
+  waitChan(ctx, chan, MM2S_DMASR, DMASR_HALTED, 0, 0);
+
+  applyIRQ(ctx, chan);
+  traceEnd(ctx, t0, TRACE_START, istx, 0);
+
+  PRINT("%s channel is running in streaming mode\n", istx ? "MM2S" : "S2MM");
+
+  chan->ring_running = 1;
+  return 0;
+}
+
+/* Writes one descriptor in the next free slot of a running ring, without advancing TAILDESC
+ * Returns: slot used on success, -1 if the ring is full
+ */
+int ringPush(dma_ctx *ctx, dma_chan *chan, sgentry_pattern *desc, int sof, int eof)
+{
+  unsigned int slot;
+
+  // One slot is always left empty so that a full ring is never mistaken for an empty one
+  if(chan->ring_count >= RING_SLOTS - 1)
+    return -1;
+
+  slot = chan->ring_head;
+
+  // The status of the recycled slot is cleared along with the descriptor
+  write_desc_linked(ctx, slotAddr(chan, slot), slotAddr(chan, slot+1), sof, eof, *desc, chan->istx, ctx->dest_tx);
+
+  chan->ring_head = (slot + 1) % RING_SLOTS;
+  chan->ring_count++;
+  chan->ring_unflushed++;
+
+  return slot;
+}
+
+/* Copies the descriptors pushed to a running ring into the BRAM and advances TAILDESC to the last one */
+void ringTail(dma_ctx *ctx, dma_chan *chan, unsigned int slot)
+{
+  unsigned long long t0;
+
+  flushDesc(ctx);
+
+  t0 = traceStart(ctx);
+  CHAN_REG(ctx->bar,chan,MM2S_TAILDESC) = getAXIaddr(slotAddr(chan, slot));
+  traceEnd(ctx, t0, TRACE_TAIL, chan->istx, chan->ring_count);
+
+  chan->ring_unflushed = 0;
+}
+
+/* Appends one descriptor to a running ring and advances TAILDESC so that the engine fetches it
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      desc - descriptor to append (AXI address, HSIZE, VSIZE, STRIDE)
+ * 	      sof, eof - Start/End of frame flags of the descriptor (MM2S only)
+ * Returns: slot used on success, RING_FULL if the ring is full, -1 on error
+ */
+int streamSubmit(dma_ctx *ctx, int istx, sgentry_pattern *desc, int sof, int eof)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  int slot;
+
+  if(!chan->ring_running){
+     PRINT("Error: Channel is not in streaming mode\n");
+     return -1;
+  }
+
+  slot = ringPush(ctx, chan, desc, sof, eof);
+  if(slot < 0)
+    return RING_FULL;
+
+  ringTail(ctx, chan, slot);
+
+  return slot;
+}
+
+/* Appends a slice of a registered buffer to a running ring as a single frame, with one TAILDESC write
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      reg - registration handle
+ * 	      offset, len - slice of the registered buffer
+ * Returns: number of descriptors used on success, RING_FULL if there are not enough free slots, -1 on error; nothing is
+ *          appended unless the whole slice fits
+ */
+int streamSubmitReg(dma_ctx *ctx, int istx, dma_reg *reg, unsigned int offset, unsigned int len)
+{
+  int n;
+
+  // A failed post pushes nothing, so there is nothing to hand to the engine either
+  n = streamPostReg(ctx, istx, reg, offset, len);
+  if(n > 0)
+    streamFlush(ctx, istx);
+
+  return n;
+}
+
+/* Copies the descriptors posted since the last TAILDESC write into the BRAM and advances TAILDESC past them
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * Returns: number of descriptors handed to the engine
+ */
+int streamFlush(dma_ctx *ctx, int istx)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  int n = chan->ring_unflushed;
+
+  if(n > 0)
+    ringTail(ctx, chan, (chan->ring_head + RING_SLOTS - 1) % RING_SLOTS);
+
+  return n;
+}
+
+/* Same as streamSubmitReg() without advancing TAILDESC, so that a batch of slices is handed to the engine by one streamFlush()
+ * Returns: number of descriptors used on success, RING_FULL if there are not enough free slots, -1 on error; nothing is
+ *          appended unless the whole slice fits
+ */
+int streamPostReg(dma_ctx *ctx, int istx, dma_reg *reg, unsigned int offset, unsigned int len)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  pd_umem_t *slice;
+  sgentry_pattern *list, *cur_desc;
+  unsigned long long t0;
+  int i, k, n, w;
+
+  if(!chan->ring_running){
+     PRINT("Error: Channel is not in streaming mode\n");
+     return -1;
+  }
+
+  if(reg == NULL || !reg->in_use){
+     PRINT("Error: Buffer is not registered\n");
+     return -1;
+  }
+
+  w = regWindow(reg, offset, len);
+  if(w < 0)
+    return -1;
+
+  t0 = traceStart(ctx);
+  if(sliceTranslation(reg->umem_tr, offset, len, &slice) < 0)
+    return -1;
+  traceEnd(ctx, t0, TRACE_TRANSLATE, istx, len);
+
+  // The whole slice is described before anything is pushed, so that a slice that does not fit leaves the ring untouched
+  list = sglist_new();
+  if(list == NULL){
+    free(slice->sg);
+    free(slice);
+    return -1;
+  }
+
+  for(i = 0, n = 0; i < slice->nents && n >= 0; i++){
+    k = sglist_push_split(list, (slice->sg[i]).addr, (slice->sg[i]).size);
+    n = (k < 0) ? -1 : n + k;
+  }
+  free(slice->sg);
+  free(slice);
+
+  if(n > (int)(RING_SLOTS - 1 - chan->ring_count)){
+    PRINT("Error: Not enough free slots in the ring (%d needed)\n", n);
+    n = RING_FULL;
+  }
+  else if(n >= 0 && setAXI2PCIEbar(ctx, reg->win[w].base) < 0){
+     PRINT("Error: Could not configure address translation on the PCIe core\n");
+     n = -1;
+  }
+
+  if(n > 0 && istx){
+    t0 = traceStart(ctx);
+    ctx->ops->sync_umem(ctx->dev, &reg->um, PD_DIR_TODEVICE);
+    traceEnd(ctx, t0, TRACE_SYNC, 1, reg->size);
+  }
+
+  for(i = 0; (cur_desc = sglist_pop(list)) != NULL; i++){
+    if(n > 0)
+      ringPush(ctx, chan, cur_desc, (i == 0), (i == n - 1));
+    free(cur_desc);
+  }
+  free(list);
+
+  return n;
+}
+
+/* Recycles the descriptors completed by the engine since the last call, oldest first
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      bytes - if not NULL, will hold the number of bytes transferred by the recycled descriptors
+ * Returns: number of recycled descriptors, -1 on a DMA error that could not be recovered (see setRecovery())
+ */
+int streamReap(dma_ctx *ctx, int istx, unsigned int *bytes)
+{
+  return streamReapCompl(ctx, istx, NULL, RING_SLOTS, bytes);
+}
+
+/* Same as streamReap(), also reporting the completion of every recycled descriptor; descriptors beyond max are left for the
+ * next call
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      compl - will hold the completions, oldest first
+ * 	      max - room in compl
+ * 	      bytes - if not NULL, will hold the number of bytes transferred by the recycled descriptors
+ * Returns: number of recycled descriptors, -1 on a DMA error that could not be recovered (see setRecovery())
+ */
+int streamReapCompl(dma_ctx *ctx, int istx, dma_compl *compl, int max, unsigned int *bytes)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  unsigned int status[RING_SLOTS], status_reg, total_size = 0, cur_desc, pos, span = 0;
+  unsigned long long t0;
+  int n = 0;
+
+  t0 = traceStart(ctx);
+  if(chan->ring_count > 0 && max > 0){
+    // A poll that finds nothing costs a single read
+    readStatus(ctx, chan, chan->ring_tail, 1, status);
+    span = 1;
+  }
+
+  if(span > 0 && (status[0] & STATUS_CMPLT) && chan->ring_count > 1 && max > 1){
+    // The engine has not gone past CURDESC: only the slots up to it are worth reading. A CURDESC outside the slots in flight
+    // (not updated yet, or still on a recycled slot) gives no bound
+    cur_desc = getPCIEaddr(CHAN_REG(ctx->bar,chan,MM2S_CURDESC) & CURDESC_PTR);
+    span = chan->ring_count;
+    if(cur_desc >= chan->desc_base && cur_desc < chan->desc_base + RING_SLOTS*DESC_SIZE){
+      pos = ((cur_desc - chan->desc_base)/DESC_SIZE + RING_SLOTS - chan->ring_tail) % RING_SLOTS;
+      if(pos < span)
+        span = pos + 1;
+    }
+    if(span > (unsigned int)max)
+      span = max;
+    readStatus(ctx, chan, chan->ring_tail + 1, span - 1, status + 1);
+  }
+
+  while((unsigned int)n < span){
+    status_reg = status[n];
+    if(!(status_reg & STATUS_CMPLT))
+      break; // Descriptors complete in order
+
+    // The stream sideband of a received frame is written back next to the status
+    if(compl != NULL){
+      compl[n].status = status_reg;
+      compl[n].mc = ((unsigned int*)ctx->bar)[(slotAddr(chan, chan->ring_tail)/4) + (MC_CTL/4)];
+    }
+
+    total_size += status_reg & STATUS_TRANSF;
+
+    chan->ring_tail = (chan->ring_tail + 1) % RING_SLOTS;
+    chan->ring_count--;
+    n++;
+  }
+
+  // Polls that found nothing are not recorded, they would flood the ring
+  if(n > 0){
+    traceEnd(ctx, t0, TRACE_STATUS, istx, n);
+    chan->retried = 0;
+  }
+
+  // Slots completed before an error were recycled above, the others are resubmitted if setRecovery() allows it
+  if(checkDMAerrors(ctx->bar, chan->reg_base + MM2S_DMASR) < 0 && recoverChan(ctx, chan) < 0){
+     PRINT("Error: %s channel reported an error in streaming mode\n", istx ? "MM2S" : "S2MM");
+     resetBRAM(ctx->bar);
+     return -1;
+  }
+
+  if(bytes != NULL)
+    *bytes = total_size;
+
+  return n;
+}
+
+/* Moves the descriptors of a pattern to the end of the pending list of a channel, as one frame
+ * Returns: 0 on success, -1 otherwise
+ */
+int streamQueue(dma_chan *chan, pd_umem_pattern *umem_pat)
+{
+  sgentry_pattern *last;
+
+  if(umem_pat->nents <= 0)
+    return 0;
+
+  if(chan->pending == NULL){
+    chan->pending = sglist_new();
+    if(chan->pending == NULL)
+      return -1;
+    chan->pending_nents = 0;
+    chan->pending_sof = 1;
+  }
+
+  last = chan->pending;
+  while(last->next != NULL)
+    last = last->next;
+
+  last->next = umem_pat->sg->next;
+  umem_pat->sg->next = NULL;
+
+  chan->pending_nents += umem_pat->nents;
+  umem_pat->nents = 0;
+
+  return 0;
+}
+
+/* Appends a slice of a kernel buffer to a running ring as a single frame, with one TAILDESC write
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      kb - kernel buffer
+ * 	      offset, len - slice of the kernel buffer
+ * Returns: number of descriptors used on success, RING_FULL if there are not enough free slots, -1 on error; nothing is
+ *          appended unless the whole slice fits
+ */
+int streamSubmitKbuf(dma_ctx *ctx, int istx, dma_kbuf *kb, unsigned int offset, unsigned int len)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  sgentry_pattern *list, *cur_desc;
+  int i, n, slot = -1;
+
+  if(!chan->ring_running){
+     PRINT("Error: Channel is not in streaming mode\n");
+     return -1;
+  }
+
+  if(kb == NULL || len == 0 || offset + len > kb->size){
+     PRINT("Error: Slice %d+%d exceeds the kernel buffer\n", offset, len);
+     return -1;
+  }
+
+  // Contiguous memory: one descriptor, unless the slice exceeds what a single 2D descriptor can describe
+  list = sglist_new();
+  if(list == NULL)
+    return -1;
+
+  n = sglist_push_split(list, kb->axi_addr + offset, len);
+  if(n < 0 || n > (int)(RING_SLOTS - 1 - chan->ring_count)){
+    if(n > 0){
+      PRINT("Error: Not enough free slots in the ring (%d needed)\n", n);
+      n = RING_FULL;
+    }
+    while((cur_desc = sglist_pop(list)) != NULL)
+      free(cur_desc);
+    free(list);
+    return n;
+  }
+
+  if(setAXI2PCIEbar(ctx, kb->base_axi2pcie) < 0){
+     PRINT("Error: Could not configure address translation on the PCIe core\n");
+     n = -1;
+  }
+
+  for(i = 0; (cur_desc = sglist_pop(list)) != NULL; i++){
+    if(n > 0)
+      slot = ringPush(ctx, chan, cur_desc, (i == 0), (i == n - 1));
+    free(cur_desc);
+  }
+  free(list);
+
+  if(slot >= 0)
+    ringTail(ctx, chan, slot);
+
+  return n;
+}
+
+/* Queues a descriptor list of any length as one frame on a channel in streaming mode. As many descriptors as there are free
+ * slots are handed to the engine right away; the rest are kept pending and fed by streamRefill() as slots are recycled
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      umem_pat - descriptors resulting from patternization; the descriptors are moved out of it
+ * Returns: 0 on success, -1 otherwise
+ */
+int streamSubmitPattern(dma_ctx *ctx, int istx, pd_umem_pattern *umem_pat)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+
+  if(!chan->ring_running){
+     PRINT("Error: Channel is not in streaming mode\n");
+     return -1;
+  }
+
+  if(streamQueue(chan, umem_pat) < 0)
+    return -1;
+
+  return (streamRefill(ctx, istx) < 0) ? -1 : 0;
+}
+
+/* Moves pending descriptors into the slots freed by streamReap() and advances TAILDESC once
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * Returns: number of descriptors handed to the engine, -1 otherwise
+ */
+int streamRefill(dma_ctx *ctx, int istx)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  sgentry_pattern *cur_desc;
+  int eof, n = 0, slot = -1;
+
+  if(!chan->ring_running){
+     PRINT("Error: Channel is not in streaming mode\n");
+     return -1;
+  }
+
+  while(chan->pending_nents > 0 && chan->ring_count < RING_SLOTS - 1){
+    cur_desc = sglist_pop(chan->pending);
+    if(cur_desc == NULL)
+      break;
+
+    chan->pending_nents--;
+    eof = (chan->pending_nents == 0) || destBreak(cur_desc, chan->pending->next);
+
+    slot = ringPush(ctx, chan, cur_desc, chan->pending_sof, eof);
+    chan->pending_sof = eof; // Descriptors pending together form a single frame per stream destination
+    free(cur_desc);
+    n++;
+  }
+
+  if(slot >= 0)
+    ringTail(ctx, chan, slot);
+
+  return n;
+}
+
+/* Waits, following the wait policy of the channel, until at least one descriptor in flight has completed and recycles every
+ * descriptor completed since the last call. A single coalesced interrupt may therefore account for many descriptors
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      bytes - if not NULL, will hold the number of bytes transferred by the recycled descriptors
+ * Returns: number of recycled descriptors (0 if nothing is in flight), -1 on a DMA error that could not be recovered
+ */
+int streamWait(dma_ctx *ctx, int istx, unsigned int *bytes)
+{
+  return streamWaitCompl(ctx, istx, NULL, RING_SLOTS, bytes);
+}
+
+/* Same as streamWait(), reporting completions as streamReapCompl() does
+ * Returns: number of recycled descriptors (0 if nothing is in flight), -1 on a DMA error that could not be recovered
+ */
+int streamWaitCompl(dma_ctx *ctx, int istx, dma_compl *compl, int max, unsigned int *bytes)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  unsigned long long t0;
+
+  if(bytes != NULL)
+    *bytes = 0;
+
+  if(!chan->ring_running || chan->ring_count == 0)
+    return 0;
+
+  t0 = traceStart(ctx);
+  waitDesc(ctx, chan, slotAddr(chan, chan->ring_tail));
+  traceEnd(ctx, t0, TRACE_IDLE, istx, chan->ring_count);
+
+  // The other channel stopped feeding this one: resume it, its completed slots are left to its own streamReap()
+  if(peerError(ctx, chan))
+    recoverChan(ctx, istx ? &ctx->recv : &ctx->snd);
+
+  // Everything completed up to now is recycled, however many descriptors the interrupt covered
+  return streamReapCompl(ctx, istx, compl, max, bytes);
+}
+
+/* Stops a channel running in streaming mode; descriptors not yet completed are discarded
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * Returns: 0 on success, -1 otherwise
+ */
+int stopStream(dma_ctx *ctx, int istx)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  sgentry_pattern *cur_desc;
+
+  if(!chan->ring_running)
+    return 0;
+
+  // Stop the channel by setting run/stop bit to 0
+  regWrite(ctx, CHAN_OFF(chan,MM2S_DMACR), regRead(ctx, CHAN_OFF(chan,MM2S_DMACR)) & ~DMACR_RS);
+
+  if(chan->ring_count > 0 || chan->pending_nents > 0)
+    PRINT("Discarding %d descriptors still in flight, %d pending\n", chan->ring_count, chan->pending_nents);
+
+  if(chan->pending != NULL){
+    while((cur_desc = sglist_pop(chan->pending)) != NULL)
+      free(cur_desc);
+    free(chan->pending);
+    chan->pending = NULL;
+  }
+  chan->pending_nents = 0;
+
+  chan->ring_running = 0;
+  chan->ring_count = 0;
+  chan->ring_unflushed = 0;
+  chan->ring_head = 0;
+  chan->ring_tail = 0;
+
+  return 0;
+}
+
+/* Starts DMA MM2S transfer with the parameters set on the previous call to setupSend()
+ * Arguments: ctx - DMA context
+ * 	      blocking - 1 for interrupt mode, 0 for non blocking mode
+ * Returns: 0 on success, -1 otherwise
+ */
+int startSend(dma_ctx *ctx, int blocking)
+{
+   unsigned long long t0;
+
+//PRINT("INSIDE STARTSEND\n");
+//dumpBRAM(ctx->bar);
+
+   if(ctx->snd.chunked){
+     // Refilling needs the host, the completion wait is done by checkSend()
+     return (streamRefill(ctx, 1) < 0) ? -1 : 0;
+   }
+
+   t0 = traceStart(ctx);
+   writeTailSend(ctx->bar,ctx->snd.tail_desc);
+   ctx->snd.armed = 1;
+   traceEnd(ctx, t0, TRACE_TAIL, 1, 0);
+  
+   if(blocking){
+     PRINT("Wait on interrupt\n");
+     if(waitIOC(ctx)<0){
+	PRINT("Error: Wait on interrupt failed\n");
+     return -1;
+     }
+   }
+
+   return 0;  
+}
+
+
+/* Starts DMA S2MM transfer with the parameters set on the previous call to setupRecv()
+ * Arguments: ctx - DMA context
+ * 	      blocking - 1 for interrupt mode, 0 for non blocking mode
+ * Returns: 0 on success, -1 otherwise
+ */
+int startRecv(dma_ctx *ctx, int blocking)
+{
+  unsigned long long t0;
+
+  ctx->recv.seen_desc = ctx->recv.desc_base;
+  ctx->recv.seen_bytes = 0;
+  ctx->recv.synced_bytes = 0;
+  ctx->recv.seen_done = 0;
+
+  if(ctx->recv.chunked){
+    // Refilling needs the host, the completion wait is done by checkRecv()
+    return (streamRefill(ctx, 0) < 0) ? -1 : 0;
+  }
+
+  t0 = traceStart(ctx);
+  writeTailRecv(ctx->bar,ctx->recv.tail_desc);
+  ctx->recv.armed = 1;
+  traceEnd(ctx, t0, TRACE_TAIL, 0, 0);
+  
+  if(blocking){
+     PRINT("Wait on interrupt\n");
+     if(waitIOC(ctx)<0){
+	PRINT("Error: Wait on interrupt failed\n");
+     return -1;
+     }
+   }
+   
+   return 0;  
+}
+
+/* Checks if the DMA MM2S transfer is complete and there were no errors; this function should be always called before starting other transfer
+ * Arguments: ctx - DMA context
+ * Returns: 0 on success, -1 otherwise
+ */
+int checkSend(dma_ctx *ctx)
+{
+  if(ctx->snd.chunked)
+    return drainChunked(ctx, 1);
+
+  // Check DMA status and completion
+  if(checkSendCompletion(ctx,ctx->snd.desc_base,ctx->snd.tail_desc) < 0){
+     PRINT("Error: DMA transfer failed\n");
+     return -1;
+  }
+  
+  return 0;
+}
+
+
+/* Makes the bytes written by the S2MM channel visible to the CPU. Only the written range needs syncing: nothing is synced
+ * when the descriptors report no bytes or the buffer is a coherent kernel buffer. pciDriver syncs a mapping as a whole, so
+ * a non-empty range still costs a sync of the entire mapping
+ * Arguments: ctx - DMA context
+ * 	      bytes - bytes the descriptors reported as written
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int syncRecv(dma_ctx *ctx, unsigned int bytes)
+{
+  unsigned long long t0;
+
+  if(bytes == 0 || ctx->recv.kbuf != NULL)
+    return 0;
+
+  t0 = traceStart(ctx);
+  if(ctx->ops->sync_umem(ctx->dev, ctx->recv.reg ? &ctx->recv.reg->um : &ctx->recv.um, PD_DIR_FROMDEVICE) <0){
+      PRINT("Error: Could not sync user memory\n");
+      return -1;
+  }
+  traceEnd(ctx, t0, TRACE_SYNC, 0, bytes);
+
+  return 0;
+}
 
 // Version of checkRecv() call without a user buffer associated
-int checkRecvNoBuf()
+int checkRecvNoBuf(dma_ctx *ctx)
 {
-  if(checkRecvCompletion(bar,BRAM_BASE+0x800) < 0){
+  if(ctx->recv.chunked)
+    return drainChunked(ctx, 0);
+
+  if(checkRecvCompletion(ctx,ctx->recv.desc_base,ctx->recv.tail_desc) < 0){
      PRINT("Error: DMA transfer failed\n");
      return -1;
   }
@@ -948,72 +2725,306 @@ int checkRecvNoBuf()
 
 /* Checks if the DMA S2MM transfer is complete and there were no errors; 
  * This function should be always called before using the receive buffer because it performs necessary syncing between the user buffer and kernel buffer
- * Arguments: 
+ * Arguments: ctx - DMA context
  * Returns: 0 on success, -1 otherwise
  */
-int checkRecv()
+int checkRecv(dma_ctx *ctx)
 {
   // Check DMA status and completion
-
-  if(checkRecvCompletion(bar,BRAM_BASE+0x800) < 0){
+  if(ctx->recv.chunked){
+    if(drainChunked(ctx, 0) < 0){
+       PRINT("Error: DMA transfer failed\n");
+       return -1;
+    }
+  }
+  else if(checkRecvCompletion(ctx,ctx->recv.desc_base,ctx->recv.tail_desc) < 0){
      PRINT("Error: DMA transfer failed\n");
      return -1;
   }
   
-  if(pd_syncUserMemory(&um_recv, PD_DIR_FROMDEVICE) <0){
-      PRINT("Error: Could not sync user memory\n");
+  return syncRecv(ctx, ctx->recv.xfer_bytes);
+}
+
+/* Reports how much of the S2MM transfer started by startRecv() is final, without waiting. The descriptors are walked from the
+ * first one not yet seen completed, so each descriptor status is read once; a chunked transfer is also refilled. The bytes
+ * are counted in descriptor order, which for a linear receive (setupRecv(), setupRecvReg(), ...) is the start of the buffer.
+ * A sync covers the whole user mapping however few bytes are new, so a caller polling often should only ask for it before
+ * reading the buffer. checkRecv() must still be called to end the transfer
+ * Arguments: ctx - DMA context
+ * 	      bytes - will hold the bytes final so far
+ * 	      sync - 1 to sync the final bytes for the CPU, 0 to only count them
+ * Returns: 1 if every descriptor completed, 0 if the transfer is still in progress, -1 on error
+ */
+int recvProgress(dma_ctx *ctx, unsigned int *bytes, int sync)
+{
+  dma_chan *chan = &ctx->recv;
+  volatile unsigned int *bar = (volatile unsigned int*)ctx->bar;
+  unsigned int status_reg, total;
+  unsigned long long t0;
+  int done, i = 0;
+
+  if(chan->chunked){
+    // Reaping the ring accounts the completed descriptors and makes room for the pending ones
+    if(pumpChunked(ctx, 0) < 0)
       return -1;
+    total = chan->xfer_bytes;
+    done = chan->pending_nents == 0 && chan->ring_count == 0;
   }
-  
+  else if(chan->armed){
+    // Statuses are left in place, checkRecvCompletion() still walks the whole chain
+    t0 = traceStart(ctx);
+    total = chan->seen_bytes;
+    while(!chan->seen_done){
+      status_reg = bar[(chan->seen_desc/4) + (STATUS/4)];
+      if(!(status_reg & STATUS_CMPLT) || (status_reg & STATUS_ERR_MASK))
+        break; // Not done yet, or failed: errors are left to checkRecv()
+
+      total += status_reg & STATUS_TRANSF;
+      i++;
+
+      // One-shot chains lie in consecutive slots
+      if(chan->seen_desc == chan->tail_desc)
+        chan->seen_done = 1;
+      else
+        chan->seen_desc += DESC_SIZE;
+    }
+    traceEnd(ctx, t0, TRACE_STATUS, 0, i);
+    done = chan->seen_done;
+  }
+  else{
+    PRINT("Error: No S2MM transfer in flight\n");
+    return -1;
+  }
+
+  chan->seen_bytes = total;
+
+  if(sync && chan->seen_bytes > chan->synced_bytes){
+    if(syncRecv(ctx, chan->seen_bytes - chan->synced_bytes) < 0)
+      return -1;
+    chan->synced_bytes = chan->seen_bytes;
+  }
+
+  *bytes = chan->seen_bytes;
+  return done;
+}
+
+/* Same as checkRecv(), calling a function each time at least step more bytes of the buffer become final so that its consumer
+ * can start on the first part while the rest is received. Between descriptors it waits following the wait policy of the
+ * channel; an error stops the reports and is left to checkRecv() to recover. Bytes are only synced before a report and
+ * every sync covers the whole user mapping, so step bounds the syncs to about size/step + 1, the last one by checkRecv()
+ * Arguments: ctx - DMA context
+ * 	      step - least advance reported, 0 to report every descriptor
+ * 	      cb - function called with the bytes final so far, lastly with the whole transfer
+ * 	      arg - user argument of cb
+ * Returns: 0 on success, -1 otherwise
+ */
+int checkRecvProgress(dma_ctx *ctx, unsigned int step, dma_progress cb, void *arg)
+{
+  dma_chan *chan = &ctx->recv;
+  unsigned int bytes, last = 0;
+  int done;
+
+  while(1){
+    done = recvProgress(ctx, &bytes, 0);
+    if(done < 0){
+      PRINT("Error: DMA transfer failed\n");
+      return -1;
+    }
+    if(done)
+      break;
+
+    if(bytes > last && bytes - last >= step){
+      if(syncRecv(ctx, bytes - chan->synced_bytes) < 0)
+        return -1;
+      chan->synced_bytes = bytes;
+      cb(bytes, arg);
+      last = bytes;
+    }
+
+    if(chan->chunked){
+      // As in drainChunked(), a chunked send feeding this receive must be kept going
+      if(ctx->snd.chunked){
+        if(pumpChunked(ctx, 1) < 0)
+          return -1;
+        if(chan->wait.mode != DMA_WAIT_SPIN)
+          usleep(chan->wait.sleep_us);
+      }
+      else if(chan->ring_count > 0)
+        waitDesc(ctx, chan, slotAddr(chan, chan->ring_tail));
+    }
+    else{
+      // An error stops the descriptor walk: checkRecv() recovers the channel or fails
+      if((CHAN_REG(ctx->bar,chan,MM2S_DMASR) & (DMASR_ERR_IRQ | DMASR_ERR_MASK)) || peerError(ctx, chan))
+        break;
+      waitDesc(ctx, chan, chan->seen_desc);
+    }
+  }
+
+  if(checkRecv(ctx) < 0)
+    return -1;
+
+  if(chan->xfer_bytes > last)
+    cb(chan->xfer_bytes, arg);
+
   return 0;
 }
 
 /* Frees the user memory mapping to bus device space previously done for MM2S transfer
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * Returns: 0 on sucess, -1 otherwise
  */
-int freeSend(pd_device_t *pdev)
+int freeSend(dma_ctx *ctx)
 {
-   if(pd_unmapUserMemory( &um_snd ) < 0){
-      PRINT("Error: Could not unmap user memory\n");
-      return -1;
-   }  
-   
-   return 0;
+   return releaseChan(ctx, &ctx->snd);
 }
 
 /* Frees the user memory mapping to bus device space previously done for S2MM transfer
- * Arguments: pdev - pcie device handler
+ * Arguments: ctx - DMA context
  * Returns: 0 on sucess, -1 otherwise
  */
-int freeRecv(pd_device_t *pdev)
+int freeRecv(dma_ctx *ctx)
 {
-   if(pd_unmapUserMemory( &um_recv ) < 0){
-      PRINT("Error: Could not unmap user memory\n");
-      return -1;
-   }  
-   
-   return 0;
+   return releaseChan(ctx, &ctx->recv);
 }
 
-/* Stops the framework by unmpaping the pcie BAR
- * Arguments: pdev - pcie device handler obtained from a successful call to open()
+/* Compiles a pattern into a program for the buffer the channel is set up on (setupSendReg(), setupRecvReg(), setupSendKbuf(),
+ * ...): the descriptor image is laid out from the first slot of the channel as setupSGDesc_pattern() would write it, and the
+ * stream destination of a send is the one given at setup. The pattern is consumed even if it cannot be compiled. The program
+ * refers to the buffer by its device addresses, so it stays valid while the buffer stays registered or allocated; buffers
+ * mapped by setupSend()/setupRecv() are released after the transfer and cannot be compiled
+ * Arguments: ctx - DMA context
+ * 	      istx - MM2S (1) or S2MM (0) channel
+ * 	      umem_pat - descriptors resulting from patternization, at most RING_SLOTS
+ * 	      prog - will hold the program; left with no descriptors on error
  * Returns: 0 on sucess, -1 otherwise
  */
-int stopDMA(pd_device_t *pdev)
-{ 
-  if(pd_unmapBAR(pdev,0,bar)<0){
-     PRINT("Error: Could not unmpap BAR0\n");
-     return -1;
-   }
- 
-  return 0;
+int progCompile(dma_ctx *ctx, int istx, pd_umem_pattern *umem_pat, dma_prog *prog)
+{
+  dma_chan *chan = istx ? &ctx->snd : &ctx->recv;
+  sgentry_pattern *cur_desc;
+  unsigned int cur;
+  int i, ret = 0, sof = 1, eof;
+
+  if(chan->mapped){
+     PRINT("Error: Only registered, kernel or DDR buffers outlive a transfer and can be compiled\n");
+     ret = -1;
+  }
+
+  if(umem_pat->nents <= 0 || umem_pat->nents > RING_SLOTS){
+     PRINT("Error: Program of %d descriptors does not fit the %d slots of the channel\n", umem_pat->nents, RING_SLOTS);
+     ret = -1;
+  }
+
+  memset(prog, 0, sizeof(dma_prog));
+  prog->istx = istx;
+  prog->reg = chan->reg;
+  prog->kbuf = chan->kbuf;
+  prog->axi2pcie = regRead(ctx, AXIBAR2PCIEBAR0);
+
+  // Descriptors are laid out as setupSGDesc_pattern() does, from the first slot of the channel
+  for(i = 0; (cur_desc = sglist_pop(umem_pat->sg)) != NULL; i++){
+    if(ret == 0){
+      cur = slotAddr(chan, i);
+      eof = (i == umem_pat->nents - 1) || destBreak(cur_desc, umem_pat->sg->next);
+      fillDesc((unsigned int*)prog->image[i], (i == umem_pat->nents - 1) ? cur : cur + DESC_SIZE, sof, eof, *cur_desc, istx,
+               ctx->dest_tx);
+      sof = eof;
+      prog->bytes += cur_desc->hsize*cur_desc->vsize;
+    }
+    free(cur_desc);
+  }
+  // A failed program is left empty, progLoad() refuses it
+  prog->nents = (ret == 0) ? i : 0;
+
+  free(umem_pat->sg);
+  free(umem_pat);
+
+  return ret;
 }
 
+/* Loads a program on its channel in place of a setup and pattern call: the descriptor image is copied to the BRAM half of
+ * the channel in one burst through the shadow and the channel is pointed at it. startSend()/startRecv() and
+ * checkSend()/checkRecv() follow as usual
+ * Arguments: ctx - DMA context
+ * 	      prog - program compiled by progCompile(); programs with no descriptors (a failed compile) or more than RING_SLOTS
+ * 		     are refused
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int progLoad(dma_ctx *ctx, dma_prog *prog)
+{
+  dma_chan *chan = prog->istx ? &ctx->snd : &ctx->recv;
+  unsigned int slot = (chan->desc_base - BRAM_BASE)/DESC_SIZE;
+  unsigned long long t0;
 
+  if(prog->nents == 0 || prog->nents > RING_SLOTS){
+     PRINT("Error: Program of %d descriptors was not compiled or does not fit the %d slots of the channel\n", prog->nents, RING_SLOTS);
+     return -1;
+  }
 
+  if(chan->ring_running){
+     PRINT("Error: %s channel is in streaming mode\n", prog->istx ? "MM2S" : "S2MM");
+     return -1;
+  }
 
+  if(prog->reg != NULL && !prog->reg->in_use){
+     PRINT("Error: Buffer of the program is no longer registered\n");
+     return -1;
+  }
 
+  // The buffer of the program replaces the one the channel was set up on
+  releaseChan(ctx, chan);
+  chan->reg = prog->reg;
+  chan->kbuf = prog->kbuf;
+  chan->chunked = 0;
 
+  if(setAXI2PCIEbar(ctx, prog->axi2pcie) < 0){
+     PRINT("Error: Could not configure address translation on the PCIe core\n");
+     return -1;
+  }
 
+  // The buffer may have been written by the CPU since the last replay
+  if(prog->istx && prog->reg != NULL){
+    t0 = traceStart(ctx);
+    if(ctx->ops->sync_umem(ctx->dev, &prog->reg->um, PD_DIR_TODEVICE) < 0){
+        PRINT("Error: Could not sync user memory\n");
+        return -1;
+    }
+    traceEnd(ctx, t0, TRACE_SYNC, 1, prog->reg->size);
+  }
+
+  // The image goes through the shadow so that both stay consistent, and reaches the BRAM in one burst
+  memcpy(ctx->shadow[slot], prog->image, prog->nents*sizeof(prog->image[0]));
+  ctx->dirty |= ((1ULL << prog->nents) - 1) << slot;
+  flushDesc(ctx);
+
+  chan->tail_desc = slotAddr(chan, prog->nents - 1);
 
+  return prog->istx ? setupDMAsend(ctx, chan->desc_base) : setupDMArecv(ctx, chan->desc_base);
+}
+
+/* Stops the framework by unmpaping the pcie BAR
+ * Arguments: ctx - DMA context previously initialized by initDMA()
+ * Returns: 0 on sucess, -1 otherwise
+ */
+int stopDMA(dma_ctx *ctx)
+{ 
+  int i;
+
+  stopStream(ctx, 1);
+  stopStream(ctx, 0);
+
+  releaseChan(ctx, &ctx->snd);
+  releaseChan(ctx, &ctx->recv);
+
+  for(i = 0; i < DMA_MAX_REG; i++)
+    if(ctx->reg[i].in_use)
+      unregisterBuffer(ctx, &ctx->reg[i]);
+
+  if(ctx->ops->unmap_bar(ctx->dev, ctx->bar)<0){
+     PRINT("Error: Could not unmpap BAR0\n");
+     return -1;
+   }
+  ctx->bar = NULL;
+ 
+  return 0;
+}
@@ -1,4 +1,10 @@
 #include "pciedma.h"
+#include "data_patterns.h"
+#include "dmapipe.h"
+#include "dmabuf.h"
+#include "dmasim.h"
+#include "dmatrace.h"
+#include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -13,18 +19,35 @@ int main(int argc, char **argv)
   int i;
   int size;
   pd_device_t dev;
+  dma_sim sim;
+  int use_sim, use_trace;
+  dma_trace *trace = NULL;
+  dma_ctx ctx;
+  dma_reg *regs, *regr;
+  dma_buf bufs, bufr;
+  dma_prog progs, progr;
   void *memr, *mems;
   float throughput;
   struct timeval tv1,tv2;
   int mintime, curtime;
+  int errors;
 
  printf("====================================\n");
  printf("=       DMA Throughput Test        =\n");
  printf("====================================\n\n");
 
  
- if(argc != 2){
-    printf("Usage: %s [buffer size]\n",argv[0]);
+ use_sim = use_trace = 0;
+ for(i = 2; i < argc; i++){
+   if(strcmp(argv[i], "sim") == 0)
+     use_sim = 1;
+   else if(strcmp(argv[i], "trace") == 0)
+     use_trace = 1;
+   else
+     break;
+ }
+ if(argc < 2 || i < argc){
+    printf("Usage: %s [buffer size] [sim] [trace]\n",argv[0]);
     return -1;
  }
  
@@ -40,35 +63,42 @@ int main(int argc, char **argv)
  
  printf("Buffer size: %d\n\n",size);
  
- if(pd_open(0,&dev) != 0){
+ // The simulated device measures the host side alone
+ if(use_sim){
+   if(simOpen(&sim, NULL) != 0){
+     printf("Failed to start the simulated device\n");
+     return -1;
+   }
+   printf("Simulated device started\n");
+ }
+ else if(pd_open(0,&dev) != 0){
     printf("Failed to open file \n");
     return -1;
   }
-
+ else
   printf("Device file opened successfuly\n");
 
-  // Allocate send and receive buffers
-  
-  posix_memalign( (void**)&memr, 16, size);
-  posix_memalign( (void**)&mems, 16, size);
-  
-  //for(i=0;i<size/4;i++)
-  //  ((unsigned int*)mems)[i] = i;
-    
-  //for(i=0;i<size/4;i++)
-  //  ((unsigned int*)memr)[i] = 9;
+  // Send and receive buffers are allocated after initDMA(), on hugepages when available
 
  //--------------------------
 
   
  
- if(initDMA(&dev) < 0)
+ if((use_sim ? initDMAbackend(&ctx, &sim_ops, &sim) : initDMA(&ctx, &dev)) < 0)
    printf("Init DMA failed\n");
+
+ // Time every phase of the transfers below
+ if(use_trace){
+   trace = (dma_trace*)calloc(1, sizeof(dma_trace));
+   if(trace == NULL)
+     printf("Trace allocation failed\n");
+   setTrace(&ctx, trace);
+ }
  
  /*
  gettimeofday(&tv1,NULL);  
  
- if(setupSend(&dev, (void*)mems, size) < 0)
+ if(setupSend(&ctx, (void*)mems, size) < 0)
    printf("Setup Send failed\n");
  
  gettimeofday(&tv2,NULL);  
@@ -80,7 +110,7 @@ int main(int argc, char **argv)
  gettimeofday(&tv1,NULL);  
 
  
- if(setupRecv(&dev, memr, size) < 0)
+ if(setupRecv(&ctx, memr, size) < 0)
    printf("Setup Recv failed\n");
 
  gettimeofday(&tv2,NULL);  
@@ -92,10 +122,10 @@ int main(int argc, char **argv)
  
  gettimeofday(&tv1,NULL);  
  
- if(startSend(&dev, 0) < 0)
+ if(startSend(&ctx, 0) < 0)
    printf("DMA Send failed\n");
 
- if(checkSend() < 0)
+ if(checkSend(&ctx) < 0)
    printf("Check DMA send failed\n");
 
   gettimeofday(&tv2,NULL);  
@@ -110,7 +140,7 @@ int main(int argc, char **argv)
  if(startRecv() < 0)
    printf("DMA Recv failed\n");
 
- if(checkRecv() < 0)
+ if(checkRecv(&ctx) < 0)
    printf("Check DMA recv failed\n");
 
   gettimeofday(&tv2,NULL);  
@@ -124,15 +154,33 @@ int main(int argc, char **argv)
  
    //--------------------------
 
+ // Allocate and map both buffers once; every run only writes the descriptors
+ if(dmabufAlloc(&ctx, size, DMABUF_ANY, &bufs) < 0 || dmabufAlloc(&ctx, size, DMABUF_ANY, &bufr) < 0){
+   printf("DMA buffer allocation failed\n");
+   stopDMA(&ctx);
+   return -1;
+ }
+ mems = bufs.vaddr; regs = bufs.reg;
+ memr = bufr.vaddr; regr = bufr.reg;
+
+ // Counting pattern out, a value it never holds in, so the first run can be checked
+ for(i=0;i<size/4;i++)
+   ((unsigned int*)mems)[i] = i;
+
+ for(i=0;i<size/4;i++)
+   ((unsigned int*)memr)[i] = 0xffffffff;
+
+ printf("Send buffer: %d physical segments, receive buffer: %d physical segments\n", bufs.nsegs, bufr.nsegs);
+
  // Send and receive in simultaneous
  mintime = 9999;
 for(i=0;i<NRUNS;i++){
   gettimeofday(&tv1,NULL);  
 
- if(setupSend(&dev, (void*)mems, size,1) < 0)
+ if(setupSendReg(&ctx, regs, 0, size,1) < 0 || applySG_send(&ctx) < 0)
    printf("Setup Send failed\n");
  
- if(setupRecv(&dev, (void*)memr, size) < 0)
+ if(setupRecvReg(&ctx, regr, 0, size) < 0 || applySG_recv(&ctx) < 0)
    printf("Setup Recv failed\n");
 
   gettimeofday(&tv2,NULL);  
@@ -143,17 +191,17 @@ for(i=0;i<NRUNS;i++){
 
   gettimeofday(&tv1,NULL);  
   
-    if(startRecv(&dev, 0) < 0)
+    if(startRecv(&ctx, 0) < 0)
    printf("DMA Recv failed\n");
  
-   if(startSend(&dev, 0) < 0)
+   if(startSend(&ctx, 0) < 0)
    printf("DMA Send failed\n");
    
 
-     if(checkRecv() < 0)
+     if(checkRecv(&ctx) < 0)
    printf("Check DMA recv failed\n");
  
-   if(checkSend() < 0)
+   if(checkSend(&ctx) < 0)
    printf("Check DMA send failed\n");
   
 
@@ -166,20 +214,84 @@ for(i=0;i<NRUNS;i++){
    printf("Throughput: %f MB/s\n",(float)2*size/((float)(curtime)));
 
   
- freeSend(&dev);
+ freeSend(&ctx);
 
- freeRecv(&dev);
+ freeRecv(&ctx);
  
  if(curtime < mintime)
    mintime = curtime;
 }
 
- stopDMA(&dev);
- 
- //for(i=0;i<size/4;i++)
- // printf("%d ",((unsigned int*)memr)[i]);
- 
- free(memr); free(mems);
+ errors = 0;
+ for(i=0;i<size/4;i++)
+   if(((unsigned int*)memr)[i] != (unsigned int)i)
+     errors++;
+ printf("Data check: %d of %d words differ\n", errors, size/4);
+
+ // Same transfer compiled once, every run only replays the descriptors
+ // Buffers whose chain does not fit the slots of a channel cannot be compiled: the replay is skipped
+ if(setupSendReg(&ctx, regs, 0, size,1) < 0 || compileSG(&ctx, 1, &progs) < 0 ||
+    setupRecvReg(&ctx, regr, 0, size) < 0 || compileSG(&ctx, 0, &progr) < 0){
+   printf("Compile failed, skipping replay\n");
+   freeSend(&ctx);
+   freeRecv(&ctx);
+ }
+ else{
+ gettimeofday(&tv1,NULL);
+
+for(i=0;i<NRUNS;i++){
+   if(progLoad(&ctx, &progr) < 0 || startRecv(&ctx, 0) < 0)
+   printf("DMA Recv failed\n");
+
+   if(progLoad(&ctx, &progs) < 0 || startSend(&ctx, 0) < 0)
+   printf("DMA Send failed\n");
+
+   if(checkRecv(&ctx) < 0 || checkSend(&ctx) < 0)
+   printf("Check DMA replay failed\n");
+}
+
+ gettimeofday(&tv2,NULL);
+
+ curtime = (tv2.tv_sec - tv1.tv_sec)*1000000 + tv2.tv_usec - tv1.tv_usec;
+ printf("Time taken to replay %d send AND receive transfers:%d\n", NRUNS, curtime);
+ printf("Replay throughput: %f MB/s\n",(float)2*size*NRUNS/((float)(curtime)));
+ }
+
+ // Same buffers through the pipeline, both channels kept running
+ for(i=0;i<size/4;i++)
+   ((unsigned int*)memr)[i] = 0xffffffff;
+
+ gettimeofday(&tv1,NULL);
+
+ if(pipeStreamReg(&ctx, regs, size, regr, size, 0, 1) < 0)
+   printf("Pipelined transfer failed\n");
+ else{
+ gettimeofday(&tv2,NULL);
+
+ curtime = (tv2.tv_sec - tv1.tv_sec)*1000000 + tv2.tv_usec - tv1.tv_usec;
+ printf("Time taken to complete pipelined send AND receive transfer:%d\n", curtime);
+ printf("Pipelined throughput: %f MB/s\n",(float)2*size/((float)(curtime)));
+ }
+
+ errors = 0;
+ for(i=0;i<size/4;i++)
+   if(((unsigned int*)memr)[i] != (unsigned int)i)
+     errors++;
+ printf("Pipelined data check: %d of %d words differ\n", errors, size/4);
+
+ dmabufFree(&ctx, &bufs);
+ dmabufFree(&ctx, &bufr);
+
+ if(trace != NULL){
+   printf("\nPer-phase latency:\n");
+   traceReport(trace, stdout);
+   setTrace(&ctx, NULL);
+   free(trace);
+ }
+
+ stopDMA(&ctx);
+ if(use_sim)
+   simClose(&sim);
 
 printf("Maximum throughput for %d points: %f MB/s\n",size,(float)2*size/((float)(mintime)));
 
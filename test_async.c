@@ -0,0 +1,715 @@
+#include "pciedma.h"
+#include "dmasim.h"
+#include "dmaasync.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define XFER_SIZE	4096		// Bytes per transfer, one frame each
+#define NXFERS		256		// Transfers per channel in a batch, most of them waiting in the submission queue
+#define NPRODUCERS	4		// Submitting threads per channel
+#define NPRODXFERS	128		// Transfers per submitting thread, enough to fill the submission queue
+#define BULK_SIZE	0x100000	// Bulk transfer an urgent one has to overtake, more than the stream and the window hold
+#define NSHARED		128		// Transfers per class competing for the link
+#define LARGE_SIZE	0x10000		// Transfer over HSIZE_MAX, one default chunk
+#define NLARGE		8
+#define LARGE_SEG	0x200000	// Simulated segment size, as with buffers on 2 MB hugepages
+
+int use_sim, use_irq;
+pd_device_t dev;
+dma_sim sim;
+volatile int ncallbacks, nfailed;
+
+void countDone(long token, int status, unsigned int bytes, void *arg)
+{
+  (void)token; (void)arg;
+
+  __sync_fetch_and_add(&ncallbacks, 1);
+  if(status != 0 || bytes != XFER_SIZE)
+    __sync_fetch_and_add(&nfailed, 1);
+}
+
+/* Counts the completions of a transfer whose counter is the callback argument */
+void countOnce(long token, int status, unsigned int bytes, void *arg)
+{
+  (void)token;
+
+  __sync_fetch_and_add((int*)arg, 1);
+  if(status != 0 || bytes != XFER_SIZE)
+    __sync_fetch_and_add(&nfailed, 1);
+}
+
+/* Slice of the transfers of a channel submitted by one thread */
+typedef struct {
+  dma_async *as;
+  int istx;
+  dma_reg *reg;
+  int first;			// First transfer of the thread, every NPRODUCERS-th after it being its own too
+  long *tokens;			// Tokens of all the transfers of the channel
+  int *done;			// Completion counters of all the transfers of the channel
+  volatile int *nsubmitted;	// Transfers of the channel submitted so far
+} producer;
+
+void *produce(void *arg)
+{
+  producer *p = (producer*)arg;
+  int k;
+
+  for(k = p->first; k < NPRODUCERS*NPRODXFERS; k += NPRODUCERS){
+    p->tokens[k] = asyncSubmit(p->as, p->istx, p->reg, k*XFER_SIZE, XFER_SIZE, countOnce, &p->done[k]);
+    __sync_fetch_and_add(p->nsubmitted, 1);
+  }
+
+  return NULL;
+}
+
+/* Receive buffers posted from a thread of their own, since they outnumber the submission queue */
+typedef struct {
+  dma_async *as;
+  dma_reg *reg;
+  int n;			// Receive buffers of XFER_SIZE bytes
+  long *tokens;
+} receiver;
+
+void *receive(void *arg)
+{
+  receiver *r = (receiver*)arg;
+  int k;
+
+  for(k = 0; k < r->n; k++)
+    r->tokens[k] = asyncSubmit(r->as, 0, r->reg, k*XFER_SIZE, XFER_SIZE, NULL, NULL);
+
+  return NULL;
+}
+
+/* Completion order of the sends, the callback argument being the class of the transfer */
+volatile int norder;
+int order[2*NSHARED];
+
+void recordClass(long token, int status, unsigned int bytes, void *arg)
+{
+  int n;
+
+  (void)token; (void)bytes;
+
+  n = __sync_fetch_and_add(&norder, 1);
+  if(n < 2*NSHARED)
+    order[n] = (int)(long)arg;
+  if(status != 0)
+    __sync_fetch_and_add(&nfailed, 1);
+}
+
+/* Opens the board, or starts a simulated device, and a context on it
+ * cfg - configuration of the simulated device, NULL for the defaults
+ */
+int openDev(dma_ctx *ctx, const dma_sim_cfg *cfg)
+{
+  if(use_sim ? simOpen(&sim, cfg) != 0 : pd_open(0, &dev) != 0){
+    printf("Failed to open the device\n");
+    return -1;
+  }
+
+  if((use_sim ? initDMAbackend(ctx, &sim_ops, &sim) : initDMA(ctx, &dev)) < 0){
+    printf("Init DMA failed\n");
+    if(use_sim)
+      simClose(&sim);
+    else
+      pd_close(&dev);
+    return -1;
+  }
+
+  if(use_irq){
+    setWaitPolicy(ctx, 0, DMA_WAIT_IRQ, 0, 1);
+    setWaitPolicy(ctx, 1, DMA_WAIT_IRQ, 0, 1);
+  }
+
+  return 0;
+}
+
+void closeDev(dma_ctx *ctx)
+{
+  stopDMA(ctx);
+  if(use_sim)
+    simClose(&sim);
+  else
+    pd_close(&dev);
+}
+
+/* A batch of transfers on both channels: receives are queued first, then the sends that fill them, every token is waited
+ * for and the data looped back must match what was sent
+ * Returns: number of errors
+ */
+int testBatch(void)
+{
+  dma_ctx ctx;
+  dma_async as;
+  dma_reg *regs, *regr;
+  unsigned int *mems, *memr;
+  long tokr[NXFERS], toks[NXFERS];
+  int i, errors = 0;
+  int size = NXFERS*XFER_SIZE;
+
+  if(openDev(&ctx, NULL) < 0)
+    return 1;
+
+  if(posix_memalign((void**)&mems, 4096, size) != 0 || posix_memalign((void**)&memr, 4096, size) != 0){
+    printf("Buffer allocation failed\n");
+    return 1;
+  }
+  for(i = 0; i < size/4; i++){
+    mems[i] = i;
+    memr[i] = 0xffffffff;
+  }
+
+  if(registerBuffer(&ctx, mems, size, &regs) < 0 || registerBuffer(&ctx, memr, size, &regr) < 0){
+    printf("Buffer registration failed\n");
+    return 1;
+  }
+
+  if(asyncInit(&as, &ctx, 0) < 0){
+    printf("Async init failed\n");
+    return 1;
+  }
+
+  ncallbacks = nfailed = 0;
+  for(i = 0; i < NXFERS; i++)
+    if((tokr[i] = asyncSubmit(&as, 0, regr, i*XFER_SIZE, XFER_SIZE, countDone, NULL)) < 0)
+      errors++;
+  for(i = 0; i < NXFERS; i++)
+    if((toks[i] = asyncSubmit(&as, 1, regs, i*XFER_SIZE, XFER_SIZE, countDone, NULL)) < 0)
+      errors++;
+  if(errors > 0)
+    printf("%d submissions failed\n", errors);
+
+  for(i = 0; i < NXFERS; i++){
+    if(tokr[i] >= 0 && asyncWait(&as, tokr[i]) < 0)
+      errors++;
+    if(toks[i] >= 0 && asyncWait(&as, toks[i]) < 0)
+      errors++;
+  }
+
+  asyncStop(&as);
+
+  if(ncallbacks != 2*NXFERS || nfailed > 0){
+    printf("%d callbacks of %d, %d failed\n", ncallbacks, 2*NXFERS, nfailed);
+    errors++;
+  }
+
+  if(memcmp(mems, memr, size) != 0){
+    printf("Received data differs from the data sent\n");
+    errors++;
+  }
+
+  printf("Batch of %d transfers per channel: %s\n", NXFERS, errors ? "FAILED" : "ok");
+
+  unregisterBuffer(&ctx, regs);
+  unregisterBuffer(&ctx, regr);
+  closeDev(&ctx);
+  free(mems);
+  free(memr);
+
+  return errors;
+}
+
+/* Several threads submit on each channel at once. The receives go first and, with no frame to fill them, fill their submission
+ * queue so that the submitters block until the sends start; every token must then complete exactly once and every frame sent
+ * must land in exactly one receive buffer
+ * Returns: number of errors
+ */
+int testProducers(void)
+{
+  dma_ctx ctx;
+  dma_async as;
+  dma_reg *regs, *regr;
+  unsigned int *mems, *memr;
+  pthread_t thr[2][NPRODUCERS];
+  producer prod[2][NPRODUCERS];
+  long tokens[2][NPRODUCERS*NPRODXFERS];
+  int done[2][NPRODUCERS*NPRODXFERS];
+  volatile int nsubmitted[2];
+  char *seen;
+  int i, k, n, errors = 0;
+  int nxfers = NPRODUCERS*NPRODXFERS;
+  int size = nxfers*XFER_SIZE;
+  unsigned int idx;
+
+  if(openDev(&ctx, NULL) < 0)
+    return 1;
+
+  seen = (char*)calloc(nxfers, 1);
+  if(seen == NULL || posix_memalign((void**)&mems, 4096, size) != 0 || posix_memalign((void**)&memr, 4096, size) != 0){
+    printf("Buffer allocation failed\n");
+    return 1;
+  }
+  // The first word of a transfer tells which one it is
+  for(k = 0; k < nxfers; k++)
+    for(i = 0; i < XFER_SIZE/4; i++)
+      mems[k*XFER_SIZE/4 + i] = k*1000003u + i;
+  memset(memr, 0xff, size);
+
+  if(registerBuffer(&ctx, mems, size, &regs) < 0 || registerBuffer(&ctx, memr, size, &regr) < 0){
+    printf("Buffer registration failed\n");
+    return 1;
+  }
+
+  if(asyncInit(&as, &ctx, 0) < 0){
+    printf("Async init failed\n");
+    return 1;
+  }
+
+  nfailed = 0;
+  memset(done, 0, sizeof(done));
+  for(n = 0; n < 2; n++){
+    nsubmitted[n] = 0;
+    for(i = 0; i < NPRODUCERS; i++){
+      prod[n][i].as = &as;
+      prod[n][i].istx = n;
+      prod[n][i].reg = n ? regs : regr;
+      prod[n][i].first = i;
+      prod[n][i].tokens = tokens[n];
+      prod[n][i].done = done[n];
+      prod[n][i].nsubmitted = &nsubmitted[n];
+    }
+  }
+
+  for(i = 0; i < NPRODUCERS; i++)
+    pthread_create(&thr[0][i], NULL, produce, &prod[0][i]);
+
+  // Without sends, no more receives than the queue and the ring hold can be accepted
+  while(nsubmitted[0] < ASYNC_QUEUE)
+    usleep(1000);
+  usleep(20000);
+  if(nsubmitted[0] >= nxfers){
+    printf("Receive submissions did not wait for a full queue\n");
+    errors++;
+  }
+
+  for(i = 0; i < NPRODUCERS; i++)
+    pthread_create(&thr[1][i], NULL, produce, &prod[1][i]);
+
+  for(n = 0; n < 2; n++)
+    for(i = 0; i < NPRODUCERS; i++)
+      pthread_join(thr[n][i], NULL);
+
+  for(n = 0; n < 2; n++){
+    for(k = 0; k < nxfers; k++){
+      if(tokens[n][k] < 0 || asyncWait(&as, tokens[n][k]) < 0){
+        printf("%s transfer %d failed\n", n ? "Send" : "Receive", k);
+        errors++;
+      }
+    }
+  }
+
+  asyncStop(&as);
+
+  for(n = 0; n < 2; n++){
+    for(k = 0; k < nxfers; k++){
+      if(done[n][k] != 1){
+        printf("%s transfer %d completed %d times\n", n ? "Send" : "Receive", k, done[n][k]);
+        errors++;
+      }
+    }
+  }
+  if(nfailed > 0){
+    printf("%d callbacks reported a failure\n", nfailed);
+    errors++;
+  }
+
+  // Sends of different threads interleave: each receive buffer holds some transfer sent, each transfer is received once
+  for(k = 0; k < nxfers; k++){
+    idx = memr[k*XFER_SIZE/4]/1000003u;
+    if(idx >= (unsigned int)nxfers || seen[idx] ||
+       memcmp(memr + k*XFER_SIZE/4, mems + idx*XFER_SIZE/4, XFER_SIZE) != 0){
+      errors++;
+      continue;
+    }
+    seen[idx] = 1;
+  }
+
+  printf("%d producers of %d transfers per channel: %s\n", NPRODUCERS, NPRODXFERS, errors ? "FAILED" : "ok");
+
+  unregisterBuffer(&ctx, regs);
+  unregisterBuffer(&ctx, regr);
+  closeDev(&ctx);
+  free(seen);
+  free(mems);
+  free(memr);
+
+  return errors;
+}
+
+/* Waits for the receives posted by a receiver thread
+ * Returns: number of errors
+ */
+int joinReceiver(pthread_t thr, receiver *r)
+{
+  int k, errors = 0;
+
+  pthread_join(thr, NULL);
+  for(k = 0; k < r->n; k++)
+    if(r->tokens[k] < 0 || asyncWait(r->as, r->tokens[k]) < 0)
+      errors++;
+  if(errors > 0)
+    printf("%d receives failed\n", errors);
+
+  return errors;
+}
+
+/* An urgent transfer submitted once a bulk transfer has filled the loopback stream and the window must go out, and complete,
+ * before the rest of the bulk transfer; the data of both must arrive intact
+ * Returns: number of errors
+ */
+int testUrgent(void)
+{
+  dma_ctx ctx;
+  dma_async as;
+  dma_reg *regs, *regr;
+  unsigned int *mems, *memr;
+  pthread_t thr;
+  receiver rx;
+  long tokb, toku;
+  int k, slot, b, errors = 0;
+  int nrecv = BULK_SIZE/XFER_SIZE + 1;
+
+  if(openDev(&ctx, NULL) < 0)
+    return 1;
+
+  rx.tokens = (long*)malloc(nrecv*sizeof(long));
+  if(rx.tokens == NULL || posix_memalign((void**)&mems, 4096, BULK_SIZE + XFER_SIZE) != 0 ||
+     posix_memalign((void**)&memr, 4096, nrecv*XFER_SIZE) != 0){
+    printf("Buffer allocation failed\n");
+    return 1;
+  }
+  for(k = 0; k < (BULK_SIZE + XFER_SIZE)/4; k++)
+    mems[k] = k + 1;
+  memset(memr, 0, nrecv*XFER_SIZE);
+
+  if(registerBuffer(&ctx, mems, BULK_SIZE + XFER_SIZE, &regs) < 0 || registerBuffer(&ctx, memr, nrecv*XFER_SIZE, &regr) < 0){
+    printf("Buffer registration failed\n");
+    return 1;
+  }
+
+  if(asyncInit(&as, &ctx, 0) < 0){
+    printf("Async init failed\n");
+    return 1;
+  }
+
+  // With nothing received, the bulk transfer stalls once the stream and the window are full
+  norder = nfailed = 0;
+  tokb = asyncSubmit(&as, 1, regs, 0, BULK_SIZE, recordClass, (void*)ASYNC_CLASS_BULK);
+  usleep(20000);
+  toku = asyncSubmitClass(&as, 1, ASYNC_CLASS_CTRL, regs, BULK_SIZE, XFER_SIZE, recordClass, (void*)ASYNC_CLASS_CTRL);
+
+  rx.as = &as;
+  rx.reg = regr;
+  rx.n = nrecv;
+  pthread_create(&thr, NULL, receive, &rx);
+
+  errors += joinReceiver(thr, &rx);
+  if(tokb < 0 || toku < 0 || asyncWait(&as, tokb) < 0 || asyncWait(&as, toku) < 0){
+    printf("Send failed\n");
+    errors++;
+  }
+
+  asyncStop(&as);
+
+  if(norder != 2 || order[0] != ASYNC_CLASS_CTRL || nfailed > 0){
+    printf("Urgent transfer did not complete first\n");
+    errors++;
+  }
+
+  // The urgent frame sits between two bulk chunks, the bulk data around it in order
+  slot = -1;
+  b = 0;
+  for(k = 0; k < nrecv; k++){
+    if(memr[k*XFER_SIZE/4] == BULK_SIZE/4 + 1){
+      slot = k;
+      if(memcmp(memr + k*XFER_SIZE/4, mems + BULK_SIZE/4, XFER_SIZE) != 0)
+        errors++;
+      continue;
+    }
+    if(memcmp(memr + k*XFER_SIZE/4, mems + b*XFER_SIZE/4, XFER_SIZE) != 0)
+      errors++;
+    b++;
+  }
+  if(slot < 0 || slot == nrecv - 1){
+    printf("Urgent frame received in slot %d of %d\n", slot, nrecv);
+    errors++;
+  }
+
+  printf("Urgent transfer behind a bulk one: %s (received in slot %d of %d)\n", errors ? "FAILED" : "ok", slot, nrecv);
+
+  unregisterBuffer(&ctx, regs);
+  unregisterBuffer(&ctx, regr);
+  closeDev(&ctx);
+  free(rx.tokens);
+  free(mems);
+  free(memr);
+
+  return errors;
+}
+
+/* Two classes kept backlogged share the link in proportion to their shares: bulk transfers stall the stream, transfers of
+ * class 1 are queued behind them, and while both classes wait class 1 must get 4 chunks for every chunk of the bulk class
+ * Returns: number of errors
+ */
+int testShares(void)
+{
+  dma_ctx ctx;
+  dma_async as;
+  dma_reg *regs, *regr;
+  unsigned int *mems, *memr;
+  pthread_t thr;
+  receiver rx;
+  long tokens[2*NSHARED];
+  int k, first, last, n1, n3, errors = 0;
+  int size = 2*NSHARED*XFER_SIZE;
+
+  if(openDev(&ctx, NULL) < 0)
+    return 1;
+
+  rx.tokens = (long*)malloc(2*NSHARED*sizeof(long));
+  if(rx.tokens == NULL || posix_memalign((void**)&mems, 4096, size) != 0 || posix_memalign((void**)&memr, 4096, size) != 0){
+    printf("Buffer allocation failed\n");
+    return 1;
+  }
+  for(k = 0; k < size/4; k++)
+    mems[k] = k;
+
+  if(registerBuffer(&ctx, mems, size, &regs) < 0 || registerBuffer(&ctx, memr, size, &regr) < 0){
+    printf("Buffer registration failed\n");
+    return 1;
+  }
+
+  // Default shares, one frame per chunk and a window of a few chunks
+  if(asyncInit(&as, &ctx, 0) < 0 || asyncSetQos(&as, XFER_SIZE, 4*XFER_SIZE, NULL) < 0){
+    printf("Async init failed\n");
+    return 1;
+  }
+
+  norder = nfailed = 0;
+  for(k = 0; k < NSHARED; k++)
+    tokens[k] = asyncSubmit(&as, 1, regs, k*XFER_SIZE, XFER_SIZE, recordClass, (void*)ASYNC_CLASS_BULK);
+  usleep(20000);
+  for(k = NSHARED; k < 2*NSHARED; k++)
+    tokens[k] = asyncSubmitClass(&as, 1, 1, regs, k*XFER_SIZE, XFER_SIZE, recordClass, (void*)1);
+
+  rx.as = &as;
+  rx.reg = regr;
+  rx.n = 2*NSHARED;
+  pthread_create(&thr, NULL, receive, &rx);
+
+  errors += joinReceiver(thr, &rx);
+  for(k = 0; k < 2*NSHARED; k++){
+    if(tokens[k] < 0 || asyncWait(&as, tokens[k]) < 0){
+      printf("Send %d failed\n", k);
+      errors++;
+    }
+  }
+
+  asyncStop(&as);
+
+  if(norder != 2*NSHARED || nfailed > 0){
+    printf("%d sends completed of %d, %d failed\n", norder, 2*NSHARED, nfailed);
+    errors++;
+  }
+
+  // From the first to the last completion of class 1, both classes were waiting
+  for(first = 0; first < 2*NSHARED && order[first] != 1; first++);
+  for(last = 2*NSHARED - 1; last >= 0 && order[last] != 1; last--);
+  n1 = n3 = 0;
+  for(k = first; k <= last; k++){
+    if(order[k] == 1)
+      n1++;
+    else
+      n3++;
+  }
+  if(n1 != NSHARED || n3 == 0 || n1 < 3*n3 || n1 > 5*n3){
+    printf("Class 1 got %d chunks for %d of the bulk class, expected 4 to 1\n", n1, n3);
+    errors++;
+  }
+
+  printf("Shares under load: %s (%d to %d)\n", errors ? "FAILED" : "ok", n1, n3);
+
+  unregisterBuffer(&ctx, regs);
+  unregisterBuffer(&ctx, regr);
+  closeDev(&ctx);
+  free(rx.tokens);
+  free(mems);
+  free(memr);
+
+  return errors;
+}
+
+/* A chunk failing in the middle of a transfer fails the whole transfer, reported with its last chunk even though the chunks
+ * posted after the channel restarted succeed; the next transfer of the class is not affected. The simulator discards the
+ * frames sent and fails every third descriptor fetched, and a window of one chunk keeps a single chunk in flight
+ * Returns: number of errors
+ */
+int testChunkFailure(void)
+{
+  dma_sim_cfg cfg;
+  dma_ctx ctx;
+  dma_async as;
+  dma_reg *regs;
+  unsigned int *mems;
+  long tok1, tok2;
+  int errors = 0;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.discard_mask = 1;
+  cfg.fault_every = 3;
+  if(openDev(&ctx, &cfg) < 0)
+    return 1;
+
+  if(posix_memalign((void**)&mems, 4096, 5*XFER_SIZE) != 0){
+    printf("Buffer allocation failed\n");
+    return 1;
+  }
+  memset(mems, 0, 5*XFER_SIZE);
+
+  if(registerBuffer(&ctx, mems, 5*XFER_SIZE, &regs) < 0){
+    printf("Buffer registration failed\n");
+    return 1;
+  }
+
+  if(asyncInit(&as, &ctx, 0) < 0 || asyncSetQos(&as, XFER_SIZE, XFER_SIZE, NULL) < 0){
+    printf("Async init failed\n");
+    return 1;
+  }
+
+  // Chunks 1 and 2 go out, chunk 3 fails, chunk 4 goes out after the restart
+  norder = nfailed = 0;
+  tok1 = asyncSubmit(&as, 1, regs, 0, 4*XFER_SIZE, recordClass, (void*)ASYNC_CLASS_BULK);
+  if(tok1 < 0 || asyncWait(&as, tok1) != -1 || asyncPoll(&as, tok1) != -1){
+    printf("Transfer with a failed chunk did not report the failure\n");
+    errors++;
+  }
+
+  tok2 = asyncSubmit(&as, 1, regs, 4*XFER_SIZE, XFER_SIZE, recordClass, (void*)ASYNC_CLASS_BULK);
+  if(tok2 < 0 || asyncWait(&as, tok2) != 0){
+    printf("Transfer following the failed one failed too\n");
+    errors++;
+  }
+
+  asyncStop(&as);
+
+  if(norder != 2 || nfailed != 1){
+    printf("%d callbacks, %d failed, expected 2 and 1\n", norder, nfailed);
+    errors++;
+  }
+
+  printf("Chunk failure: %s\n", errors ? "FAILED" : "ok");
+
+  unregisterBuffer(&ctx, regs);
+  closeDev(&ctx);
+  free(mems);
+
+  return errors;
+}
+
+/* Transfers larger than HSIZE_MAX over buffers made of large physical segments, as hugepages give: every chunk has to be
+ * split into legal descriptors on its way to the ring, and the data looped back must match what was sent
+ * Returns: number of errors
+ */
+int testLargeSegments(void)
+{
+  dma_sim_cfg cfg;
+  dma_ctx ctx;
+  dma_async as;
+  dma_reg *regs, *regr;
+  unsigned int *mems, *memr;
+  long tokr[NLARGE], toks[NLARGE];
+  int i, errors = 0;
+  int size = NLARGE*LARGE_SIZE;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.seg_size = LARGE_SEG;
+  if(openDev(&ctx, &cfg) < 0)
+    return 1;
+
+  if(posix_memalign((void**)&mems, LARGE_SEG, size) != 0 || posix_memalign((void**)&memr, LARGE_SEG, size) != 0){
+    printf("Buffer allocation failed\n");
+    return 1;
+  }
+  for(i = 0; i < size/4; i++){
+    mems[i] = i*7 + 1;
+    memr[i] = 0xffffffff;
+  }
+
+  if(registerBuffer(&ctx, mems, size, &regs) < 0 || registerBuffer(&ctx, memr, size, &regr) < 0){
+    printf("Buffer registration failed\n");
+    return 1;
+  }
+
+  if(asyncInit(&as, &ctx, 0) < 0){
+    printf("Async init failed\n");
+    return 1;
+  }
+
+  for(i = 0; i < NLARGE; i++)
+    tokr[i] = asyncSubmit(&as, 0, regr, i*LARGE_SIZE, LARGE_SIZE, NULL, NULL);
+  for(i = 0; i < NLARGE; i++)
+    toks[i] = asyncSubmit(&as, 1, regs, i*LARGE_SIZE, LARGE_SIZE, NULL, NULL);
+
+  for(i = 0; i < NLARGE; i++){
+    if(tokr[i] < 0 || asyncWait(&as, tokr[i]) < 0)
+      errors++;
+    if(toks[i] < 0 || asyncWait(&as, toks[i]) < 0)
+      errors++;
+  }
+  if(errors > 0)
+    printf("%d transfers failed\n", errors);
+
+  asyncStop(&as);
+
+  if(memcmp(mems, memr, size) != 0){
+    printf("Received data differs from the data sent\n");
+    errors++;
+  }
+
+  printf("Transfers of %d bytes over %d KB segments: %s\n", LARGE_SIZE, LARGE_SEG/1024, errors ? "FAILED" : "ok");
+
+  unregisterBuffer(&ctx, regs);
+  unregisterBuffer(&ctx, regr);
+  closeDev(&ctx);
+  free(mems);
+  free(memr);
+
+  return errors;
+}
+
+int main(int argc, char **argv)
+{
+  int i, errors;
+
+ printf("====================================\n");
+ printf("=        Async Engine Tests        =\n");
+ printf("====================================\n\n");
+
+ use_sim = use_irq = 0;
+ for(i = 1; i < argc; i++){
+   if(strcmp(argv[i], "sim") == 0)
+     use_sim = 1;
+   else if(strcmp(argv[i], "irq") == 0)
+     use_irq = 1;
+   else{
+     printf("Usage: %s [sim] [irq]\n",argv[0]);
+     return -1;
+   }
+ }
+
+ errors = testBatch();
+ errors += testProducers();
+
+ // These depend on the size of the simulated loopback stream, or on its segment sizes and faults
+ if(use_sim){
+   errors += testUrgent();
+   errors += testShares();
+   errors += testChunkFailure();
+   errors += testLargeSegments();
+ }
+
+ return errors ? -1 : 0;
+}
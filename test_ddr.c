@@ -13,13 +13,13 @@ int main(int argc, char **argv)
   int i,val,j;
   int size, new_size;
   pd_device_t dev;
+  dma_ctx ctx;
   void *memr, *memA, *memB, *mems, *mem_new;
   float throughput;
   struct timeval tv1,tv2;
   int mintime, curtime, vsize;
   
   unsigned int mask, interrupt, base_addr;
-  int div_factor = 1;
   
  printf("====================================\n");
  printf("=       Pattern Tests	            =\n");
@@ -38,13 +38,13 @@ int main(int argc, char **argv)
   printf("Device file opened successfuly\n");
   
   
- if(initDMA(&dev) < 0)
+ if(initDMA(&ctx, &dev) < 0)
    printf("Init DMA failed\n");
  
 if(atoi(argv[1]) == 1)
 {
  mask = 32;	// reset 5
- genReset(mask);
+ genReset(&ctx, mask);
  return 0;
 }
  
@@ -53,14 +53,14 @@ if(atoi(argv[1]) == 1)
  printf("Activating reset\n");
  
 gettimeofday(&tv1,NULL);
-genReset(mask);
+genReset(&ctx, mask);
 
   
  
 // Read Interrupt
   while(1)
   {
-    interrupt = getInterrupt();
+    interrupt = getInterrupt(&ctx);
    // printf("Interrupts: %08x\n", interrupt);
     if(interrupt != 0)
       break;
@@ -99,39 +99,35 @@ genReset(mask);
  for(i=0; i< 8; i++)
  {
       // Setup copy from the host memory to the MM2S interface
-	if(setupSend(&dev, (void*)memA,size,0)<0){
+	if(setupSend(&ctx, (void*)memA,size,0)<0){
 	    printf("Setup Send failed\n");
 	    return -1;
 	}
 
       // Setup copy from the S2MM interface to the DDR
-	if(setupRecvtoDDR(&dev, base_addr,size)<0){
+	if(setupRecvtoDDR(&ctx, base_addr,size)<0){
 	    printf("Setup Recv to DDR failed\n");
 	    return -1;
 	}
 	
-	// If buffer is bigger than 32768 rely on VSIZE
-	if(size > 32768)
-	  div_factor = size/32768;
-	
-	// Apply Linear pattern to the Send data
-	if( applyLinear_send(0, size/div_factor, size/div_factor, size) < 0){
-	  printf("Apply linear send failed\n");
+	// Send the data as mapped; segments above the 16-bit HSIZE are split into 2D descriptors
+	if(applySG_send(&ctx) < 0){
+	  printf("Apply SG send failed\n");
 	  return -1;
 	}
 	
-	// Apply Linear pattern to the Recv data
-	if(applyLinear_recv(0,size/div_factor, size/div_factor,size) < 0){  
-	  printf("Apply Linear recv failed\n");
+	// Same for the Recv data, written to the DDR
+	if(applySG_recv(&ctx) < 0){  
+	  printf("Apply SG recv failed\n");
 	  return -1;
 	}
       
 	// Start DMA engine. Start by enabling the S2MM so that it blocks waiting for the MM2S 
-	if(startRecv(&dev, 0) < 0)
+	if(startRecv(&ctx, 0) < 0)
 	printf("DMA Recv failed\n");
 	
 	// Now for the MM2S...
-	if(startSend(&dev, 0) < 0)
+	if(startSend(&ctx, 0) < 0)
 	printf("DMA Send failed\n");
 	
 	
@@ -139,18 +135,18 @@ genReset(mask);
 	
 	// Recv does not have a buffer associated
 	printf("Checking recv...\n");
-	if(checkRecvNoBuf() < 0)
+	if(checkRecvNoBuf(&ctx) < 0)
 	  printf("Check DMA recv failed\n");
 
 	printf("Checking send...\n");
-	if(checkSend() < 0)
+	if(checkSend(&ctx) < 0)
 	  printf("Check DMA send failed\n");
 	
-	freeSend(&dev);
+	freeSend(&ctx);
 	
 	
 	// No need to unmap because no user buffer was used
-	// freeRecv(&dev);
+	// freeRecv(&ctx);
 	
 	// Next 4 MB part
 	base_addr += 0x800000;
@@ -161,13 +157,13 @@ genReset(mask);
    // Test reset
  mask = 0xFFFFFFFF; // reset all cores
  printf("Activating reset\n");
- //genReset(mask);
+ //genReset(&ctx, mask);
  
  
 // Read Interrupt
   while(1)
   {
-    interrupt = getInterrupt();
+    interrupt = getInterrupt(&ctx);
     printf("Interrupts: %08x\n", interrupt);
     if(interrupt != 0)
       break;
@@ -179,7 +175,7 @@ genReset(mask);
   
   
  
-  stopDMA(&dev);
+  stopDMA(&ctx);
   
   free(memA); free(memB);
       
@@ -0,0 +1,164 @@
+#include "pciedma.h"
+#include "data_patterns.h"
+#include "dmabuf.h"
+#include "dmasim.h"
+#include "dmademux.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BUF_SIZE	65536		// Send buffer the frames are sliced from
+#define POOL_BUFS	16		// Receive buffers, enough to hold every fragment sent
+#define POOL_BUF_SIZE	4096		// Bytes per receive buffer; larger frames arrive in fragments
+#define NFRAMES		6
+#define NRUNS		3
+
+/* Frames sent in a row to three streams, two of them split over several receive buffers */
+dma_fanout frames[NFRAMES] = {
+  {0,     2000,  2000,  1, 1},
+  {4096,  6000,  6000,  1, 2},
+  {12288, 4096,  4096,  1, 3},
+  {20480, 100,   100,   1, 1},
+  {24576, 12288, 12288, 1, 2},
+  {40960, 300,   300,   1, 3}
+};
+
+/* Streams are read in the reverse order of arrival, so every queue has to hold its frames while the others are read */
+int streams[3] = {3, 2, 1};
+
+/* Takes the fragments of a frame from the queue of its stream and checks them against the slice sent
+ * Returns: number of errors
+ */
+int recvFrame(dma_demux *dmx, int key, dma_fanout *fr, unsigned char *mems)
+{
+  dma_frag frag;
+  unsigned int got = 0;
+  int errors = 0;
+
+  do{
+    if(demuxRecv(dmx, fr->tdest, &frag, 1) != 1){
+      printf("Receive on stream %d failed\n", fr->tdest);
+      return 1;
+    }
+
+    if((got == 0) != (frag.sof != 0))
+      errors++;
+    if((key == DEMUX_BY_TDEST ? frag.tdest : frag.tid) != fr->tdest)
+      errors++;
+    if(got + frag.len > fr->hsize || memcmp(frag.kb->vaddr, mems + fr->offset + got, frag.len) != 0)
+      errors++;
+    got += frag.len;
+
+    demuxRelease(dmx, &frag);
+  } while(!frag.eof && errors == 0);
+
+  if(got != fr->hsize)
+    errors++;
+  if(errors > 0)
+    printf("Frame at offset %d of stream %d received wrong\n", fr->offset, fr->tdest);
+
+  return errors;
+}
+
+/* Sends the frames to the loopback of the simulator and reads every stream back from its own queue
+ * Returns: number of errors
+ */
+int testKey(int key)
+{
+  dma_sim sim;
+  dma_ctx ctx;
+  dma_kpool pool;
+  dma_demux dmx;
+  dma_frag frag;
+  dma_reg *regs;
+  unsigned char *mems;
+  int i, k, run, errors = 0;
+
+  if(simOpen(&sim, NULL) != 0){
+    printf("Failed to start the simulated device\n");
+    return 1;
+  }
+
+  if(initDMAbackend(&ctx, &sim_ops, &sim) < 0){
+    printf("Init DMA failed\n");
+    simClose(&sim);
+    return 1;
+  }
+
+  if(posix_memalign((void**)&mems, 4096, BUF_SIZE) != 0){
+    printf("Buffer allocation failed\n");
+    return 1;
+  }
+  for(i = 0; i < BUF_SIZE; i++)
+    mems[i] = i*13 + 5;
+
+  if(registerBuffer(&ctx, mems, BUF_SIZE, &regs) < 0){
+    printf("Buffer registration failed\n");
+    return 1;
+  }
+
+  if(kpoolInit(&ctx, &pool, POOL_BUFS, POOL_BUF_SIZE) < 0 || demuxInit(&ctx, &dmx, &pool, key) < 0){
+    printf("Demux init failed\n");
+    return 1;
+  }
+
+  for(run = 0; run < NRUNS; run++){
+    if(setupSendReg(&ctx, regs, 0, BUF_SIZE, 0) < 0 || applyFanout_send(&ctx, frames, NFRAMES) < 0){
+      printf("Setup Send failed\n");
+      errors++;
+      break;
+    }
+
+    if(startSend(&ctx, 0) < 0 || checkSend(&ctx) < 0){
+      printf("DMA Send failed\n");
+      errors++;
+      break;
+    }
+
+    for(i = 0; i < 3; i++)
+      for(k = 0; k < NFRAMES; k++)
+        if(frames[k].tdest == streams[i])
+          errors += recvFrame(&dmx, key, &frames[k], mems);
+
+    // Nothing else may have been routed to any stream
+    for(i = 0; i < DEMUX_STREAMS; i++){
+      if(demuxRecv(&dmx, i, &frag, 0) != 0){
+        printf("Unexpected fragment on stream %d\n", i);
+        errors++;
+      }
+    }
+
+    freeSend(&ctx);
+  }
+
+  printf("Demultiplexing by %s: %s\n", key == DEMUX_BY_TDEST ? "TDEST" : "TID", errors ? "FAILED" : "ok");
+
+  demuxStop(&dmx);
+  kpoolFree(&pool);
+  unregisterBuffer(&ctx, regs);
+  stopDMA(&ctx);
+  simClose(&sim);
+  free(mems);
+
+  return errors;
+}
+
+int main(int argc, char **argv)
+{
+  int errors;
+
+ printf("====================================\n");
+ printf("=    Receive Demux Tests (sim)     =\n");
+ printf("====================================\n\n");
+
+ if(argc > 1){
+   printf("Usage: %s\n",argv[0]);
+   return -1;
+ }
+
+ errors = testKey(DEMUX_BY_TDEST);
+ errors += testKey(DEMUX_BY_TID);
+
+ return errors ? -1 : 0;
+}
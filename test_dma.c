@@ -13,6 +13,7 @@ int main(int argc, char **argv)
   int i,val,j;
   int size, new_size;
   pd_device_t dev;
+  dma_ctx ctx;
   void *memr, *memA, *memB, *mems, *mem_new;
   float throughput;
   struct timeval tv1,tv2;
@@ -34,7 +35,7 @@ int main(int argc, char **argv)
   printf("Device file opened successfuly\n");
   
   
- if(initDMA(&dev) < 0)
+ if(initDMA(&ctx, &dev) < 0)
    printf("Init DMA failed\n");
  
 
@@ -54,13 +55,13 @@ int main(int argc, char **argv)
 gettimeofday(&tv1,NULL); 
 
       // Setup copy from the host memory to the MM2S interface
-	if(setupSend(&dev, (void*)mems,size,0)<0){
+	if(setupSend(&ctx, (void*)mems,size,0)<0){
 	    printf("Setup Send failed\n");
 	    return -1;
 	}
 
       // Setup copy from the S2MM interface to the DDR
-	if(setupRecvtoDDR(&dev, base_addr,size)<0){
+	if(setupRecvtoDDR(&ctx, base_addr,size)<0){
 	    printf("Setup Recv to DDR failed\n");
 	    return -1;
 	}
@@ -70,13 +71,13 @@ gettimeofday(&tv1,NULL);
           div_factor = size/32768;
     
         // Apply Linear pattern to the Send data
-        if( applyLinear_send(0, size/div_factor, size/div_factor, size) < 0){ 
+        if( applyLinear_send(&ctx, 0, size/div_factor, size/div_factor, size) < 0){ 
           printf("Apply linear send failed\n");
           return -1; 
         }   
     
         // Apply Linear pattern to the Recv data
-        if(applyLinear_recv(0,size/div_factor, size/div_factor,size) < 0){  
+        if(applyLinear_recv(&ctx, 0,size/div_factor, size/div_factor,size) < 0){  
           printf("Apply Linear recv failed\n");
           return -1; 
         }   
@@ -90,7 +91,7 @@ gettimeofday(&tv2,NULL);
 
     
         // Start DMA engine. Start by enabling the S2MM so that it blocks waiting for the MM2S 
-        if(startRecv(&dev, 0) < 0)
+        if(startRecv(&ctx, 0) < 0)
         printf("DMA Recv failed\n");
 
 	
@@ -98,18 +99,18 @@ gettimeofday(&tv2,NULL);
 	    
         
 	// Now for the MM2S...
-        if(startSend(&dev, 0) < 0)
+        if(startSend(&ctx, 0) < 0)
         printf("DMA Send failed\n");
 	
 	// Check completion of the transfers
 	
 	// Recv does not have a buffer associated
 	printf("Checking recv...\n");
-	if(checkRecvNoBuf() < 0)
+	if(checkRecvNoBuf(&ctx) < 0)
 	  printf("Check DMA recv failed\n");
 
 	printf("Checking send...\n");
-	if(checkSend() < 0)
+	if(checkSend(&ctx) < 0)
 	  printf("Check DMA send failed\n");
 	
 	gettimeofday(&tv2,NULL);
@@ -117,12 +118,12 @@ gettimeofday(&tv2,NULL);
 	curtime = tv2.tv_usec - tv1.tv_usec;
 	printf("Time elapsed : %d\n",curtime);
 
-	freeSend(&dev);
+	freeSend(&ctx);
 	
 	
 
  
-  stopDMA(&dev);
+  stopDMA(&ctx);
   
   free(mems); //free(memr);
       
@@ -13,6 +13,7 @@ int main(int argc, char **argv)
   int i,val,j;
   int size, new_size;
   pd_device_t dev;
+  dma_ctx ctx;
   void *memr, *mems, *mem_new;
   float throughput;
   struct timeval tv1,tv2;
@@ -90,7 +91,7 @@ for(i=1; i < 16; i++)
 
 //--------------------------
  
- if(initDMA(&dev) < 0)
+ if(initDMA(&ctx, &dev) < 0)
    printf("Init DMA failed\n");
  
  // Send and receive in simultaneous
@@ -98,19 +99,19 @@ for(i=1; i < 16; i++)
 gettimeofday(&tv1,NULL);  
 
 #ifdef SEND
-if(setupSend(&dev, (void*)mems, size,1) < 0)
+if(setupSend(&ctx, (void*)mems, size,1) < 0)
   printf("Setup Send failed\n");
 
-	if(applyBlocking_send(16, 32, 4) < 0)
+	if(applyBlocking_send(&ctx, 16, 32, 4) < 0)
 	 printf("Apply Blocking send failed\n");
 #endif
- if(setupRecv(&dev, (void*)memr, size) < 0)
+ if(setupRecv(&ctx, (void*)memr, size) < 0)
    printf("Setup Recv failed\n");
 
 
-//int applyLinear_recv(int offset, int hsize, int stride, int total_size);
-//	if(applyBlocking_recv(16, 32, 4) < 0)
-	if(applyLinear_recv(0,128,128,4096) < 0)  
+//int applyLinear_recv(&ctx, int offset, int hsize, int stride, int total_size);
+//	if(applyBlocking_recv(&ctx, 16, 32, 4) < 0)
+	if(applyLinear_recv(&ctx, 0,128,128,4096) < 0)  
  	 printf("Apply Blocking recv failed\n");
 
 
@@ -122,23 +123,23 @@ if(setupSend(&dev, (void*)mems, size,1) < 0)
 
   gettimeofday(&tv1,NULL);  
 #ifdef SEND
- //if(startSend(&dev, 0) < 0)
+ //if(startSend(&ctx, 0) < 0)
  //  printf("DMA Send failed\n");
 #endif
  // printf("Press any key to continue ;)\n");
  // getchar();
 
-  if(startRecv(&dev, 0) < 0)
+  if(startRecv(&ctx, 0) < 0)
    printf("DMA Recv failed\n");
  
-  if(startSend(&dev, 0) < 0)
+  if(startSend(&ctx, 0) < 0)
    printf("DMA Send failed\n");
    
 
-   if(checkRecv() < 0)
+   if(checkRecv(&ctx) < 0)
     printf("Check DMA recv failed\n");
 #ifdef SEND
-   if(checkSend() < 0)
+   if(checkSend(&ctx) < 0)
     printf("Check DMA send failed\n");
 #endif
 
@@ -159,11 +160,11 @@ if(setupSend(&dev, (void*)mems, size,1) < 0)
     printf("%d ", ((int*)memr)[i]);
   } 
   
- freeSend(&dev);
+ freeSend(&ctx);
 
- freeRecv(&dev);
+ freeRecv(&ctx);
  
- stopDMA(&dev);
+ stopDMA(&ctx);
  
  //for(i=0;i<size/4;i++)
  // printf("%d ",((unsigned int*)memr)[i]);